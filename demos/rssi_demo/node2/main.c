@@ -27,6 +27,7 @@
 
 #include <asf.h>
 #include "mac/mac.h"
+#include "xbee/xbee_cpu.h"
 #include "radio/radio.h"
 #include "message.h"
 
@@ -54,18 +55,24 @@ void main(void)
 	//signal initialization went fine.
 	ioport_set_pin_level( IOPORT_CREATE_PIN(PIOC, 23), LED_ON );
 	
+	//the MAC is polled while waiting (it sends what's queued, and handles acks)
 	while(1){
 		task_msgsend();
 		task_ledblink();
 		
-		delay_ms(blink_wait);
+		uint32_t start_ms = xbee_cpu_get_ms();
+		
+		while( xbee_cpu_get_ms() - start_ms < blink_wait )
+			mac_poll();
 	}
 }
 
 void task_msgsend(void){
 	//sends a message every now and then
 	Message msg;
+	uint8_t payload[1];
 	msg.address = ADDRESSEE_NODE;			//Addressee node
+	msg.data = payload;					//payload buffer
 	msg.data[0] = 7;						//send anything (random value)
 	msg.data_length = 1;					//we're sending one byte
 	mac_send(&msg);
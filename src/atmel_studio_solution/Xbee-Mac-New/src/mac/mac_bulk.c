@@ -0,0 +1,869 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	mac_bulk.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Reliable bulk transfer over the MAC (sliding window, selective acks).
+ *
+ * A transfer is split in segments of MAC_BULK_SEGMENT_LENGTH bytes, numbered
+ * from 0. The sender keeps up to a window of segments unacked; the receiver
+ * buffers those that arrive out of order, hands the data to the app in order,
+ * and answers with SACKs: the next segment it expects, plus a bitmap of the 32
+ * segments after it that it already has. Segments are only sent again when a
+ * SACK shows a gap (a segment sent after them arrived, so they were lost), or
+ * when no SACK makes progress for a retransmission timeout (then only the 
+ * oldest one is, to draw a SACK). The timeout follows the round trip time
+ * measured, and doubles after every timeout. Only built with MAC_BULK_TRANSFER (mac.c routes
+ * segments and SACKs here, and not to the app).
+ */
+
+#include <stdint-gcc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "xbee/xbee_cpu.h"
+#include "mac.h"
+#include "mac_bulk.h"
+#include "mac_config.h"
+
+#ifdef MAC_BULK_TRANSFER
+
+#define TYPE_SACK			0x01	///< Segment type flag: SACK (otherwise data)
+#define TYPE_LAST			0x02	///< Segment type flag: last segment of the transfer
+#define TYPE_ACK_REQUEST	0x04	///< Segment type flag: SACK wanted right away
+#define SACK_LENGTH			9		///< SACK: tag, type, transfer ID, next segment expected (2 bytes), bitmap (4 bytes)
+#define TX_HANDLES			2		///< Segments handed to the MAC at once (one waiting for its ack, the next one queued behind it)
+#define RTO_INITIAL			1000	///< ms without SACK progress after which the oldest segment unacked is sent again, until the round trip time is measured
+#define RTO_MIN				50		///< Min retransmission timeout, in ms (twice the smoothed round trip time, plus this)
+#define RTO_MAX				4000	///< Max retransmission timeout, in ms (it doubles after every timeout)
+#define GIVE_UP_TIMEOUT		10000	///< ms without SACK progress after which a transfer is given up on
+#define ACK_DELAY			200		///< Max ms a receiver holds back a SACK for segments received in order
+#define RX_SESSION_TIMEOUT	15000	///< ms without segments after which a receive session is ended (given up on, unless it's done). Longer than GIVE_UP_TIMEOUT
+
+typedef struct{ ///< Segment (or SACK) handed to the MAC, waiting for its TX status
+	Message msg;		///< message handle, as passed to mac_send_prio
+	bool used;			///< whether it's waiting for its TX status
+	uint8_t id;			///< transfer ID
+}BulkHandle;
+
+typedef struct{ ///< Transfer being sent. Bitmaps are relative to base (bit i = segment base + i)
+	bool active;						///< whether a transfer is being sent
+	const uint8_t* data;				///< the data (the app's buffer)
+	uint32_t length;					///< data length
+	uint16_t address;					///< destination
+	uint8_t id;							///< transfer ID
+	uint8_t window;						///< max segments sent and not acked
+	uint8_t since_ack_request;			///< segments sent since the last one that asked for a SACK
+	uint16_t n_segments;				///< segments in all
+	uint16_t base;						///< oldest segment not acked
+	uint16_t next;						///< next segment never sent
+	uint32_t sacked;					///< segments acked out of order (bitmap)
+	uint32_t lost;						///< segments to send again (bitmap)
+	uint32_t stamp[MAC_BULK_MAX_WINDOW];///< when each segment was last handed to the MAC (a count of segments handed over, by segment number modulo the window)
+	uint32_t next_stamp;				///< next stamp
+	uint32_t high_stamp;				///< stamp of the segment last handed over that's been acked (those handed over before it and not acked were lost)
+	uint32_t start_ms;					///< when the transfer started
+	uint32_t progress_ms;				///< when a SACK last acked something new
+	uint32_t timer_ms;					///< when the retransmission timer started (progress, or the last timeout)
+	uint32_t rto_ms;					///< retransmission timeout
+	uint32_t srtt_ms;					///< smoothed round trip time (0 = not measured yet)
+	bool rtt_timing;					///< whether a segment's round trip is being timed
+	uint32_t rtt_stamp;					///< its stamp
+	uint32_t rtt_start_ms;				///< when it was handed to the MAC
+}BulkTx;
+
+typedef struct{ ///< Transfer being received. Bitmaps are relative to base (bit i = segment base + i)
+	bool used;										///< whether the session is in use
+	bool done;										///< whether the last segment was handed to the app (then the session only answers duplicates, until it times out)
+	bool sack_due;									///< whether a SACK must be sent (from mac_bulk_poll)
+	bool last_known;								///< whether the last segment was received
+	uint16_t address;								///< source (the key)
+	uint8_t id;										///< transfer ID
+	uint8_t unacked;								///< segments received since the last SACK
+	uint16_t base;									///< next segment expected in order
+	uint16_t last;									///< number of the last segment (once last_known)
+	uint32_t received;								///< segments received out of order, waiting for the gaps before them (bitmap)
+	uint32_t last_ms;								///< when a segment last arrived
+	uint32_t unacked_ms;							///< when the oldest segment not SACKed yet arrived
+	uint8_t lengths[MAC_BULK_MAX_WINDOW];			///< length of each segment buffered (by segment number modulo the window)
+	uint8_t data[MAC_BULK_MAX_WINDOW][MAC_BULK_SEGMENT_LENGTH];	///< segments buffered
+	BulkHandle sack;								///< its SACK handle
+}BulkRx;
+
+//Bulk transfer to App callbacks
+static void (*app_data_received_callback)(uint16_t, uint32_t, uint8_t*, uint32_t, bool);	///< data received (in order) callback
+static void (*app_transfer_sent_callback)(uint16_t, bool);								///< transfer sent (or given up on) callback
+
+static BulkTx tx;
+static BulkHandle tx_handles[TX_HANDLES];
+static uint8_t tx_window = MAC_BULK_MAX_WINDOW;
+static uint8_t next_id = 0;
+static volatile bool tx_pumping = false;		///< whether bulk_pump is running (it isn't reentrant)
+static uint8_t tx_buffer[MSG_MAX_LENGTH];		///< segment or SACK being handed to the MAC (which copies it)
+static BulkRx rx_sessions[MAC_BULK_RX_SESSIONS];
+static MacBulkStats stats;
+
+static void bulk_pump(void);
+static void tx_finish(bool);
+static void tx_advance(void);
+static void sack_received(Message*);
+static void segment_received(Message*);
+static void rx_deliver(BulkRx*);
+static void rx_send_sack(BulkRx*);
+static BulkRx* rx_session_get(uint16_t, uint8_t);
+static bool rx_session_expired(BulkRx*, uint32_t);
+static uint16_t read_u16(uint8_t*);
+static void write_u16(uint8_t*, uint16_t);
+
+
+
+/**
+*	Bulk transfer init.
+*
+*	Initializes the bulk transfer engine. To be called after mac_init.
+*
+*	@param received_callback called with the source, the offset, the data and its length as
+*							data is received, in order. The last argument tells whether
+*							it's the end of the transfer. The data is only valid until the
+*							callback returns
+*	@param sent_callback called with the destination when every segment of a transfer is
+*						acked (true), or when it's given up on (false). The data buffer
+*						can be reused then
+*/
+void mac_bulk_init( void(*received_callback)(uint16_t, uint32_t, uint8_t*, uint32_t, bool), void(*sent_callback)(uint16_t, bool) ){
+	app_data_received_callback = received_callback;
+	app_transfer_sent_callback = sent_callback;
+}
+
+/**
+*	Set window.
+*
+*	Sets how many segments can be sent and not acked yet, for the transfers
+*	started from now on. Larger windows keep the link busier while SACKs are on
+*	their way, and ride out more losses without waiting.
+*
+*	@param window the window (1 to MAC_BULK_MAX_WINDOW)
+*
+*	@return true if it was set, false if it's out of range
+*/
+bool mac_bulk_set_window( uint8_t window ){
+	if( window == 0 || window > MAC_BULK_MAX_WINDOW )
+		return false;
+	
+	tx_window = window;
+	
+	return true;
+}
+
+/**
+*	Bulk send.
+*
+*	Sends data to a destination reliably, in segments of MAC_BULK_SEGMENT_LENGTH
+*	bytes (with priority MAC_PRIO_BULK), keeping up to a window of them unacked
+*	(see mac_bulk_set_window). The data is NOT copied: the buffer must be left
+*	alone until sent_callback (see mac_bulk_init) is called. Segments (and
+*	SACKs) are only sent from mac_poll (call it often), never from the USART1
+*	handler, where this might be called from (a callback). The transfer is
+*	given up on after GIVE_UP_TIMEOUT ms without SACK progress, or
+*	right away if the destination is deemed unreachable.
+*
+*	@param address the destination (not the broadcast address: the receiver must SACK)
+*	@param data the data
+*	@param length its length (1 to MAC_BULK_MAX_LENGTH)
+*
+*	@return true if the data is being sent, false if another transfer still is, or the
+*			data is too long (or empty), or the address is the broadcast address
+*/
+bool mac_bulk_send( uint16_t address, const uint8_t* data, uint32_t length ){
+	if( length == 0 || length > MAC_BULK_MAX_LENGTH || address == MSG_BROADCAST_ADDRESS )
+		return false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	if( tx.active ){
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	tx.active = true;
+	tx.data = data;
+	tx.length = length;
+	tx.address = address;
+	tx.id = next_id++;
+	tx.window = tx_window;
+	tx.since_ack_request = 0;
+	tx.n_segments = (length + MAC_BULK_SEGMENT_LENGTH - 1) / MAC_BULK_SEGMENT_LENGTH;
+	tx.base = 0;
+	tx.next = 0;
+	tx.sacked = 0;
+	tx.lost = 0;
+	tx.next_stamp = 1;
+	tx.high_stamp = 0;
+	tx.start_ms = xbee_cpu_get_ms();
+	tx.progress_ms = tx.start_ms;
+	tx.timer_ms = tx.start_ms;
+	tx.rto_ms = RTO_INITIAL;
+	tx.srtt_ms = 0;
+	tx.rtt_timing = false;
+	
+	xbee_cpu_exit_critical(state);
+	
+	return true;
+}
+
+/**
+*	Bulk message received.
+*
+*	Called by the MAC with every message received: takes segments and SACKs.
+*
+*	@param msg the message received
+*
+*	@return true if it was a segment or a SACK (not for the app), false otherwise
+*/
+bool mac_bulk_msg_received( Message* msg ){
+	if( msg->data_length == 0 || msg->data[0] != MAC_BULK_TAG )
+		return false;
+	
+	if( msg->data_length < MAC_BULK_HEADER_LENGTH ){
+		stats.rx_invalid++;
+		return true;
+	}
+	
+	if( msg->data[1] & TYPE_SACK )
+		sack_received(msg);
+	else
+		segment_received(msg);
+	
+	return true;
+}
+
+/**
+*	Bulk TX status.
+*
+*	Called by the MAC with every TX status. Segments lost on the air are sent
+*	again as SACKs show them missing, not from here: only a destination deemed
+*	unreachable ends the transfer.
+*
+*	@param msg the message handle
+*	@param status its TX status
+*
+*	@return true if it was a segment or a SACK (not for the app), false otherwise
+*/
+bool mac_bulk_tx_status( Message* msg, uint8_t status ){
+	BulkHandle* handle = NULL;
+	
+	for( uint32_t i=0; i<TX_HANDLES; i++ )
+		if( &tx_handles[i].msg == msg )
+			handle = &tx_handles[i];
+	
+	for( uint32_t s=0; s<MAC_BULK_RX_SESSIONS; s++ )
+		if( &rx_sessions[s].sack.msg == msg )
+			return true;
+	
+	if( !handle )
+		return false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	bool unreachable = tx.active && status == MSG_ACK_UNREACHABLE && handle->id == tx.id;
+	uint16_t address = tx.address;
+	
+	handle->used = false;
+	
+	if( unreachable )
+		tx_finish(false);
+	
+	xbee_cpu_exit_critical(state);
+	
+	if( unreachable )
+		(*app_transfer_sent_callback)( address, false );
+	
+	return true;
+}
+
+/**
+*	Bulk poll.
+*
+*	Called from mac_poll: sends the oldest segment unacked again when SACKs
+*	stopped making progress (or gives up), sends the SACKs due, ends receive
+*	sessions whose segments stopped arriving, and sends the segments waiting
+*	(new ones, or to send again).
+*/
+void mac_bulk_poll(void){
+	uint32_t now = xbee_cpu_get_ms();
+	bool failed = false;
+	uint32_t state = xbee_cpu_enter_critical();
+	uint16_t address = tx.address;
+	
+	if( tx.active && now - tx.progress_ms >= GIVE_UP_TIMEOUT ){
+		tx_finish(false);
+		failed = true;
+	}
+	else if( tx.active && tx.next != tx.base && now - tx.timer_ms >= tx.rto_ms ){
+		tx.lost |= 1;
+		tx.timer_ms = now;
+		tx.rto_ms = (tx.rto_ms * 2 > RTO_MAX) ? RTO_MAX : tx.rto_ms * 2;
+		stats.tx_timeouts++;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	if( failed )
+		(*app_transfer_sent_callback)( address, false );
+	
+	for( uint32_t s=0; s<MAC_BULK_RX_SESSIONS; s++ ){
+		BulkRx* session = &rx_sessions[s];
+		
+		state = xbee_cpu_enter_critical();
+		
+		if( rx_session_expired(session, now) )
+			session->used = false;
+		
+		if( session->used && session->unacked > 0 && now - session->unacked_ms >= ACK_DELAY )
+			session->sack_due = true;
+		
+		bool sack_due = session->used && session->sack_due;
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( sack_due )
+			rx_send_sack(session);
+	}
+	
+	bulk_pump();
+}
+
+/**
+*	Bulk transfer statistics.
+*
+*	@param out where statistics are copied
+*/
+void mac_bulk_get_stats( MacBulkStats* out ){
+	uint32_t state = xbee_cpu_enter_critical();
+	*out = stats;
+	xbee_cpu_exit_critical(state);
+}
+
+
+//  L O C A L    F U N C T I O N S
+
+/**
+*	Bulk pump
+*
+*	Hands segments to the MAC, as long as a handle is free and the MAC takes
+*	them: first those to send again, then new ones while the window allows. A
+*	segment asks for a SACK right away when half a window went without asking,
+*	when it fills the window, when it's the last one, or when it's sent again.
+*	Only called from mac_bulk_poll, in the main loop: segments are never
+*	serialized from the USART1 handler (it could be in the middle of another
+*	frame, and UART waits can't time out there). Not reentrant: a call made
+*	while it runs (a callback calling mac_poll) leaves the work to it.
+*/
+static void bulk_pump(void){
+	uint32_t state = xbee_cpu_enter_critical();
+	bool busy = tx_pumping;
+	
+	tx_pumping = true;
+	xbee_cpu_exit_critical(state);
+	
+	if( busy )
+		return;
+	
+	while( true ){
+		BulkHandle* handle = NULL;
+		uint16_t seq = 0;
+		bool resend = false;
+		bool found = false;
+		
+		state = xbee_cpu_enter_critical();
+		
+		for( uint32_t i=0; i<TX_HANDLES && tx.active; i++ ){
+			if( !tx_handles[i].used ){
+				handle = &tx_handles[i];
+				break;
+			}
+		}
+		
+		if( handle && tx.lost ){
+			uint32_t i = 0;
+			while( !(tx.lost & (1UL << i)) )
+				i++;
+			
+			tx.lost &= ~(1UL << i);
+			seq = tx.base + i;
+			resend = found = true;
+			
+			//(Karn: the round trip of a segment sent twice can't be told)
+			tx.rtt_timing = false;
+		}
+		else if( handle && tx.next < tx.n_segments && (uint16_t)(tx.next - tx.base) < tx.window ){
+			seq = tx.next++;
+			found = true;
+		}
+		
+		uint8_t type = 0;
+		
+		if( found ){
+			handle->used = true;
+			handle->id = tx.id;
+			tx.stamp[seq % MAC_BULK_MAX_WINDOW] = tx.next_stamp++;
+			
+			if( seq == tx.n_segments - 1 )
+				type |= TYPE_LAST;
+			
+			if( resend || seq == tx.n_segments - 1 || (uint16_t)(tx.next - tx.base) >= tx.window ||
+				++tx.since_ack_request >= (tx.window + 1) / 2 ){
+				type |= TYPE_ACK_REQUEST;
+				tx.since_ack_request = 0;
+				
+				if( !resend && !tx.rtt_timing ){
+					tx.rtt_timing = true;
+					tx.rtt_stamp = tx.stamp[seq % MAC_BULK_MAX_WINDOW];
+					tx.rtt_start_ms = xbee_cpu_get_ms();
+				}
+			}
+		}
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( !found )
+			break;
+		
+		uint32_t offset = (uint32_t)seq * MAC_BULK_SEGMENT_LENGTH;
+		uint32_t length = (tx.length - offset > MAC_BULK_SEGMENT_LENGTH) ? MAC_BULK_SEGMENT_LENGTH : tx.length - offset;
+		
+		tx_buffer[0] = MAC_BULK_TAG;
+		tx_buffer[1] = type;
+		tx_buffer[2] = tx.id;
+		write_u16( &tx_buffer[3], seq );
+		for( uint32_t i=0; i<length; i++ )
+			tx_buffer[MAC_BULK_HEADER_LENGTH + i] = tx.data[offset + i];
+		
+		handle->msg.address = tx.address;
+		handle->msg.data = tx_buffer;
+		handle->msg.data_length = MAC_BULK_HEADER_LENGTH + length;
+		
+		//(its TX status might be reported before this returns)
+		if( mac_send_prio( &handle->msg, MAC_PRIO_BULK ) ){
+			stats.tx_segments++;
+			if( resend )
+				stats.tx_retransmissions++;
+			continue;
+		}
+		
+		//MAC queue full, try again later
+		state = xbee_cpu_enter_critical();
+		handle->used = false;
+		if( resend )
+			tx.lost |= 1UL << (uint16_t)(seq - tx.base);
+		else
+			tx.next--;
+		xbee_cpu_exit_critical(state);
+		break;
+	}
+	
+	tx_pumping = false;
+}
+
+/**
+*	TX finish
+*
+*	Ends the transfer being sent (sent_callback is due). To be called within a
+*	critical section.
+*
+*	@param acked whether every segment was acked
+*/
+static void tx_finish(bool acked){
+	tx.active = false;
+	
+	if( acked ){
+		stats.tx_transfers++;
+		stats.tx_bytes += tx.length;
+		stats.tx_last_bytes = tx.length;
+		stats.tx_last_ms = xbee_cpu_get_ms() - tx.start_ms;
+	}
+	else{
+		stats.tx_transfers_failed++;
+	}
+}
+
+/**
+*	TX advance
+*
+*	Slides the window past the segments acked at its start. To be called
+*	within a critical section.
+*/
+static void tx_advance(void){
+	while( tx.base != tx.next && (tx.sacked & 1) ){
+		tx.sacked >>= 1;
+		tx.lost >>= 1;
+		tx.base++;
+	}
+}
+
+/**
+*	SACK received
+*
+*	Acks the segments the receiver has: those before the next one it expects,
+*	and those in its bitmap. Segments not acked that were handed to the MAC
+*	before one that's acked now were lost: they're sent again (once per gap
+*	seen, as they're stamped again when sent). Progress restarts the
+*	retransmission timer, with a timeout of twice the smoothed round trip time
+*	(plus RTO_MIN).
+*
+*	@param msg the SACK
+*/
+static void sack_received(Message* msg){
+	bool done = false;
+	uint16_t address = msg->address;
+	
+	if( msg->data_length != SACK_LENGTH ){
+		stats.rx_invalid++;
+		return;
+	}
+	
+	uint8_t id = msg->data[2];
+	uint16_t expected = read_u16( &msg->data[3] );
+	uint32_t bitmap = msg->data[5] | ((uint32_t)msg->data[6] << 8) | ((uint32_t)msg->data[7] << 16) | ((uint32_t)msg->data[8] << 24);
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	//(SACKs of an earlier transfer, or late ones of this one)
+	if( !tx.active || msg->address != tx.address || id != tx.id ||
+		(uint16_t)(expected - tx.base) > (uint16_t)(tx.next - tx.base) ){
+		xbee_cpu_exit_critical(state);
+		return;
+	}
+	
+	stats.tx_sacks++;
+	
+	uint32_t before = tx.sacked;
+	uint16_t base = tx.base;
+	
+	for( uint16_t seq=tx.base; seq!=tx.next; seq++ ){
+		uint16_t i = seq - base;
+		bool acked = (uint16_t)(seq - expected) >= 0x8000 ||
+					 ( seq != expected && (uint16_t)(seq - expected - 1) < 32 && (bitmap >> (uint16_t)(seq - expected - 1)) & 1 );
+		
+		if( acked && !(tx.sacked & (1UL << i)) ){
+			tx.sacked |= 1UL << i;
+			tx.lost &= ~(1UL << i);
+			
+			if( tx.stamp[seq % MAC_BULK_MAX_WINDOW] > tx.high_stamp )
+				tx.high_stamp = tx.stamp[seq % MAC_BULK_MAX_WINDOW];
+		}
+	}
+	
+	if( tx.sacked != before ){
+		uint32_t now = xbee_cpu_get_ms();
+		
+		if( tx.rtt_timing && tx.high_stamp >= tx.rtt_stamp ){
+			uint32_t rtt = now - tx.rtt_start_ms;
+			
+			tx.srtt_ms = (tx.srtt_ms == 0) ? rtt : (7 * tx.srtt_ms + rtt) / 8;
+			tx.rtt_timing = false;
+		}
+		
+		if( tx.srtt_ms > 0 )
+			tx.rto_ms = (2 * tx.srtt_ms + RTO_MIN > RTO_MAX) ? RTO_MAX : 2 * tx.srtt_ms + RTO_MIN;
+		
+		tx.progress_ms = now;
+		tx.timer_ms = now;
+	}
+	
+	//the gaps
+	for( uint16_t seq=tx.base; seq!=tx.next; seq++ ){
+		uint16_t i = seq - base;
+		
+		if( !(tx.sacked & (1UL << i)) && !(tx.lost & (1UL << i)) && tx.stamp[seq % MAC_BULK_MAX_WINDOW] < tx.high_stamp )
+			tx.lost |= 1UL << i;
+	}
+	
+	tx_advance();
+	
+	if( tx.base == tx.n_segments ){
+		tx_finish(true);
+		done = true;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	if( done )
+		(*app_transfer_sent_callback)( address, true );
+}
+
+/**
+*	Segment received
+*
+*	Buffers a segment in its session, hands what's now in order to the app,
+*	and marks a SACK due (for mac_bulk_poll) if the sender asked for one, or if
+*	something's amiss (a gap, a duplicate, a segment beyond the window). A segment of a newer
+*	transfer ends the source's earlier one (segments of older ones are dropped).
+*
+*	@param msg the segment
+*/
+static void segment_received(Message* msg){
+	uint8_t type = msg->data[1];
+	uint8_t id = msg->data[2];
+	uint16_t seq = read_u16( &msg->data[3] );
+	uint32_t length = msg->data_length - MAC_BULK_HEADER_LENGTH;
+	
+	stats.rx_segments++;
+	
+	//all segments but the last one are full
+	if( length == 0 || (!(type & TYPE_LAST) && length != MAC_BULK_SEGMENT_LENGTH) ){
+		stats.rx_invalid++;
+		return;
+	}
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	BulkRx* session = rx_session_get( msg->address, id );
+	
+	if( !session ){
+		stats.rx_busy++;
+		xbee_cpu_exit_critical(state);
+		return;
+	}
+	
+	//(a late segment of an earlier transfer)
+	if( session->id != id ){
+		stats.rx_duplicates++;
+		xbee_cpu_exit_critical(state);
+		return;
+	}
+	
+	uint16_t i = seq - session->base;
+	
+	session->last_ms = xbee_cpu_get_ms();
+	
+	if( session->done || i >= 0x8000 || (session->received & (1UL << i)) ){
+		stats.rx_duplicates++;
+		session->sack_due = true;
+	}
+	else if( i >= MAC_BULK_MAX_WINDOW ){
+		stats.rx_out_of_window++;
+		session->sack_due = true;
+	}
+	else{
+		uint8_t* slot = session->data[seq % MAC_BULK_MAX_WINDOW];
+		
+		for( uint32_t b=0; b<length; b++ )
+			slot[b] = msg->data[MAC_BULK_HEADER_LENGTH + b];
+		
+		session->lengths[seq % MAC_BULK_MAX_WINDOW] = length;
+		session->received |= 1UL << i;
+		
+		if( type & TYPE_LAST ){
+			session->last_known = true;
+			session->last = seq;
+		}
+		
+		if( session->unacked++ == 0 )
+			session->unacked_ms = session->last_ms;
+		
+		if( i != 0 || (type & TYPE_ACK_REQUEST) )
+			session->sack_due = true;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	rx_deliver(session);
+}
+
+/**
+*	RX deliver
+*
+*	Hands the segments buffered at the start of the window to the app, in
+*	order, and slides the window past them.
+*
+*	@param session the session
+*/
+static void rx_deliver(BulkRx* session){
+	while( true ){
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( !session->used || session->done || !(session->received & 1) ){
+			xbee_cpu_exit_critical(state);
+			break;
+		}
+		
+		uint16_t seq = session->base;
+		bool last = session->last_known && seq == session->last;
+		
+		xbee_cpu_exit_critical(state);
+		
+		//(the slot isn't overwritten until the window slides past it)
+		uint32_t length = session->lengths[seq % MAC_BULK_MAX_WINDOW];
+		(*app_data_received_callback)( session->address, (uint32_t)seq * MAC_BULK_SEGMENT_LENGTH,
+			session->data[seq % MAC_BULK_MAX_WINDOW], length, last );
+		
+		state = xbee_cpu_enter_critical();
+		
+		session->received >>= 1;
+		session->base++;
+		stats.rx_bytes += length;
+		
+		if( last ){
+			session->done = true;
+			session->sack_due = true;
+			stats.rx_transfers++;
+		}
+		
+		xbee_cpu_exit_critical(state);
+	}
+}
+
+/**
+*	RX send SACK
+*
+*	Sends a session's SACK: the next segment expected, and the bitmap of the
+*	32 after it. Only called from mac_bulk_poll (see bulk_pump). If the MAC's
+*	queue is full, it's left due for the next call.
+*
+*	@param session the session
+*/
+static void rx_send_sack(BulkRx* session){
+	uint8_t sack[SACK_LENGTH];
+	uint32_t state = xbee_cpu_enter_critical();
+	uint32_t bitmap = session->received >> 1;
+	
+	sack[0] = MAC_BULK_TAG;
+	sack[1] = TYPE_SACK;
+	sack[2] = session->id;
+	write_u16( &sack[3], session->base );
+	sack[5] = bitmap;
+	sack[6] = bitmap >> 8;
+	sack[7] = bitmap >> 16;
+	sack[8] = bitmap >> 24;
+	
+	session->sack_due = false;
+	session->unacked = 0;
+	
+	xbee_cpu_exit_critical(state);
+	
+	session->sack.msg.address = session->address;
+	session->sack.msg.data = sack;
+	session->sack.msg.data_length = SACK_LENGTH;
+	
+	if( mac_send_prio( &session->sack.msg, MAC_PRIO_BULK ) )
+		stats.rx_sacks++;
+	else
+		session->sack_due = true;
+}
+
+/**
+*	RX session get
+*
+*	Finds the session of a transfer, or starts one for it: in place of the
+*	source's earlier transfer, or in a free session, or else in one that's done
+*	or timed out. Transfer IDs rotate: an ID behind the source's session's is
+*	an earlier transfer, and gets that session (to be told apart by its ID).
+*	To be called within a critical section.
+*
+*	@param address the source
+*	@param id the transfer ID
+*
+*	@return the session, or NULL if all are busy with other sources
+*/
+static BulkRx* rx_session_get(uint16_t address, uint8_t id){
+	BulkRx* session = NULL;
+	uint32_t now = xbee_cpu_get_ms();
+	
+	for( uint32_t s=0; s<MAC_BULK_RX_SESSIONS; s++ ){
+		if( rx_sessions[s].used && rx_sessions[s].address == address ){
+			if( (int8_t)(id - rx_sessions[s].id) <= 0 )
+				return &rx_sessions[s];
+			
+			session = &rx_sessions[s];
+			if( !session->done )
+				stats.rx_timeouts++;
+		}
+	}
+	
+	for( uint32_t s=0; s<MAC_BULK_RX_SESSIONS && !session; s++ )
+		if( !rx_sessions[s].used )
+			session = &rx_sessions[s];
+	
+	for( uint32_t s=0; s<MAC_BULK_RX_SESSIONS && !session; s++ )
+		if( rx_sessions[s].done || rx_session_expired(&rx_sessions[s], now) )
+			session = &rx_sessions[s];
+	
+	if( !session )
+		return NULL;
+	
+	session->used = true;
+	session->done = false;
+	session->sack_due = false;
+	session->last_known = false;
+	session->address = address;
+	session->id = id;
+	session->unacked = 0;
+	session->base = 0;
+	session->received = 0;
+	session->last_ms = now;
+	
+	return session;
+}
+
+/**
+*	RX session expired
+*
+*	Tells whether a session timed out (RX_SESSION_TIMEOUT ms without segments),
+*	accounting for it if it wasn't done: the session is to be reused. To be
+*	called within a critical section.
+*
+*	@param session the session
+*	@param now the current time, in ms
+*
+*	@return true if it timed out
+*/
+static bool rx_session_expired(BulkRx* session, uint32_t now){
+	if( !session->used || now - session->last_ms < RX_SESSION_TIMEOUT )
+		return false;
+	
+	if( !session->done )
+		stats.rx_timeouts++;
+	
+	return true;
+}
+
+/**
+*	Read 16-bit
+*
+*	@param buffer where the number is (little endian)
+*
+*	@return the number
+*/
+static uint16_t read_u16(uint8_t* buffer){
+	return buffer[0] | (buffer[1] << 8);
+}
+
+/**
+*	Write 16-bit
+*
+*	@param buffer where the number goes (little endian)
+*	@param value the number
+*/
+static void write_u16(uint8_t* buffer, uint16_t value){
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+}
+
+#endif /* MAC_BULK_TRANSFER */
@@ -0,0 +1,71 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	mac_bulk.h
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief header file for mac_bulk.c
+ *
+ */
+
+#ifndef MAC_BULK_H_
+#define MAC_BULK_H_
+
+#include "message.h"
+
+#define MAC_BULK_TAG			0xF8	///< First byte of every segment and SACK. With MAC_BULK_TRANSFER, messages starting with it are taken for the bulk transfer engine's
+#define MAC_BULK_HEADER_LENGTH	5		///< Segment header: tag, type, transfer ID, sequence number (2 bytes)
+#define MAC_BULK_SEGMENT_LENGTH	(MSG_MAX_LENGTH - MAC_BULK_HEADER_LENGTH)	///< Payload bytes per segment (all but the last one are full)
+#define MAC_BULK_MAX_LENGTH		(65535UL * MAC_BULK_SEGMENT_LENGTH)			///< Max transfer length (sequence numbers are 16 bits)
+#define MAC_BULK_MAX_WINDOW		16		///< Max segments sent and not acked yet (see mac_bulk_set_window). At most 32. The receiver buffers this many per session
+#define MAC_BULK_RX_SESSIONS	2		///< Transfers received at once (from different sources)
+
+typedef struct{ ///< Bulk transfer statistics
+	uint32_t tx_transfers;			///< transfers sent (every segment acked)
+	uint32_t tx_transfers_failed;	///< transfers given up on (SACKs stopped coming, or the destination is deemed unreachable)
+	uint32_t tx_bytes;				///< bytes of the transfers sent
+	uint32_t tx_segments;			///< segments handed to the MAC, retransmissions included
+	uint32_t tx_retransmissions;	///< of those, segments sent again (a SACK showed them missing, or on a timeout)
+	uint32_t tx_timeouts;			///< retransmission timeouts (no SACK made progress for a while, and the oldest segment unacked was sent again)
+	uint32_t tx_sacks;				///< SACKs received
+	uint32_t tx_last_bytes;			///< length of the last transfer sent
+	uint32_t tx_last_ms;			///< time it took, from mac_bulk_send to its last SACK (throughput = tx_last_bytes * 1000 / tx_last_ms bytes/s)
+	uint32_t rx_transfers;			///< transfers received in full
+	uint32_t rx_bytes;				///< bytes handed to the app
+	uint32_t rx_segments;			///< segments received, duplicates included
+	uint32_t rx_duplicates;			///< segments received twice (a SACK was lost, or was late)
+	uint32_t rx_out_of_window;		///< segments dropped because they were beyond the window
+	uint32_t rx_invalid;			///< segments and SACKs dropped because their header made no sense
+	uint32_t rx_sacks;				///< SACKs sent
+	uint32_t rx_busy;				///< segments dropped because MAC_BULK_RX_SESSIONS other transfers were being received
+	uint32_t rx_timeouts;			///< transfers given up on because their segments stopped arriving
+}MacBulkStats;
+
+void mac_bulk_init( void(*)(uint16_t, uint32_t, uint8_t*, uint32_t, bool), void(*)(uint16_t, bool) );
+bool mac_bulk_set_window( uint8_t );
+bool mac_bulk_send( uint16_t, const uint8_t*, uint32_t );
+bool mac_bulk_msg_received( Message* );
+bool mac_bulk_tx_status( Message*, uint8_t );
+void mac_bulk_poll(void);
+void mac_bulk_get_stats( MacBulkStats* );
+
+#endif /* MAC_BULK_H_ */
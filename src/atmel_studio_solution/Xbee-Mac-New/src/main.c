@@ -27,6 +27,7 @@
 
 #include <asf.h>
 #include "mac/mac.h"
+#include "xbee/xbee_cpu.h"
 #include "radio/radio.h"
 #include "message.h"
 
@@ -37,6 +38,7 @@ void msg_received(Message *msg);
 void ack_received(uint8_t status);
 
 Message msg;
+uint8_t payload[1];
 
 void main(void)
 {
@@ -52,14 +54,18 @@ void main(void)
 	//signal initialization went fine.
 	ioport_set_pin_level( IOPORT_CREATE_PIN(PIOC, 23), LED_ON );
 	
-	//sends a 1-byte message every half seconds
+	//sends a 1-byte message every half seconds, polling the MAC meanwhile
 	while(1){
 		msg.address = ADDRESSEE_NODE;		//Addressee node
+		msg.data = payload;					//payload buffer
 		msg.data[0] = 7;					//send anything (random value)
 		msg.data_length = 1;				//we're sending one byte
 		mac_send(&msg);
 		
-		delay_ms(500);
+		uint32_t sent_ms = xbee_cpu_get_ms();
+		
+		while( xbee_cpu_get_ms() - sent_ms < 500 )
+			mac_poll();
 	}
 }
 
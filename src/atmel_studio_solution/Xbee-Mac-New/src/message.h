@@ -31,17 +31,19 @@
 #ifndef MESSAGE_H_
 #define MESSAGE_H_
 
-#define MSG_LENGTH	10					///< Message (MAC payload) Length. Customize for every application.
+#define MSG_MAX_LENGTH	100				///< Max message (MAC payload) length (Xbee RF data limit)
 #define MSG_BROADCAST_ADDRESS 0xFFFF	///< Broadcast address
 #define MSG_ACK_RECEIVED	0			///< Message ack value
 #define MSG_ACK_TIMEOUT		1			///< Message ack value
 #define MSG_ACK_CCA_FAILURE	2			///< Message ack value
 #define MSG_ACK_PURGED		3			///< Message ack value
+#define MSG_ACK_LOST		4			///< Message ack value (no TX status from the radio, see mac_register_tx_status_callback)
+#define MSG_ACK_UNREACHABLE	5			///< Message ack value (not sent: destination deemed unreachable, see mac_send_prio)
 
 typedef struct{		///< The message data structure
 	uint16_t address;			  ///< source or destination address (depending on whether the message is being sent or received)
-	uint8_t data[MSG_LENGTH];	  ///< MAC payload
-	uint8_t	data_length;		  ///< length of MAC payload
+	uint8_t* data;				  ///< MAC payload (points to a buffer of at least data_length bytes)
+	uint8_t	data_length;		  ///< length of MAC payload (up to MSG_MAX_LENGTH)
 	uint8_t rssi;				  ///< rssi associated
 }Message;	
 
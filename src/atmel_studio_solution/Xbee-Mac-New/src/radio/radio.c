@@ -31,17 +31,66 @@
 
 #include <stdint-gcc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "xbee/xbee_cpu.h"
 #include "xbee/xbee.h"
 #include "radio.h"
 #include "mac_config.h"
 
-static void at_command_response(XbeeATCommandResponse*);							
-static void blocking_send_at_command(const uint8_t*, const uint8_t*, uint8_t );	
+#define AT_MAX_IN_FLIGHT		8		///< Max AT commands sent and waiting for their response
+#define AT_RESPONSE_TIMEOUT		1000	///< ms to wait for an AT command response before giving it up
+#define AT_WAIT_TIMEOUT			3000	///< ms a blocking operation (a command, or a batch of them) may take in all
+#define AT_STATUS_OK			0		///< AT command response status: OK
+#define SHADOW_RETRY_HOLDOFF	10000	///< ms after the radio parameters failed to be read before a read tries again
+
+typedef struct{ ///< AT command sent, waiting for its response
+	void (*callback)(XbeeATCommandResponse*);	///< completion callback (may be NULL)
+	uint32_t sent_ms;							///< when it was sent
+	uint8_t command[2];							///< AT command
+	uint8_t frame_id;							///< frame ID its response will carry (0 = free entry)
+}AtCommandInFlight;
+
+static void at_command_response(XbeeATCommandResponse*);
+static void load_shadow(void);							
+static bool blocking_send_at_command(const uint8_t*, const uint8_t*, uint8_t );	
+static void blocking_response(XbeeATCommandResponse*);
+static void config_response(XbeeATCommandResponse*);
+static void batch_response(XbeeATCommandResponse*);
+static bool send_at_command(const uint8_t*, const uint8_t*, uint8_t, bool, void(*)(XbeeATCommandResponse*));
+static bool wait_send_at_command(const uint8_t*, const uint8_t*, uint8_t, bool, void(*)(XbeeATCommandResponse*), uint32_t);
+static bool batch_send_at_command(const uint8_t*, const uint8_t*, uint8_t, bool, void(*)(XbeeATCommandResponse*));
+static void batch_set_8bit(const char*, uint8_t);
+static void batch_set_16bit(const char*, uint16_t);
+static bool wait_for_responses(volatile uint32_t*, void(*)(XbeeATCommandResponse*), uint32_t);
+static AtCommandInFlight* at_slot_alloc(const uint8_t*, void(*)(XbeeATCommandResponse*));
+static void expire_at_commands(void(*)(XbeeATCommandResponse*));
+static uint32_t response_value(XbeeATCommandResponse*);
 static uint16_t fix_endianness_16bit(uint16_t original);
+static void invalidate_warm_boot(void);
+
+static volatile XbeeATCommandResponse response; //Response to the last blocking command (blocking commands are issued one at a time)
+static volatile uint32_t blocking_pending = 0;
+
+//AT commands in flight (sent, waiting for their response)
+static AtCommandInFlight at_in_flight[AT_MAX_IN_FLIGHT];
+static uint8_t next_frame_id = 1;
+
+//batch of commands in progress (radio_read_config, radio_config_commit)
+static RadioConfig* config_read;
+static volatile uint32_t batch_pending;
+static volatile bool batch_ok;
+static uint32_t batch_deadline;			///< when the batch is given up on (xbee_cpu_get_us time)
+
+static RadioStats stats;
 
-static volatile XbeeATCommandResponse response; //One reponse for all upper layer threads (hence, shared memory)
-static volatile bool waiting_for_response = false;
+//shadow copy of the radio parameters (read once, then kept up to date by every write)
+static RadioConfig shadow;
+static bool shadow_valid = false;		///< whether shadow has been read
+static bool shadow_failed = false;		///< whether the last attempt to read it failed (see SHADOW_RETRY_HOLDOFF)
+static uint32_t shadow_retry_ms;		///< when a read may try again, after a failure
+
+//configuration transaction (radio_config_begin ... radio_config_commit)
+static RadioConfig config_new;			///< values to be committed
 
 /**
 *	Initializes the radio.
@@ -60,6 +109,306 @@ bool radio_init(void){
 	return xbee_init(RADIO_SPEED_RATE);  //takes ~2 secs to complete
 }
 
+/**
+*	Send AT command.
+*
+*	Sends an AT command without waiting for its response. Several commands
+*	can be in flight at once: each one gets its own frame ID, and its callback
+*	is called when its response arrives (possibly from the USART1 handler). A
+*	response that never arrives is reported with status RADIO_AT_STATUS_TIMEOUT,
+*	after AT_RESPONSE_TIMEOUT ms (see radio_poll). Not to be called from 
+*	interrupt handlers (callbacks included).
+*
+*	@param command pointer to the AT command (2 chars)
+*	@param params pointer to the parameter value (big endian)
+*	@param params_length length of the parameter value (0 to read a value)
+*	@param callback called with the response (may be NULL)
+*
+*	@return true if the command was sent, false if too many are waiting for their response
+*/
+bool radio_send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length, void(*callback)(XbeeATCommandResponse*)){
+	return send_at_command( command, params, params_length, false, callback );
+}
+
+/**
+*	Radio poll.
+*
+*	Gives up on AT command responses that are long overdue (reporting them
+*	with status RADIO_AT_STATUS_TIMEOUT). Called from mac_poll.
+*/
+void radio_poll(void){
+	expire_at_commands(NULL);
+}
+
+/**
+*	Radio get statistics.
+*
+*	@param out where the statistics are copied
+*/
+void radio_get_stats(RadioStats* out){
+	*out = stats;
+}
+
+/**
+*	Radio read configuration.
+*
+*	Reads all the radio parameters at once: the commands are sent back-to-back,
+*	and the responses are collected as they arrive.
+*
+*	@param config where the parameters read are stored
+*
+*	@return true if all parameters were read
+*/
+bool radio_read_config(RadioConfig* config){
+	static const char commands[] = "MYIDCHMMPLCARRRN";
+	
+	config_read = config;
+	batch_ok = true;
+	batch_pending = 0;
+	batch_deadline = xbee_cpu_get_us() + AT_WAIT_TIMEOUT * 1000;
+	
+	for( uint32_t i=0; i<sizeof(commands) - 1; i+=2 )
+		batch_send_at_command( (const uint8_t*)&commands[i], (uint8_t*)"", 0, false, config_response );
+	
+	wait_for_responses( &batch_pending, config_response, batch_deadline );
+	
+	return batch_ok;
+}
+
+/**
+*	Radio refresh.
+*
+*	Reads all the radio parameters again. Reads are served from a shadow copy,
+*	which every write through this module keeps up to date: refresh it only if
+*	the radio might have been changed behind its back (e.g. reset). The shadow
+*	copy is first read by the first read; if that fails, reads serve what's
+*	there (see radio_shadow_valid) and don't try again for SHADOW_RETRY_HOLDOFF
+*	ms (this always tries).
+*
+*	@return true if all parameters were read
+*/
+bool radio_refresh(void){
+	shadow_valid = radio_read_config( &shadow );
+	shadow_failed = !shadow_valid;
+	
+	if( shadow_failed ){
+		shadow_retry_ms = xbee_cpu_get_ms() + SHADOW_RETRY_HOLDOFF;
+		stats.refresh_failures++;
+	}
+	
+	return shadow_valid;
+}
+
+/**
+*	Radio shadow valid.
+*
+*	@return true if the values the radio_read_* functions serve were read from
+*			the radio (or written through this module), false if reading them
+*			failed, or wasn't tried yet
+*/
+bool radio_shadow_valid(void){
+	return shadow_valid;
+}
+
+/**
+*	Radio configuration begin.
+*
+*	Begins a configuration transaction: the radio_config_set_* calls that follow
+*	only stage new values, which radio_config_commit writes all at once. 
+*	Unchanged values (as per the shadow copy) aren't written again.
+*
+*	@return true if the current values are known (otherwise all values are written on commit)
+*/
+bool radio_config_begin(void){
+	load_shadow();
+	config_new = shadow;
+	
+	return shadow_valid;
+}
+
+/**
+*	Radio configuration set 16-bit address.
+*
+*	@param value the address
+*/
+void radio_config_set_16bit_address(uint16_t value){
+	config_new.address = value;
+}
+
+/**
+*	Radio configuration set PAN ID.
+*
+*	@param pan_id the PAN ID
+*/
+void radio_config_set_panid(uint16_t pan_id){
+	config_new.panid = pan_id;
+}
+
+/**
+*	Radio configuration set channel.
+*
+*	Input must be a valid IEEE 802.15.4 channel.
+*
+*	@param value the channel
+*/
+void radio_config_set_channel(uint8_t value){
+	if(value < 0x0B || value > 0x1A)
+		return;
+		
+	config_new.channel = value;
+}
+
+/**
+*	Radio configuration set acks.
+*
+*	@param acks_allowed whether to use packet acknowledgment or not
+*/
+void radio_config_set_acks(bool acks_allowed){
+	config_new.acks = acks_allowed;
+}
+
+/**
+*	Radio configuration set TX power.
+*
+*	0 = -10dBm, 1 = -6dBm, 2 = -4dBm, 3 = -2dBm, 4 = 0dBm.
+*
+*	@param power the TX power level
+*/
+void radio_config_set_tx_power(uint8_t power){
+	if(power > 4)
+		return;
+		
+	config_new.tx_power = power;
+}
+
+/**
+*	Radio configuration set CCA Threshold.
+*
+*	Min = 0x24 -dBm, Max = 0x50 -dBm.
+*
+*	@param threshold the threshold in -dBm
+*/
+void radio_config_set_cca_threshold(uint8_t threshold){
+	if(threshold < 0x24 || threshold > 0x50)
+		return;
+		
+	config_new.cca_threshold = threshold;
+}
+
+/**
+*	Radio configuration set macMinBE.
+*
+*	The value must be between 0 and 3.
+*
+*	@param value the desired value
+*/
+void radio_config_set_macminbe(uint8_t value){
+	if( value > 3 )
+		return;
+		
+	config_new.macminbe = value;
+}
+
+/**
+*	Radio configuration commit.
+*
+*	Ends a configuration transaction. The values that changed are queued in the 
+*	radio (AT command queue parameter value frames, sent back-to-back), then 
+*	applied with a single AC and written to non-volatile memory with a single WR.
+*	AC and WR are only sent once every value has been queued successfully, so a 
+*	partial configuration is never written. Nothing is sent if nothing changed.
+*	On failure the shadow copy is dropped (values queued may still be applied by
+*	the radio), so the next read asks the radio. The warm boot fingerprint is
+*	cleared first (see invalidate_warm_boot).
+*
+*	@return true if all commands succeeded
+*/
+bool radio_config_commit(void){
+	bool all = !shadow_valid;
+	uint32_t changes = 0;
+	
+	batch_ok = true;
+	batch_pending = 0;
+	batch_deadline = xbee_cpu_get_us() + AT_WAIT_TIMEOUT * 1000;
+	
+	//(values are queued in the radio as they're compared)
+	invalidate_warm_boot();
+	
+	if( all || config_new.address != shadow.address ){
+		batch_set_16bit( "MY", config_new.address );
+		changes++;
+	}
+	if( all || config_new.panid != shadow.panid ){
+		batch_set_16bit( "ID", config_new.panid );
+		changes++;
+	}
+	if( all || config_new.channel != shadow.channel ){
+		batch_set_8bit( "CH", config_new.channel );
+		changes++;
+	}
+	if( all || config_new.acks != shadow.acks ){
+		batch_set_8bit( "MM", config_new.acks ? 2 : 1 ); //ieee 802.15.4 with or without acks
+		changes++;
+	}
+	if( all || config_new.tx_power != shadow.tx_power ){
+		batch_set_8bit( "PL", config_new.tx_power );
+		changes++;
+	}
+	if( all || config_new.cca_threshold != shadow.cca_threshold ){
+		batch_set_8bit( "CA", config_new.cca_threshold );
+		changes++;
+	}
+	if( all || config_new.macminbe != shadow.macminbe ){
+		batch_set_8bit( "RN", config_new.macminbe );
+		changes++;
+	}
+	
+	if( changes == 0 )
+		return true;
+	
+	//every value must be in before they're applied
+	wait_for_responses( &batch_pending, batch_response, batch_deadline );
+	
+	//apply changes, and write them to nonvolatile
+	if( batch_ok ){
+		batch_send_at_command( (uint8_t*)"AC", (uint8_t*)"", 0, false, batch_response );
+		batch_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0, false, batch_response );
+		
+		wait_for_responses( &batch_pending, batch_response, batch_deadline );
+	}
+	
+	if( batch_ok ){
+		shadow = config_new;
+		shadow_valid = true;
+		shadow_failed = false;
+	}
+	else{
+		shadow_valid = false;
+	}
+	
+	return batch_ok;
+}
+
+/**
+*	Radio query 16-bit address.
+*
+*	Asks the radio for its 16-bit address (unlike radio_read_16bit_address, which
+*	is served from the shadow copy). A cheap way of checking the radio is there,
+*	and configured.
+*
+*	@param address where the address is stored
+*
+*	@return true if the radio responded
+*/
+bool radio_query_16bit_address(uint16_t* address){
+	if( !blocking_send_at_command( (uint8_t*)"MY", (uint8_t*)"", 0 ) )
+		return false;
+	
+	*address = response.value_requested[0]*256 + response.value_requested[1];
+	
+	return true;
+}
+
 /**
 *	Radio read 16-bit address.
 *
@@ -68,17 +417,9 @@ bool radio_init(void){
 *	@return the address
 */
 uint16_t radio_read_16bit_address(void){
-	//LOCK OR MUTEX.... Fix this
-	
-	//send command
-	blocking_send_at_command( (uint8_t*)"MY", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint16_t address = response.value_requested[0]*256 + response.value_requested[1];
+	load_shadow();
 	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return address;//later fix... check that status == OK (0) and not error
+	return shadow.address;
 }
 
 /**
@@ -89,17 +430,9 @@ uint16_t radio_read_16bit_address(void){
 *	@return the PAN ID
 */
 uint16_t radio_read_panid(void){
-		//LOCK OR MUTEX.... Fix this
-		
-		//send command
-		blocking_send_at_command( (uint8_t*)"ID", (uint8_t*)"", 0 );
-
-		//extract numeric value
-		uint16_t panid = response.value_requested[0]*256 + response.value_requested[1];
-		
-		//UNLOCK OR RELEASE MUTEX.... Fix this
-
-		return panid;//later fix... check that status == OK (0) and not error
+	load_shadow();
+	
+	return shadow.panid;
 }
 
 /**
@@ -110,17 +443,9 @@ uint16_t radio_read_panid(void){
 *	@return the channel
 */
 uint8_t radio_read_channel(void){
-	//LOCK OR MUTEX.... Fix this
+	load_shadow();
 	
-	//send command
-	blocking_send_at_command( (uint8_t*)"CH", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t channel = response.value_requested[0];
-	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return channel;//later fix... check that status == OK (0) and not error
+	return shadow.channel;
 }
 
 /**
@@ -134,19 +459,9 @@ uint8_t radio_read_channel(void){
 *	@return # of retries, maximum 6
 */
 uint8_t radio_read_extra_retries(void){
-
-	//LOCK OR MUTEX.... Fix this
-	
-	//send command
-	blocking_send_at_command( (uint8_t*)"RR", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t retries = response.value_requested[0];
+	load_shadow();
 	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return retries;//later fix... check that status == OK (0) and not error
-
+	return shadow.extra_retries;
 }
 
 /**
@@ -158,17 +473,9 @@ uint8_t radio_read_extra_retries(void){
 *	@return the tx power level
 */
 uint8_t radio_read_tx_power(void){
-	//LOCK OR MUTEX.... Fix this
+	load_shadow();
 	
-	//send command
-	blocking_send_at_command( (uint8_t*)"PL", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t power = response.value_requested[0];
-	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return power;//later fix... check that status == OK (0) and not error
+	return shadow.tx_power;
 }
 
 /**
@@ -183,17 +490,9 @@ uint8_t radio_read_tx_power(void){
 *	@return the CCA threshold in -dBm
 */
 uint8_t radio_read_cca_threshold(void){
-	//LOCK OR MUTEX.... Fix this
-	
-	//send command
-	blocking_send_at_command( (uint8_t*)"CA", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t threshold = response.value_requested[0];
+	load_shadow();
 	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return threshold;//later fix... check that status == OK (0) and not error
+	return shadow.cca_threshold;
 }
 
 /**
@@ -205,17 +504,9 @@ uint8_t radio_read_cca_threshold(void){
 *	@return acks activated, yes or not
 */
 bool radio_read_acks(void){
-	//LOCK OR MUTEX.... Fix this
-	
-	//send command
-	blocking_send_at_command( (uint8_t*)"MM", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t v = response.value_requested[0];
+	load_shadow();
 	
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return v;//later fix... check that status == OK (0) and not error
+	return shadow.acks;
 }
 
 /**
@@ -226,19 +517,9 @@ bool radio_read_acks(void){
 *	@return The macMinBEE (between 0 and 3)
 */
 uint8_t radio_read_macminbe(void){
+	load_shadow();
 	
-	//LOCK OR MUTEX.... Fix this
-		
-	//send command
-	blocking_send_at_command( (uint8_t*)"RN", (uint8_t*)"", 0 );
-
-	//extract numeric value
-	uint8_t value = response.value_requested[0];
-		
-	//UNLOCK OR RELEASE MUTEX.... Fix this
-
-	return value;//later fix... check that status == OK (0) and not error
-
+	return shadow.macminbe;
 }
 
 
@@ -248,13 +529,20 @@ uint8_t radio_read_macminbe(void){
 *	Changes the radio 16-bit address to the specified one.
 *
 *	@param value the address
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_16bit_address(uint16_t value){
+bool radio_write_16bit_address(uint16_t value){
 	
 	uint16_t fixed_value = fix_endianness_16bit(value);	
 	
-	blocking_send_at_command( (uint8_t*)"MY", (uint8_t*)(&fixed_value), 2 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  						//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"MY", (uint8_t*)(&fixed_value), 2 ) )	//send command
+		return false;
+	
+	shadow.address = value;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  						//write changes to nonvolatile
 }
 
 /**
@@ -264,14 +552,21 @@ void radio_write_16bit_address(uint16_t value){
 *	a valid IEEE 802.15.4 channel.
 *
 *	@param value the channel
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_channel(uint8_t value){
+bool radio_write_channel(uint8_t value){
 	
 	if(value < 0x0B || value > 0x1A)
-		return;
+		return false;
 		
-	blocking_send_at_command( (uint8_t*)"CH", (uint8_t*)(&value), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  					//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"CH", (uint8_t*)(&value), 1 ) )	//send command
+		return false;
+	
+	shadow.channel = value;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  					//write changes to nonvolatile
 }
 
 /**
@@ -281,16 +576,23 @@ void radio_write_channel(uint8_t value){
 *	in transmissions.
 *
 *	@param acks_allowed yes or not
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_acks(bool acks_allowed){
+bool radio_write_acks(bool acks_allowed){
 	
 	uint8_t mac_mode;
 	
 	if(acks_allowed) mac_mode = 2; //ieee 802.15.4 with acks
 	else mac_mode = 1;				//ieee 802.15.4 no acks
 
-	blocking_send_at_command( (uint8_t*)"MM", (uint8_t*)(&mac_mode), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"MM", (uint8_t*)(&mac_mode), 1 ) )	//send command
+		return false;
+	
+	shadow.acks = acks_allowed;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
 }
 
 
@@ -300,13 +602,20 @@ void radio_write_acks(bool acks_allowed){
 *	Changes the radio's PAN ID to the specified one.
 *
 *	@param pan_id the PAN ID
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_panid(uint16_t pan_id){
+bool radio_write_panid(uint16_t pan_id){
 	
 	uint16_t fixed_value = fix_endianness_16bit(pan_id);
 	
-	blocking_send_at_command( (uint8_t*)"ID", (uint8_t*)(&fixed_value), 2 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  						//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"ID", (uint8_t*)(&fixed_value), 2 ) )	//send command
+		return false;
+	
+	shadow.panid = pan_id;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  						//write changes to nonvolatile
 }
 
 /**
@@ -318,14 +627,21 @@ void radio_write_panid(uint16_t pan_id){
 *	up to 3 retries.
 *
 *	@param retries # of retries, maximum 6
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_extra_retries(uint8_t retries){
+bool radio_write_extra_retries(uint8_t retries){
 
 	if(retries > 6)	
-		return;
+		return false;
 		
-	blocking_send_at_command( (uint8_t*)"RR", (uint8_t*)(&retries), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"RR", (uint8_t*)(&retries), 1 ) )	//send command
+		return false;
+	
+	shadow.extra_retries = retries;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
 }
 
 /**
@@ -335,14 +651,21 @@ void radio_write_extra_retries(uint8_t retries){
 *	0 = -10dBm, 1 = -6dBm, 2 = -4dBm, 3 = -2dBm, 4 = 0dBm.
 *
 *	@param power the TX power level
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_tx_power(uint8_t power){
+bool radio_write_tx_power(uint8_t power){
 
 	if(power > 4)
-		return;
+		return false;
+	
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"PL", (uint8_t*)(&power), 1 ) )	//send command
+		return false;
 	
-	blocking_send_at_command( (uint8_t*)"PL", (uint8_t*)(&power), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
+	shadow.tx_power = power;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
 }
 
 /**
@@ -355,14 +678,21 @@ void radio_write_tx_power(uint8_t power){
 *	Min = 0x24 -dBm, Max = 0x50 -dBm.
 *
 *	@param threshold the threshold in -dBm
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_cca_threshold(uint8_t threshold){
+bool radio_write_cca_threshold(uint8_t threshold){
 
 	if(threshold < 0x24 || threshold > 0x50)
-		return;
+		return false;
+	
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"CA", (uint8_t*)(&threshold), 1 ) )	//send command
+		return false;
+	
+	shadow.cca_threshold = threshold;
 	
-	blocking_send_at_command( (uint8_t*)"CA", (uint8_t*)(&threshold), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  		//write changes to nonvolatile
 }
 /**
 *	Radio write macMinBE.
@@ -371,14 +701,21 @@ void radio_write_cca_threshold(uint8_t threshold){
 *	CSMA-CA algorithm. The value must be between 0 and 3.
 *
 *	@param value the desired value
+*
+*	@return true if the radio acked both the value and the WR (write to non-volatile)
 */
-void radio_write_macminbe(uint8_t value){
+bool radio_write_macminbe(uint8_t value){
 	
 	if( value > 3 || value < 0 )
-		return;
+		return false;
 		
-	blocking_send_at_command( (uint8_t*)"RN", (uint8_t*)(&value), 1 );	//send command
-	blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  					//write changes to nonvolatile
+	invalidate_warm_boot();
+	if( !blocking_send_at_command( (uint8_t*)"RN", (uint8_t*)(&value), 1 ) )	//send command
+		return false;
+	
+	shadow.macminbe = value;
+	
+	return blocking_send_at_command( (uint8_t*)"WR", (uint8_t*)"", 0 );  					//write changes to nonvolatile
 }
 
 
@@ -394,8 +731,54 @@ void radio_write_macminbe(uint8_t value){
 *	@param response the response
 */
 static void at_command_response(XbeeATCommandResponse* r){
+	void (*callback)(XbeeATCommandResponse*) = NULL;
+	bool found = false;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t i=0; i<AT_MAX_IN_FLIGHT; i++ ){
+		if( at_in_flight[i].frame_id == r->frame_id ){
+			callback = at_in_flight[i].callback;
+			at_in_flight[i].frame_id = 0;
+			found = true;
+			break;
+		}
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	//(unknown frame IDs belong to commands already given up on)
+	if( found && callback )
+		(*callback)(r);
+}
+
+/**
+*	Load shadow
+*
+*	Reads the radio parameters into the shadow copy, unless already done, or
+*	the last attempt failed less than SHADOW_RETRY_HOLDOFF ms ago (every read
+*	would otherwise block on the whole batch again).
+*/
+static void load_shadow(void){
+	if( shadow_valid )
+		return;
+	
+	if( shadow_failed && (int32_t)(xbee_cpu_get_ms() - shadow_retry_ms) < 0 )
+		return;
+	
+	radio_refresh();
+}
+
+/**
+*	Blocking command response
+*
+*	Completion callback of blocking_send_at_command.
+*
+*	@param r the response
+*/
+static void blocking_response(XbeeATCommandResponse* r){
 	
 	//copies response in buffer
+	response.frame_id = r->frame_id;
 	response.status = r->status;
 	response.value_requested_length = r->value_requested_length;
 	
@@ -403,7 +786,342 @@ static void at_command_response(XbeeATCommandResponse* r){
 	response.value_requested[i] = r->value_requested[i];
 	
 	//signals data is ready
-	waiting_for_response = false;
+	blocking_pending = 0;
+}
+
+/**
+*	Configuration read response
+*
+*	Completion callback of the commands sent by radio_read_config.
+*
+*	@param r the response
+*/
+static void config_response(XbeeATCommandResponse* r){
+	uint32_t value = response_value(r);
+	uint16_t command = (r->command[0] << 8) | r->command[1];
+	
+	if( r->status != AT_STATUS_OK ){
+		batch_ok = false;
+		command = 0;	//(no value to store)
+	}
+	
+	switch( command ){
+		case ('M' << 8) | 'Y': config_read->address = value; break;
+		case ('I' << 8) | 'D': config_read->panid = value; break;
+		case ('C' << 8) | 'H': config_read->channel = value; break;
+		case ('M' << 8) | 'M': config_read->acks = (value == 2); break;
+		case ('P' << 8) | 'L': config_read->tx_power = value; break;
+		case ('C' << 8) | 'A': config_read->cca_threshold = value; break;
+		case ('R' << 8) | 'R': config_read->extra_retries = value; break;
+		case ('R' << 8) | 'N': config_read->macminbe = value; break;
+	}
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	batch_pending--;
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Batch response
+*
+*	Completion callback of the commands sent by radio_config_commit.
+*
+*	@param r the response
+*/
+static void batch_response(XbeeATCommandResponse* r){
+	if( r->status != AT_STATUS_OK )
+		batch_ok = false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	batch_pending--;
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Send AT command
+*
+*	Sends an AT command (or queues a parameter value) without waiting for 
+*	its response.
+*
+*	@param command pointer to the AT command (2 chars)
+*	@param params pointer to the parameter value (big endian)
+*	@param params_length length of the parameter value
+*	@param queued true to queue the value (applied by AC), false to send a regular command
+*	@param callback called with the response (may be NULL)
+*
+*	@return true if the command was sent, false if too many are waiting for their response
+*/
+static bool send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length, bool queued, void(*callback)(XbeeATCommandResponse*)){
+	
+	AtCommandInFlight* slot = at_slot_alloc( command, callback );
+	
+	//full: give up on responses that are long overdue, and retry
+	if( !slot ){
+		expire_at_commands(NULL);
+		slot = at_slot_alloc( command, callback );
+	}
+	
+	if( !slot )
+		return false;
+	
+	if( queued )
+		xbee_queue_at_command( command, params, params_length, slot->frame_id );
+	else
+		xbee_send_at_command( command, params, params_length, slot->frame_id );
+	
+	return true;
+}
+
+/**
+*	Wait send AT command
+*
+*	Sends an AT command (or queues a parameter value), waiting for room if 
+*	the commands in flight are too many, at most until the deadline.
+*
+*	@param command pointer to the AT command (2 chars)
+*	@param params pointer to the parameter value (big endian)
+*	@param params_length length of the parameter value
+*	@param queued true to queue the value (applied by AC), false to send a regular command
+*	@param callback called with the response (may be NULL)
+*	@param deadline when to stop waiting (xbee_cpu_get_us time)
+*
+*	@return true if the command was sent
+*/
+static bool wait_send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length, bool queued, void(*callback)(XbeeATCommandResponse*), uint32_t deadline){
+	if( send_at_command( command, params, params_length, queued, callback ) )
+		return true;
+	
+	uint32_t start = xbee_cpu_get_us();
+	bool sent;
+	
+	while( !(sent = send_at_command( command, params, params_length, queued, callback )) ){
+		if( xbee_cpu_is_past(deadline) ){
+			stats.wait_timeouts++;
+			break;
+		}
+		
+#ifdef XBEE_DEFERRED_RX_PROCESSING
+		xbee_process_rx();
+#endif
+		xbee_cpu_wait();
+	}
+	
+	xbee_cpu_wait_end(XBEE_CPU_WAIT_AT_RESPONSE, start);
+	
+	return sent;
+}
+
+/**
+*	Batch send AT command
+*
+*	Sends a command of a batch (counted in batch_pending), waiting for room
+*	if the commands in flight are too many, at most until batch_deadline 
+*	(failing the batch).
+*
+*	@param command pointer to the AT command (2 chars)
+*	@param params pointer to the parameter value (big endian)
+*	@param params_length length of the parameter value
+*	@param queued true to queue the value (applied by AC), false to send a regular command
+*	@param callback completion callback (must decrement batch_pending)
+*
+*	@return true if the command was sent
+*/
+static bool batch_send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length, bool queued, void(*callback)(XbeeATCommandResponse*)){
+	uint32_t state = xbee_cpu_enter_critical();
+	batch_pending++;
+	xbee_cpu_exit_critical(state);
+	
+	if( !wait_send_at_command( command, params, params_length, queued, callback, batch_deadline ) ){
+		batch_ok = false;
+		
+		state = xbee_cpu_enter_critical();
+		batch_pending--;
+		xbee_cpu_exit_critical(state);
+		
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+*	Batch set 8-bit
+*
+*	Queues an 8-bit parameter value, as part of a batch.
+*
+*	@param command the AT command
+*	@param value the value
+*/
+static void batch_set_8bit(const char* command, uint8_t value){
+	batch_send_at_command( (const uint8_t*)command, &value, 1, true, batch_response );
+}
+
+/**
+*	Batch set 16-bit
+*
+*	Queues a 16-bit parameter value, as part of a batch.
+*
+*	@param command the AT command
+*	@param value the value
+*/
+static void batch_set_16bit(const char* command, uint16_t value){
+	uint16_t fixed_value = fix_endianness_16bit(value);
+	
+	batch_send_at_command( (const uint8_t*)command, (uint8_t*)(&fixed_value), 2, true, batch_response );
+}
+
+/**
+*	Wait for responses
+*
+*	Waits until the responses pending are in (or given up on), at most until
+*	the deadline. The commands still pending by then are given up on, so they 
+*	are all accounted for either way.
+*
+*	@param pending responses pending, decremented by the completion callbacks
+*	@param callback the completion callback of the commands waited for
+*	@param deadline when to stop waiting (xbee_cpu_get_us time)
+*
+*	@return true if the wait ended before the deadline
+*/
+static bool wait_for_responses(volatile uint32_t* pending, void(*callback)(XbeeATCommandResponse*), uint32_t deadline){
+	uint32_t start = xbee_cpu_get_us();
+	bool in_time = true;
+	
+	//use semaphore instead when OS is present.... FIX THIS....
+	while( *pending > 0 ){
+		if( xbee_cpu_is_past(deadline) ){
+			stats.wait_timeouts++;
+			expire_at_commands(callback);
+			in_time = false;
+			break;
+		}
+		
+#ifdef XBEE_DEFERRED_RX_PROCESSING
+		xbee_process_rx();	//nobody else will process the responses
+#endif
+		expire_at_commands(NULL);
+		
+		if( *pending > 0 )
+			xbee_cpu_wait();	//(woken by the USART1 interrupt, or SysTick)
+	}
+	
+	xbee_cpu_wait_end(XBEE_CPU_WAIT_AT_RESPONSE, start);
+	
+	return in_time;
+}
+
+/**
+*	AT slot alloc
+*
+*	Takes a free entry of the in-flight table for a command, and gives it a 
+*	frame ID. Frame IDs rotate from 1 to 255, skipping those still in flight.
+*
+*	@param command the AT command
+*	@param callback its completion callback
+*
+*	@return the entry, or NULL if all entries are in use
+*/
+static AtCommandInFlight* at_slot_alloc(const uint8_t* command, void(*callback)(XbeeATCommandResponse*)){
+	AtCommandInFlight* slot = NULL;
+	bool in_use;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t i=0; i<AT_MAX_IN_FLIGHT; i++ ){
+		if( at_in_flight[i].frame_id == 0 ){
+			slot = &at_in_flight[i];
+			break;
+		}
+	}
+	
+	if( slot ){
+		do{
+			slot->frame_id = next_frame_id;
+			next_frame_id = (next_frame_id == 255) ? 1 : next_frame_id + 1;
+			
+			in_use = false;
+			for( uint32_t i=0; i<AT_MAX_IN_FLIGHT; i++ )
+				if( &at_in_flight[i] != slot && at_in_flight[i].frame_id == slot->frame_id )
+					in_use = true;
+		}while( in_use );
+		
+		slot->callback = callback;
+		slot->command[0] = command[0];
+		slot->command[1] = command[1];
+		slot->sent_ms = xbee_cpu_get_ms();
+		stats.at_commands++;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return slot;
+}
+
+/**
+*	Expire AT commands
+*
+*	Gives up on commands whose response hasn't arrived within AT_RESPONSE_TIMEOUT
+*	(and, if a callback is given, on every command with that callback, however
+*	recent), so their entries and frame IDs can be reused. Their callbacks get a
+*	RADIO_AT_STATUS_TIMEOUT response.
+*
+*	@param owner callback of the commands to give up on right away (NULL for none)
+*/
+static void expire_at_commands(void(*owner)(XbeeATCommandResponse*)){
+	uint32_t now = xbee_cpu_get_ms();
+	
+	for( uint32_t i=0; i<AT_MAX_IN_FLIGHT; i++ ){
+		XbeeATCommandResponse lost = { 0 };
+		void (*callback)(XbeeATCommandResponse*) = NULL;
+		bool found = false;
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( at_in_flight[i].frame_id != 0 && 
+			( (owner && at_in_flight[i].callback == owner) || now - at_in_flight[i].sent_ms >= AT_RESPONSE_TIMEOUT ) ){
+			lost.frame_id = at_in_flight[i].frame_id;
+			lost.command[0] = at_in_flight[i].command[0];
+			lost.command[1] = at_in_flight[i].command[1];
+			lost.status = RADIO_AT_STATUS_TIMEOUT;
+			callback = at_in_flight[i].callback;
+			at_in_flight[i].frame_id = 0;
+			stats.at_timeouts++;
+			found = true;
+		}
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( found && callback )
+			(*callback)(&lost);
+	}
+}
+
+/**
+*	Response value
+*
+*	@param r an AT command response
+*
+*	@return the value requested, as a number (the Xbee sends it big endian)
+*/
+static uint32_t response_value(XbeeATCommandResponse* r){
+	uint32_t value = 0;
+	
+	for( uint32_t i=0; i<r->value_requested_length && i<4; i++ )
+		value = (value << 8) + r->value_requested[i];
+	
+	return value;
+}
+
+/**
+*	Invalidate warm boot
+*
+*	Clears the configuration fingerprint mac_init keeps across resets (see
+*	MAC_WARM_BOOT), before the radio parameters are changed: the radio may no
+*	longer match mac_config.h, so the next reset must configure it again.
+*	mac_init stores the fingerprint again once its own configuration is in.
+*/
+static void invalidate_warm_boot(void){
+#ifdef MAC_WARM_BOOT
+	xbee_cpu_write_retained(0);
+#endif
 }
 
 /**
@@ -430,18 +1148,26 @@ static uint16_t fix_endianness_16bit(uint16_t original){
 *
 *	The underlying Xbee library is interrupt based, so this 
 *	creates a blocking function that sends an AT command and 
-*	returns when a response has being received.
+*	returns when a response has being received (or given up on, 
+*	after AT_RESPONSE_TIMEOUT ms). The response is left in response.
+*	Waiting, for room and for the response, takes at most AT_WAIT_TIMEOUT ms.
 *
+*	@return true if the response status is OK
 */
-static void blocking_send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length){
+static bool blocking_send_at_command(const uint8_t* command, const uint8_t* params, uint8_t params_length){
+	uint32_t deadline = xbee_cpu_get_us() + AT_WAIT_TIMEOUT * 1000;
 	
 	//we will be waiting for incoming command response
-	waiting_for_response = true;
+	blocking_pending = 1;
 	
-	//sends command
-	xbee_send_at_command( command, params, params_length);
+	//sends command (waiting for room if the commands in flight are too many)
+	if( !wait_send_at_command( command, params, params_length, false, blocking_response, deadline ) ){
+		blocking_pending = 0;
+		return false;
+	}
 	
 	//waits until response has being received
-	//use semaphore instead when OS is present.... response.wait();...  FIX THIS....
-	while(waiting_for_response);
+	wait_for_responses( &blocking_pending, blocking_response, deadline );
+	
+	return response.status == AT_STATUS_OK;
 }
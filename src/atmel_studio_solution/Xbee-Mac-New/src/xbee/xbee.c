@@ -38,9 +38,11 @@
 
 #include <stdint-gcc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include "xbee_uart.h"
 #include "xbee_cpu.h"
+#include "xbee_msg_pool.h"
 #include "xbee.h"
 #include "mac_config.h"
 
@@ -48,11 +50,19 @@
 #define START_DELIMITER					0x7E	///< Start Delimiter value
 #define API_ID_TX						0x01	///< API ID value for TX request (msg send) frame
 #define API_ID_AT_COMMAND				0x08	///< API ID value for AT Command request frame
+#define API_ID_AT_COMMAND_QUEUED		0x09	///< API ID value for AT Command (queue parameter value) request frame
 #define API_ID_AT_COMMAND_RESPONSE		0x88	///< API ID value for AT Command response frames
 #define API_ID_MESSAGE_RESPONSE			0x89	///< API ID value for message response (ack) frames
 #define API_ID_MESSAGE_RECEIVED_16bit	0x81	///< API ID value for 16-bit RX request (msg received) frame
 #define API_ID_MESSAGE_RECEIVED_64bit	0x80	///< API ID value for 64-bit RX request (msg received) frame
 #define API_ID_MODEM_STATUS				0x8A	///< API ID value for modem status request frame
+#define RX_FRAME_DATA_MAX_LENGTH		110		///< Max API frame data length received (64-bit RX frame carrying 100 bytes of RF data)
+#define RX_CHUNK_LENGTH					16		///< Bytes taken from the UART receive ring at a time
+#define INIT_FRAME_ID					0x4D	///< Frame ID of the AT commands sent at init (nothing else is in flight then)
+#define BAUDRATE_PROBE_TIMEOUT			200		///< ms to wait for the Xbee to answer an AT command at init
+#define BAUDRATE_PROBE_ROUNDS			5		///< Times all baud rates are probed before giving up on finding the Xbee
+#define BAUDRATE_CHECK_COMMANDS			16		///< AT commands that must be answered flawlessly for a baud rate to pass the link check
+#define RX_FRAME_MAX_LENGTH				(RX_FRAME_DATA_MAX_LENGTH + 1)	///< Max API frame length field accepted (API ID included)
 
 typedef struct{ ///< TX Request API Frame
 	uint8_t start_delimiter;
@@ -87,31 +97,72 @@ typedef struct{ ///< AT Command Response API Frame
 	uint8_t value_requested_length;
 }ApiFrameATCommandResponse; 
 
+typedef struct{ ///< Received API Frame (as assembled by the receive parser)
+	uint16_t length;							///< length of the API frame data (API ID included)
+	uint8_t api_id;
+	uint8_t data[RX_FRAME_DATA_MAX_LENGTH];		///< frame data (API ID excluded)
+	uint8_t checksum;
+}ApiFrameReceived;
+
+typedef enum{ ///< Receive parser states
+	RX_WAITING_DELIMITER,
+	RX_READING_LENGTH_MSB,
+	RX_READING_LENGTH_LSB,
+	RX_READING_API_ID,
+	RX_READING_DATA,
+	RX_READING_CHECKSUM
+}RxState;
+
 
-static bool read_at_command_response( XbeeATCommandResponse*, uint16_t );
-static bool read_msg( Message*, uint16_t );
-static bool read_msg_response( XbeeStatus*, uint8_t*, uint16_t );
+static bool rx_process_byte( uint8_t );
+static void rx_resync( uint8_t );
+static bool rx_is_length_valid( uint8_t, uint16_t );
+static void process_frame( ApiFrameReceived* );
+static bool read_at_command_response( XbeeATCommandResponse*, ApiFrameReceived* );
+static bool read_msg( Message*, ApiFrameReceived* );
+static bool read_msg_response( XbeeStatus*, uint8_t*, ApiFrameReceived* );
+static void send_at_command( uint8_t, const uint8_t*, const uint8_t*, uint8_t, uint8_t );
 static void send_at_command_frame( ApiFrameATCommand* );
 static void create_at_command_frame( ApiFrameATCommand* );
 static void send_msg_frame( ApiFrameMsg* );
 static void create_msg_frame( ApiFrameMsg* );
-static bool is_xbee_baudrate_correct( uint32_t );
+static bool poll_at_command( const uint8_t*, const uint8_t*, uint8_t, XbeeATCommandResponse* );
+static bool read_xbee_baudrate( uint32_t* );
+static uint32_t find_xbee_baudrate( uint32_t );
+static bool switch_xbee_baudrate( uint32_t, uint32_t );
+static uint32_t check_link( uint32_t );
+static void report_baudrate( uint32_t, uint32_t );
 static uint8_t baudrate_to_num( uint32_t );
+static uint8_t baudrate_to_param( uint32_t, uint8_t* );
 
-//Data received (from Xbee) event 
+//Data received (from Xbee) and data sent (to Xbee) events
 static void data_received_callback(void);
+static void data_sent_callback(void);
 
 //upper layer callbacks
 static void (*app_msg_reponse_callback)(XbeeStatus, uint8_t);
 static void (*app_msg_received_callback)(Message*);
 static void (*app_at_cmd_response_callback)(XbeeATCommandResponse*);
+static void (*app_frame_sent_callback)(void);
+
+//receive parser state (kept between bytes)
+static RxState rx_state = RX_WAITING_DELIMITER;
+static uint16_t rx_index;
+static ApiFrameReceived rx_frame;
+
+static XbeeStats stats;
+
+static const uint32_t baudrates[XBEE_N_BAUDRATES] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 }; ///< Standard baud rates (BD 0 to 7)
+static XbeeBaudrateReport baudrate_report;
 
 
 /**
 *	Registers the upper-layer message received callback.
 *
 *	Registers the upper-layer message received callback, which is called when
-*	a message is received in the Xbee.
+*	a message is received in the Xbee. The message comes from the message pool,
+*	and the callback is handed its reference: it must call xbee_msg_pool_release
+*	once done with it.
 *
 *	@param app_callback	the callback function
 */
@@ -145,30 +196,86 @@ void xbee_register_at_command_responded_callback( void(*response_callback)(XbeeA
 	app_at_cmd_response_callback = response_callback;
 }
 
+/**
+*	Registers the frame sent callback
+*
+*	Registers the upper-layer frame sent callback, which is called when
+*	the frames handed to the UART have been completely transmitted to the
+*	Xbee (this is not an ACK, see xbee_register_msg_responded_callback). It
+*	might be called from within UART1's handler.
+*
+*	@param sent_callback	the callback function
+*/
+void xbee_register_frame_sent_callback( void(*sent_callback)(void) ){
+	app_frame_sent_callback = sent_callback;
+}
+
 /**
 *	Initializes the Xbee
 *
 *	Configures and initializes the Xbee, if connected as per xbee_uart.
-*	It assumes The Xbee is pre-configured in API mode. This routine will halt if
-*	Xbee is not present.
+*	It assumes The Xbee is pre-configured in API mode. The Xbee is looked for at
+*	the baud rate desired first, then at every standard baud rate, and switched
+*	to the baud rate desired if found at another one (its non-volatile BD isn't
+*	written). With XBEE_BAUDRATE_UPGRADE defined, faster baud rates are then 
+*	tried in turn, for as long as they pass a link check (see xbee_get_baudrate_report).
 *
 *	@param baudrate	baudrate desired
 *
-*	@return true if the Xbee's baudrate matches the specified one, false otherwise
+*	@return true if the Xbee was found, false otherwise
 */
 uint32_t xbee_init( uint32_t baudrate ){
 	
+	//starts timebase
+	xbee_cpu_init();
+	
 	//sets data received callback
 	xbee_uart_register_callback( data_received_callback ); //from uart to xbee (this is how xbee_uart notifies xbee of incoming data)
+	xbee_uart_register_tx_done_callback( data_sent_callback ); //(and of outgoing data being sent)
 	
 	//init uart
 	xbee_uart_config_init(baudrate); //make sure xbee's baudrate matches this same baudrate
 	
 	
-	//Check Xbee baud rate is correct
-	if( !is_xbee_baudrate_correct(RADIO_SPEED_RATE) )
+	//Look for the Xbee
+	uint32_t found = find_xbee_baudrate(baudrate);
+	
+	if( !found )
 		return false;
+	
+	baudrate_report.found_baudrate = found;
+	baudrate_report.baudrate = found;
+
+#ifdef XBEE_UART_FLOW_CONTROL
+	//Have the Xbee honour RTS (D6) and drive CTS (D7)
+	XbeeATCommandResponse response;
+	uint8_t enabled = 1;
+	
+	poll_at_command( (uint8_t*)"D6", &enabled, 1, &response );
+	poll_at_command( (uint8_t*)"D7", &enabled, 1, &response );
+#endif
+	
+	//Switch it to the baud rate desired (staying where it was found if that fails)
+	if( found != baudrate && switch_xbee_baudrate(found, baudrate) )
+		baudrate_report.baudrate = baudrate;
 
+#ifdef XBEE_BAUDRATE_UPGRADE
+	//Go faster while the link holds
+	for( uint32_t i=0; i<XBEE_N_BAUDRATES; i++ ){
+		if( baudrates[i] <= baudrate_report.baudrate )
+			continue;
+		
+		if( !switch_xbee_baudrate(baudrate_report.baudrate, baudrates[i]) )
+			break;
+		
+		baudrate_report.baudrate = baudrates[i];
+	}
+#endif
+	
+	//(probing at the wrong baud rates leaves receive errors behind)
+	XbeeStats cleared = { 0 };
+	stats = cleared;
+	
 	//enable UART interrupts
 	xbee_uart_enable_interrupt();
 	
@@ -179,14 +286,18 @@ uint32_t xbee_init( uint32_t baudrate ){
 /**
 *	Send message
 *
-*	Constructs and transmits a TX Request (msg delivery) command.
+*	Constructs and transmits a TX Request (msg delivery) command. Messages
+*	longer than MSG_MAX_LENGTH are not sent.
 *
 *	@param msg pointer to the msg to be sent
 *	@param msg_id an id to be attached to the msg
 */
 void xbee_send_msg(Message *msg, uint8_t msg_id ){
 	ApiFrameMsg api_frame;
-
+	
+	if( msg->data_length > MSG_MAX_LENGTH )
+		return;
+	
 	//API ID
 	api_frame.command_id = API_ID_TX;	//Tx request
 	
@@ -218,7 +329,7 @@ void xbee_send_msg(Message *msg, uint8_t msg_id ){
 	
 	//Length of API frame
 	api_frame.length = msg->data_length + 5; //rf data length + options + destination (2) + frameid + cmd id
-	
+
 #ifdef XBEE_64_ADDR_MODE_ENABLED
 	api_frame.length += 6; //six extra bytes for holding 64bit address
 #endif
@@ -237,21 +348,88 @@ void xbee_send_msg(Message *msg, uint8_t msg_id ){
 *	@param command pointer to a null-terminated AT command
 *	@param params pointer to a null-terminated list (string) of params
 *	@param params_length number of parameters being passed
+*	@param frame_id an id to be attached to the command (and its response). 0 = no response
 */
-void xbee_send_at_command( const uint8_t* command, const uint8_t* params, uint8_t params_length ){
-	ApiFrameATCommand api_frame;
+void xbee_send_at_command( const uint8_t* command, const uint8_t* params, uint8_t params_length, uint8_t frame_id ){
+	send_at_command( API_ID_AT_COMMAND, command, params, params_length, frame_id );
+}
 
-	//sets fields
-	api_frame.command_id = API_ID_AT_COMMAND;	//At command request
-	api_frame.frame_id = 0x4D;			//random frame id... no need to correlate 
-	api_frame.length = 4 + params_length;// cmd_id+  frame_id + command (2) + params
-	api_frame.at_command = command;
-	api_frame.at_param = params;
-	api_frame.at_param_length = params_length;
-	
-	//creates (fills) and sends
-	create_at_command_frame( &api_frame );
-	send_at_command_frame( &api_frame );
+/**
+*	Queue AT Command
+*
+*	Constructs and transmits an AT Command (queue parameter value) request. 
+*	The Xbee holds the new value until an AC command (or a regular AT
+*	Command request) applies all the values queued.
+*
+*	@param command pointer to a null-terminated AT command
+*	@param params pointer to a null-terminated list (string) of params
+*	@param params_length number of parameters being passed
+*	@param frame_id an id to be attached to the command (and its response). 0 = no response
+*/
+void xbee_queue_at_command( const uint8_t* command, const uint8_t* params, uint8_t params_length, uint8_t frame_id ){
+	send_at_command( API_ID_AT_COMMAND_QUEUED, command, params, params_length, frame_id );
+}
+
+
+/**
+*	Baud rate report
+*
+*	Reports the baud rate the Xbee was found at by xbee_init, the one in use, 
+*	and the results of the link checks made at every baud rate switched to.
+*
+*	@param out where the report is copied
+*/
+void xbee_get_baudrate_report(XbeeBaudrateReport* out){
+	*out = baudrate_report;
+}
+
+/**
+*	Transmit ready
+*
+*	Tells whether a frame can be sent without waiting for the UART, and 
+*	without queueing behind more than about one frame.
+*
+*	@return true if a frame can be sent right away
+*/
+bool xbee_tx_ready(void){
+	return xbee_uart_tx_ready();
+}
+
+/**
+*	Xbee statistics
+*
+*	@param out where the receive statistics are copied
+*/
+void xbee_get_stats(XbeeStats* out){
+	*out = stats;
+}
+
+/**
+*	Process received data
+*
+*	Drains the bytes buffered by the UART, feeding them (in runs) to the
+*	receive parser. Frames completed are delivered to upper layers. With 
+*	XBEE_DEFERRED_RX_PROCESSING defined it must be called outside interrupt 
+*	context (e.g. from the main loop), otherwise it's called from the UART handler.
+*/
+void xbee_process_rx(void){
+	uint8_t chunk[RX_CHUNK_LENGTH];
+	size_t n;
+	
+	do{
+		//bytes were lost or corrupted here, abandon the frame being received
+		if( xbee_uart_take_rx_error() && rx_state != RX_WAITING_DELIMITER ){
+			rx_state = RX_WAITING_DELIMITER;
+			stats.rx_uart_errors++;
+		}
+		
+		n = xbee_uart_read(chunk, RX_CHUNK_LENGTH);
+		
+		for(size_t i=0; i<n; i++){
+			if( rx_process_byte( chunk[i] ) )
+				process_frame( &rx_frame );
+		}
+	}while( n > 0 );
 }
 
 
@@ -263,162 +441,292 @@ void xbee_send_at_command( const uint8_t* command, const uint8_t* params, uint8_
 *	Xbee Data Received Callback.
 *
 *	Lower-layer-to-Xbee data received event. It is executed every time 
-*	data has being received over the UART. This is where incoming transmissions are
-*	processed and delivered to upper layers accordingly. (This function is called 
-*	from within UART1's handler)
+*	a byte has being received over the UART (and buffered in the UART receive ring).
+*	(This function is called from within UART1's handler). Unless 
+*	XBEE_DEFERRED_RX_PROCESSING is defined, buffered bytes are processed here
+*	right away.
 *
 */
 static void data_received_callback(void){
+#ifndef XBEE_DEFERRED_RX_PROCESSING
+	xbee_process_rx();
+#endif
+}
+
+/**
+*	Xbee Data Sent Callback.
+*
+*	Lower-layer-to-Xbee data sent event. Executed when every frame
+*	handed to the UART has left it.
+*/
+static void data_sent_callback(void){
+	if( app_frame_sent_callback )
+		(*app_frame_sent_callback)();
+}
+
+/**
+*	Receive parser.
+*
+*	Consumes one byte of an incoming API frame. The parser state (delimiter,
+*	length, API ID, data and checksum) is kept between calls, so frames
+*	are assembled one byte at a time. Lengths are checked against the API ID
+*	as soon as it's known, and checksums are verified. On any error the parser
+*	resyncs on the next start delimiter.
+*
+*	@param c the byte received
+*
+*	@return true if the byte completed a (valid) frame (available in rx_frame)
+*/
+static bool rx_process_byte( uint8_t c ){
 	
-	//ignore until start delimiter found
-	while( xbee_uart_getc() != START_DELIMITER );
+	switch(rx_state){
+		
+		case RX_WAITING_DELIMITER:
+			//ignore until start delimiter found
+			if( c == START_DELIMITER )
+				rx_state = RX_READING_LENGTH_MSB;
+			break;
+		
+		case RX_READING_LENGTH_MSB:
+			//no frame is that long, it's not a length
+			if( c > (RX_FRAME_MAX_LENGTH >> 8) ){
+				stats.rx_length_errors++;
+				rx_resync(c);
+				break;
+			}
+			
+			rx_frame.length = (uint16_t)c<<8;
+			rx_state = RX_READING_LENGTH_LSB;
+			break;
+		
+		case RX_READING_LENGTH_LSB:
+			rx_frame.length += c;
+			
+			if( rx_frame.length == 0 || rx_frame.length > RX_FRAME_MAX_LENGTH ){
+				stats.rx_length_errors++;
+				rx_resync(c);
+				break;
+			}
+			
+			rx_state = RX_READING_API_ID;
+			break;
+		
+		case RX_READING_API_ID:
+			//bogus length for this API ID, don't consume it
+			if( !rx_is_length_valid( c, rx_frame.length ) ){
+				stats.rx_length_errors++;
+				rx_resync(c);
+				break;
+			}
+			
+			rx_frame.api_id = c;
+			rx_index = 0;
+			rx_state = (rx_frame.length > 1) ? RX_READING_DATA : RX_READING_CHECKSUM;
+			break;
+		
+		case RX_READING_DATA:
+			rx_frame.data[rx_index] = c;
+			
+			if( ++rx_index >= rx_frame.length - 1 )
+				rx_state = RX_READING_CHECKSUM;
+			break;
+		
+		case RX_READING_CHECKSUM:
+			rx_frame.checksum = c;
+			
+			//API ID, data and checksum must add up to 0xFF
+			uint8_t sum = rx_frame.api_id + xbee_cpu_sum( rx_frame.data, rx_frame.length - 1 ) + c;
+			
+			if( sum != 0xFF ){
+				stats.rx_checksum_errors++;
+				rx_resync(c);
+				break;
+			}
+			
+			stats.rx_frames++;
+			rx_state = RX_WAITING_DELIMITER;
+			return true;
+	}
 	
-	//length 
-	uint16_t length = (uint16_t)(xbee_uart_getc())<<8;
-	length += xbee_uart_getc();
+	return false;
+}
+
+/**
+*	Receive parser resync.
+*
+*	Abandons the frame being received. If the offending byte is a start
+*	delimiter it's taken as the start of the next frame.
+*
+*	@param c the offending byte
+*/
+static void rx_resync( uint8_t c ){
+	rx_state = (c == START_DELIMITER) ? RX_READING_LENGTH_MSB : RX_WAITING_DELIMITER;
+}
+
+/**
+*	Receive length check
+*
+*	Checks an API frame length is consistent with its API ID.
+*
+*	@param api_id the API ID
+*	@param length the length (API ID included)
+*
+*	@return true if length is valid
+*/
+static bool rx_is_length_valid( uint8_t api_id, uint16_t length ){
 	
-	//Read API (cmd) Identifier
-	uint8_t api_id = xbee_uart_getc();
+	switch(api_id){
+		case API_ID_AT_COMMAND_RESPONSE:		//api id + frame id + command (2) + status + value
+			return length >= 5 && length <= 5 + XBEE_MAX_AT_COMMAND_RESPONSE_LENGTH;
+		case API_ID_MESSAGE_RESPONSE:			//api id + frame id + status
+			return length == 3;
+		case API_ID_MESSAGE_RECEIVED_16bit:		//api id + address (2) + rssi + options + rf data
+			return length >= 5 && length <= 5 + 100;
+		case API_ID_MESSAGE_RECEIVED_64bit:		//api id + address (8) + rssi + options + rf data
+			return length >= 11 && length <= 11 + 100;
+		case API_ID_MODEM_STATUS:				//api id + status
+			return length == 2;
+		default:
+			return length <= RX_FRAME_MAX_LENGTH;
+	}
+}
 
-	//report event (to upper layers) accordingly
+/**
+*	Process frame.
+*
+*	Decodes a complete API frame and reports the event (to upper layers)
+*	accordingly.
+*
+*	@param frame the frame received
+*/
+static void process_frame( ApiFrameReceived* frame ){
+	
 	XbeeATCommandResponse response;
 	XbeeStatus msg_status;
 	uint8_t msg_id;
-	Message msg;
+	Message* msg;
 	
-	switch(api_id){
+	switch(frame->api_id){
 		
 		case API_ID_AT_COMMAND_RESPONSE: 
 			// --- AT Commands response received --
 			
-			if( read_at_command_response(&response, length) ){
-				//notify app
-				(*app_at_cmd_response_callback)(&response);
-			}
-			else{
-				//wrong checksum...not notify... fix this 
-			}
-			break;
+			read_at_command_response(&response, frame);
 			
+			//notify app
+			(*app_at_cmd_response_callback)(&response);
+			break;
+		
 		case API_ID_MESSAGE_RESPONSE: 
 			// --- Message response received ---
 			
-			if( read_msg_response( &msg_status, &msg_id, length ) ){
-				//notify app
-				(*app_msg_reponse_callback)(msg_status, msg_id);
-			}
-			else{
-				//wrong checksum... not notify... fix this later
-			}
-			break;
+			read_msg_response( &msg_status, &msg_id, frame );
 			
+			//notify app
+			(*app_msg_reponse_callback)(msg_status, msg_id);
+			break;
+		
 		case API_ID_MESSAGE_RECEIVED_16bit: 
 			// --- Message received (16-bit address version) ---
 			
-			if( read_msg(&msg, length) ){
-				//notify app
-				(*app_msg_received_callback)(&msg);
+			//built in place in a pool message (big enough for the payload)
+			msg = xbee_msg_pool_alloc( frame->length - 5 );
+			
+			if( !msg ){
+				//pool exhausted
+				stats.rx_msgs_dropped++;
+			}
+			else if( read_msg(msg, frame) ){
+				//notify app (which now holds the message)
+				(*app_msg_received_callback)(msg);
 			}
 			else{
-				//wrong checksum... notify app?.... fix this later
-			
+				xbee_msg_pool_release(msg);
 			}
 			break;
-			
+		
 		case API_ID_MESSAGE_RECEIVED_64bit:
 			// ---- ignore msg's using 64bit address ---- FOR NOW
-			for(uint16_t i=0; i<length; i++){
-				xbee_uart_getc();	
-			}
 			break;
-			
+		
 		case API_ID_MODEM_STATUS:
 			// ---- ignore modem status ---- FOR NOW
 			//This is not used unless certain event occur in the Xbee
 			// (e.g. Watchdog timer reset, Coordinator started, etc)
 			// With the functionality included so far, no modem
 			// status should be received.
-
-			xbee_uart_getc();
-			xbee_uart_getc();
 			break;
 		
 		default:
 			//something went wrong
+			stats.rx_unknown_frames++;
 			break;
 	}
-
 }
 
 
 /**
 *	Read AT Command response
 *
-*	Reads an AT command response API frame from the UART.  
+*	Reads an AT command response from a received (and verified) API frame.  
 *
 *	@param response pointer to the AT command response to be populated
-*	@param length length of the API frame data 
+*	@param frame the API frame received
 *
-*	@return true if checksum was OK
+*	@return true if the response could be read
 */
-static bool read_at_command_response( XbeeATCommandResponse *response, uint16_t length ){
-
-	response->value_requested_length = length - 5;
+static bool read_at_command_response( XbeeATCommandResponse *response, ApiFrameReceived* frame ){
+	
+	response->value_requested_length = frame->length - 5;
 	
-	//ignore frame id
-	xbee_uart_getc();
+	//(longer values don't fit, and no command we use returns one)
+	if( response->value_requested_length > XBEE_MAX_AT_COMMAND_RESPONSE_LENGTH )
+		response->value_requested_length = XBEE_MAX_AT_COMMAND_RESPONSE_LENGTH;
 	
-	//ignore AT command
-	xbee_uart_getc();
-	xbee_uart_getc();
+	//read frame id and AT command
+	response->frame_id = frame->data[0];
+	response->command[0] = frame->data[1];
+	response->command[1] = frame->data[2];
 	
 	//read status
-	response->status = xbee_uart_getc();
+	response->status = frame->data[3];
 	
 	//reads value requested
 	for(uint32_t i=0; i<response->value_requested_length;i++){
-		response->value_requested[i] = xbee_uart_getc();
+		response->value_requested[i] = frame->data[4 + i];
 	}
 	
-	//ignore checksum..... fix this!
-	xbee_uart_getc();
-	
 	return true;
 }
 
 /**
 *	Read message
 *
-*	Reads a message receive API frame from the UART.
+*	Reads a message from a received (and verified) API frame.
 *
 *	@param msg pointer to the msg buffer to be populated
-*	@param length length of the API frame data 
+*	@param frame the API frame received
 *
-*	@return true if checksum was OK
+*	@return true if the message could be read
 */
-static bool read_msg(Message* msg, uint16_t length){
-	
+static bool read_msg(Message* msg, ApiFrameReceived* frame){
 	
 	//length of rf data (aka mac payload)
-	msg->data_length = length - 5;
+	msg->data_length = frame->length - 5;
 	
 	//source address
-	msg->address = ((uint16_t)xbee_uart_getc())<<8;
-	msg->address += xbee_uart_getc();
+	msg->address = ((uint16_t)frame->data[0])<<8;
+	msg->address += frame->data[1];
 	
 	//rssi
-	msg->rssi = xbee_uart_getc();
+	msg->rssi = frame->data[2];
 	
-	//ignore option
-	xbee_uart_getc();
+	//ignore option (data[3])
 	
 	for(uint32_t i=0; i<msg->data_length; i++){
-		msg->data[i] = xbee_uart_getc();
+		msg->data[i] = frame->data[4 + i];
 	}
 	
-	//discard checkcum... fix this later
-	xbee_uart_getc();
-	
 	return true;
 }
 
@@ -426,25 +734,22 @@ static bool read_msg(Message* msg, uint16_t length){
 /**
 *	Read message response
 *
-*	Reads a message response API frame from the UART.
+*	Reads a message response from a received (and verified) API frame.
 *
 *	@param status pointer to the status variable to be populated
-*	@param length length of the API frame data 
+*	@param msg_id pointer to the msg id variable to be populated
+*	@param frame the API frame received
 *
-*	@return true if checksum was OK
+*	@return true if the response could be read
 */
 
-static bool read_msg_response(XbeeStatus* status, uint8_t* msg_id, uint16_t length){
-	//ignore length... fix this
+static bool read_msg_response(XbeeStatus* status, uint8_t* msg_id, ApiFrameReceived* frame){
 	
 	//frame id
-	*msg_id = xbee_uart_getc();
+	*msg_id = frame->data[0];
 	
 	//response
-	*status = xbee_uart_getc();
-	
-	//discard checkcum... fix this later
-	xbee_uart_getc();
+	*status = frame->data[1];
 	
 	return true;
 }
@@ -470,9 +775,7 @@ static void create_msg_frame( ApiFrameMsg *api_frame ){
 	sum += api_frame->dest_address[0];
 	sum += api_frame->dest_address[1];
 	sum += api_frame->options;
-
-	for( uint32_t i = 0; i < api_frame->rf_data_length ; i++ ) //careful with the minus 1
-	sum += api_frame->rf_data[i];
+	sum += xbee_cpu_sum( api_frame->rf_data, api_frame->rf_data_length );
 	
 	api_frame->checksum = 0xFF - (uint8_t)sum;
 }
@@ -480,51 +783,57 @@ static void create_msg_frame( ApiFrameMsg *api_frame ){
 /**
 *	Does the actual sending of an API msg frame
 *
+*	The frame is serialized (once) into the UART transmit buffer,
+*	and then handed to the UART.
+*
 *	@param api_frame the frame to be sent
 *
 */
 static void send_msg_frame( ApiFrameMsg *frame ){
-	//in the presence of an OS (with threads) this function should execute atomically
-	//Since the Xbee is a shared resource...
+	//one frame is written at a time (one sent from an interrupt handler while
+	//another is being written is dropped, see xbee_uart_get_tx_buffer)
+	uint8_t* buffer = xbee_uart_get_tx_buffer();
+	uint16_t n = 0;
 	
-	//LOCK
+	if( !buffer )
+		return;
 	
-	//send delimiter and length
-	xbee_uart_putc( frame->start_delimiter );
+	//send delimiter
+	buffer[n++] = frame->start_delimiter;
 	
 	//send length
-	xbee_uart_putc( (uint8_t)(frame->length >> 8) );
-	xbee_uart_putc( (uint8_t)(frame->length) );
+	buffer[n++] = (uint8_t)(frame->length >> 8);
+	buffer[n++] = (uint8_t)(frame->length);
 	
 	//send cmd id
-	xbee_uart_putc( frame->command_id );
+	buffer[n++] = frame->command_id;
 	
-	//send cmd id
-	xbee_uart_putc( frame->frame_id );
+	//send frame id
+	buffer[n++] = frame->frame_id;
 	
 	//send dest address
 #ifdef XBEE_64_ADDR_MODE_ENABLED
 	for(uint32_t i=0; i<8; i++){
-		xbee_uart_putc( frame->dest_address[i] );
+		buffer[n++] = frame->dest_address[i];
 	}
 #else
 	for(uint32_t i=0; i<2; i++){
-		xbee_uart_putc( frame->dest_address[i] );
+		buffer[n++] = frame->dest_address[i];
 	}
 #endif
-
+	
 	//send options
-	xbee_uart_putc( frame->options );
+	buffer[n++] = frame->options;
 	
 	//send rf data
 	for(uint32_t i=0; i<frame->rf_data_length; i++){
-		xbee_uart_putc( frame->rf_data[i] );
+		buffer[n++] = frame->rf_data[i];
 	}
 	
 	//send checksum
-	xbee_uart_putc(  frame->checksum );
+	buffer[n++] = frame->checksum;
 	
-	//UNLOCK....
+	xbee_uart_send_tx_buffer(n);
 }
 
 /**
@@ -548,52 +857,81 @@ static void create_at_command_frame( ApiFrameATCommand *api_frame ){
 	sum += api_frame->frame_id;
 	sum += api_frame->at_command[0];
 	sum += api_frame->at_command[1];
-
-	for( uint32_t i = 0; i < api_frame->at_param_length ; i++ ) //careful with the minus 1
-		sum += api_frame->at_param[i];
+	sum += xbee_cpu_sum( api_frame->at_param, api_frame->at_param_length );
 	
 	api_frame->checksum = 0xFF - (uint8_t)sum;
 }
 
+/**
+*	Send AT Command
+*
+*	Constructs and transmits an AT Command request of either kind
+*
+*	@param api_id API ID of the request (API_ID_AT_COMMAND or API_ID_AT_COMMAND_QUEUED)
+*	@param command pointer to a null-terminated AT command
+*	@param params pointer to a null-terminated list (string) of params
+*	@param params_length number of parameters being passed
+*	@param frame_id an id to be attached to the command (and its response)
+*/
+static void send_at_command( uint8_t api_id, const uint8_t* command, const uint8_t* params, uint8_t params_length, uint8_t frame_id ){
+	ApiFrameATCommand api_frame;
+	
+	//sets fields
+	api_frame.command_id = api_id;
+	api_frame.frame_id = frame_id;
+	api_frame.length = 4 + params_length;// cmd_id+  frame_id + command (2) + params
+	api_frame.at_command = command;
+	api_frame.at_param = params;
+	api_frame.at_param_length = params_length;
+	
+	//creates (fills) and sends
+	create_at_command_frame( &api_frame );
+	send_at_command_frame( &api_frame );
+}
+
 /**
 *	Does the actual sending of an API AT Command frame
 *
+*	The frame is serialized (once) into the UART transmit buffer,
+*	and then handed to the UART.
+*
 *	@param api_frame the frame to be sent
 *
 */
 static void send_at_command_frame( ApiFrameATCommand *frame ){
-	//in the presence of an OS (with threads) this function should execute atomically
-	//Since the Xbee is a shared resource and this is one single Xbee operatoin...
-	
-	//LOCK
+	//one frame is written at a time (see send_msg_frame)
+	uint8_t* buffer = xbee_uart_get_tx_buffer();
+	uint16_t n = 0;
 	
+	if( !buffer )
+		return;
 	
 	//send delimiter
-	xbee_uart_putc( frame->start_delimiter );
+	buffer[n++] = frame->start_delimiter;
 	
 	//send length
-	xbee_uart_putc( (uint8_t)(frame->length >> 8) );
-	xbee_uart_putc( (uint8_t)(frame->length));
+	buffer[n++] = (uint8_t)(frame->length >> 8);
+	buffer[n++] = (uint8_t)(frame->length);
 	
 	//send cmd id
-	xbee_uart_putc( frame->command_id );
+	buffer[n++] = frame->command_id;
 	
 	//send frame id
-	xbee_uart_putc( frame->frame_id );
+	buffer[n++] = frame->frame_id;
 	
 	//send at command
-	xbee_uart_putc( frame->at_command[0] );
-	xbee_uart_putc( frame->at_command[1] );
+	buffer[n++] = frame->at_command[0];
+	buffer[n++] = frame->at_command[1];
 	
 	//send parameter value
 	for(uint32_t i=0; i< frame->at_param_length; i++){
-		xbee_uart_putc( frame->at_param[i] );
+		buffer[n++] = frame->at_param[i];
 	}
-
+	
 	//send checksum
-	xbee_uart_putc( frame->checksum );
+	buffer[n++] = frame->checksum;
 	
-	//unlock
+	xbee_uart_send_tx_buffer(n);
 }
 
 /**
@@ -617,54 +955,215 @@ static uint8_t baudrate_to_num(uint32_t value){
 }
 
 /**
-*	Checks the Xbee's baudrate is the same as the specified
+*	Poll AT command
 *
-*	@param baudrate the baudrate to be verified
+*	Sends an AT command and waits for its response, feeding the receive parser
+*	by polling (UART interrupts aren't enabled yet). Used at init only.
 *
-*	@return true if baud rates match 
+*	@param command pointer to the AT command
+*	@param params pointer to the parameter value
+*	@param params_length length of the parameter value
+*	@param response where the response is stored
 *
+*	@return true if the command was responded with status OK within BAUDRATE_PROBE_TIMEOUT
 */
-static bool is_xbee_baudrate_correct( uint32_t baudrate){
+static bool poll_at_command( const uint8_t* command, const uint8_t* params, uint8_t params_length, XbeeATCommandResponse* response ){
+	uint32_t deadline = xbee_cpu_get_us() + BAUDRATE_PROBE_TIMEOUT * 1000;
+	uint8_t c;
+	
+	xbee_send_at_command( command, params, params_length, INIT_FRAME_ID );
 	
-	// -- Read baud rate --
+	while( !xbee_cpu_is_past(deadline) ){
+		if( !xbee_uart_try_getc(&c) || !rx_process_byte(c) )
+			continue;
+		
+		if( rx_frame.api_id != API_ID_AT_COMMAND_RESPONSE || rx_frame.data[0] != INIT_FRAME_ID )
+			continue;
+		
+		read_at_command_response( response, &rx_frame );
+		
+		return response->status == 0;
+	}
 	
-	xbee_send_at_command( (uint8_t*)"BD", (uint8_t*)"", 0 );
+	return false;
+}
 
-	// -- Read response --
+/**
+*	Reads the Xbee's baudrate
+*
+*	@param baudrate where the baudrate is stored
+*
+*	@return true if the Xbee responded
+*/
+static bool read_xbee_baudrate( uint32_t* baudrate ){
+	XbeeATCommandResponse response;
 	
-	while( xbee_uart_getc() != START_DELIMITER );
+	if( !poll_at_command( (uint8_t*)"BD", (uint8_t*)"", 0, &response ) )
+		return false;
 	
-	//length
-	xbee_uart_getc();
-	xbee_uart_getc();
+	//value requested (the baud rate)
+	uint32_t br = 0;
+	for(uint32_t i=0; i<response.value_requested_length; i++){
+		br = (br << 8) + response.value_requested[i];
+	}
 	
-	//Read API (cmd) Identifier
-	xbee_uart_getc();
+	//standard baud rates are numbered, others are given as is
+	*baudrate = (br < XBEE_N_BAUDRATES) ? baudrates[br] : br;
 	
-	//frame id
-	xbee_uart_getc();
+	return true;
+}
+
+/**
+*	Finds the Xbee's baudrate
+*
+*	Probes the preferred baud rate, then every standard one, until the Xbee
+*	answers (which also tells its BD, so a non-standard baud rate can be
+*	found as long as it's the preferred one). The UART is left at the baud 
+*	rate found.
+*
+*	@param preferred the baud rate probed first
+*
+*	@return the baud rate found, 0 if the Xbee didn't answer at any
+*/
+static uint32_t find_xbee_baudrate( uint32_t preferred ){
+	uint32_t br;
+	
+	for( uint32_t round=0; round<BAUDRATE_PROBE_ROUNDS; round++ ){
+		for( int32_t i=-1; i<XBEE_N_BAUDRATES; i++ ){
+			uint32_t probed = (i < 0) ? preferred : baudrates[i];
+			
+			if( i >= 0 && probed == preferred )
+				continue;
+			
+			xbee_uart_set_baudrate(probed);
+			rx_state = RX_WAITING_DELIMITER;
+			
+			if( read_xbee_baudrate(&br) && br == probed )
+				return probed;
+		}
+	}
 	
-	//AT command
-	xbee_uart_getc();
-	xbee_uart_getc();
+	return 0;
+}
+
+/**
+*	Switches the Xbee's baudrate
+*
+*	Changes BD (applied with AC, not written to non-volatile), follows with the
+*	UART, and checks the link. If the check fails both go back to the 
+*	previous baud rate.
+*
+*	@param from the baud rate in use
+*	@param to the new baud rate
+*
+*	@return true if the new baud rate passed the link check
+*/
+static bool switch_xbee_baudrate( uint32_t from, uint32_t to ){
+	XbeeATCommandResponse response;
+	uint8_t param[4];
+	uint8_t param_length;
+	uint32_t frames_per_s;
 	
-	//status
-	xbee_uart_getc();
+	param_length = baudrate_to_param( to, param );
 	
-	//value requested (the baud rate)
-	volatile uint8_t br = xbee_uart_getc() << 24;
-	br += xbee_uart_getc() << 16;
-	br += xbee_uart_getc() << 8;
-	br += xbee_uart_getc() << 0;
+	if( !poll_at_command( (uint8_t*)"BD", param, param_length, &response ) )
+		return false;
 	
-	//checksum
-	xbee_uart_getc();
+	//(the response may come at either baud rate, so it isn't checked)
+	poll_at_command( (uint8_t*)"AC", (uint8_t*)"", 0, &response );
 	
+	xbee_uart_set_baudrate(to);
+	rx_state = RX_WAITING_DELIMITER;
 	
-	// -- compare --
+	frames_per_s = check_link(to);
+	report_baudrate( to, frames_per_s );
 	
-	if(br <= 7)
-		return br == baudrate_to_num( baudrate );
-	else
-		return br == baudrate;
-}
\ No newline at end of file
+	if( frames_per_s > 0 )
+		return true;
+	
+	//fall back (finding the Xbee again if it doesn't follow)
+	param_length = baudrate_to_param( from, param );
+	
+	poll_at_command( (uint8_t*)"BD", param, param_length, &response );
+	poll_at_command( (uint8_t*)"AC", (uint8_t*)"", 0, &response );
+	
+	xbee_uart_set_baudrate(from);
+	rx_state = RX_WAITING_DELIMITER;
+	
+	if( !check_link(from) )
+		find_xbee_baudrate(from);
+	
+	return false;
+}
+
+/**
+*	Baud rate to BD parameter
+*
+*	BD is numbered for standard baud rates, and the baud rate itself otherwise.
+*
+*	@param baudrate the baud rate
+*	@param param where the parameter value is stored (big endian, up to 4 bytes)
+*
+*	@return the length of the parameter value
+*/
+static uint8_t baudrate_to_param( uint32_t baudrate, uint8_t* param ){
+	uint8_t num = baudrate_to_num(baudrate);
+	
+	if( num < XBEE_N_BAUDRATES ){
+		param[0] = num;
+		return 1;
+	}
+	
+	param[0] = (uint8_t)(baudrate >> 24);
+	param[1] = (uint8_t)(baudrate >> 16);
+	param[2] = (uint8_t)(baudrate >> 8);
+	param[3] = (uint8_t)baudrate;
+	
+	return 4;
+}
+
+/**
+*	Link check
+*
+*	Reads BD BAUDRATE_CHECK_COMMANDS times. All must be answered, with valid 
+*	frames, and the right baud rate.
+*
+*	@param baudrate the baud rate in use
+*
+*	@return API frames exchanged per second, 0 if the check failed
+*/
+static uint32_t check_link( uint32_t baudrate ){
+	uint32_t errors = stats.rx_checksum_errors + stats.rx_length_errors;
+	uint32_t start = xbee_cpu_get_us();
+	uint32_t br;
+	
+	for( uint32_t i=0; i<BAUDRATE_CHECK_COMMANDS; i++ ){
+		if( !read_xbee_baudrate(&br) || br != baudrate )
+			return 0;
+	}
+	
+	if( stats.rx_checksum_errors + stats.rx_length_errors != errors )
+		return 0;
+	
+	uint32_t elapsed = xbee_cpu_get_us() - start;
+	
+	//(a command and a response per read)
+	return (2 * BAUDRATE_CHECK_COMMANDS * 1000000) / (elapsed ? elapsed : 1);
+}
+
+/**
+*	Report baud rate
+*
+*	Adds a link check result to the baud rate report.
+*
+*	@param baudrate the baud rate checked
+*	@param frames_per_s the check result
+*/
+static void report_baudrate( uint32_t baudrate, uint32_t frames_per_s ){
+	if( baudrate_report.n_results >= XBEE_N_BAUDRATES )
+		return;
+	
+	baudrate_report.results[baudrate_report.n_results].baudrate = baudrate;
+	baudrate_report.results[baudrate_report.n_results].frames_per_s = frames_per_s;
+	baudrate_report.n_results++;
+}
@@ -34,21 +34,51 @@
 #include "message.h"
 
 #define XBEE_MAX_AT_COMMAND_RESPONSE_LENGTH	8	///< Max length possible of an AT Command response
+#define XBEE_N_BAUDRATES					8	///< Number of standard baud rates
 
 typedef uint32_t XbeeStatus;	///< Xbee Status 
 
 typedef struct{ ///< AT Command response API frame
+	uint8_t frame_id;												///< Frame ID of the command responded
+	uint8_t command[2];												///< AT command responded
 	uint8_t status;													///< Status 
 	uint8_t value_requested[XBEE_MAX_AT_COMMAND_RESPONSE_LENGTH];	///< Value requested
 	uint8_t value_requested_length;									///< Length of value requested
 }XbeeATCommandResponse;			
 
+typedef struct{ ///< Xbee receive statistics
+	uint32_t rx_frames;				///< valid frames received
+	uint32_t rx_checksum_errors;	///< frames dropped because of a wrong checksum
+	uint32_t rx_length_errors;		///< frames dropped because of a bogus length
+	uint32_t rx_unknown_frames;		///< valid frames with an unknown API ID
+	uint32_t rx_uart_errors;		///< frames abandoned because of UART receive errors (see xbee_uart_get_stats)
+	uint32_t rx_msgs_dropped;		///< messages dropped because the message pool was exhausted
+}XbeeStats;
+
+typedef struct{ ///< Link check result at a baud rate
+	uint32_t baudrate;
+	uint32_t frames_per_s;		///< API frames (AT commands and responses) exchanged per second, 0 if the check failed
+}XbeeBaudrateResult;
+
+typedef struct{ ///< Baud rate discovery and upgrade report (as done by xbee_init)
+	uint32_t found_baudrate;	///< baud rate the Xbee was found at
+	uint32_t baudrate;			///< baud rate in use
+	uint32_t n_results;			///< number of link checks made
+	XbeeBaudrateResult results[XBEE_N_BAUDRATES];
+}XbeeBaudrateReport;
+
 
 uint32_t xbee_init(uint32_t);
 void xbee_send_msg(Message*, uint8_t);
-void xbee_send_at_command( const uint8_t*, const uint8_t*, uint8_t );
+void xbee_send_at_command( const uint8_t*, const uint8_t*, uint8_t, uint8_t );
+void xbee_queue_at_command( const uint8_t*, const uint8_t*, uint8_t, uint8_t );
+void xbee_process_rx(void);
+bool xbee_tx_ready(void);
+void xbee_get_stats(XbeeStats*);
+void xbee_get_baudrate_report(XbeeBaudrateReport*);
 void xbee_register_msg_received_callback( void (*)(Message*) );
 void xbee_register_at_command_responded_callback( void (*)(XbeeATCommandResponse*) );
 void xbee_register_msg_responded_callback( void(*)(XbeeStatus, uint8_t) );
+void xbee_register_frame_sent_callback( void(*)(void) );
 
 #endif /* XBEE_H_ */
\ No newline at end of file
@@ -31,9 +31,36 @@
 #ifndef XBEE_CPU_H_
 #define XBEE_CPU_H_
 
+typedef enum{ ///< What a wait is for (see xbee_cpu_wait_end)
+	XBEE_CPU_WAIT_AT_RESPONSE,		///< room for an AT command, or its response (radio.c)
+	XBEE_CPU_WAIT_UART_TX,			///< room to transmit, or transmission to end (xbee_uart.c)
+	XBEE_CPU_WAIT_DELAY,			///< xbee_cpu_delay_ms
+	XBEE_CPU_N_WAITS
+}XbeeCpuWait;
+
+typedef struct{ ///< Time spent in one kind of wait
+	uint32_t waits;			///< waits done
+	uint64_t total_us;		///< time spent waiting, in all
+	uint32_t max_us;		///< longest wait
+}XbeeCpuWaitStats;
+
+void xbee_cpu_init(void);
+uint32_t xbee_cpu_get_ms(void);
+uint32_t xbee_cpu_get_us(void);
+bool xbee_cpu_is_past(uint32_t);
 bool xbee_cpu_is_little_endian(void);
 uint16_t xbee_cpu_swap_endianness_16bit(uint16_t);
+uint32_t xbee_cpu_sum(const uint8_t*, uint32_t);
+uint32_t xbee_cpu_enter_critical(void);
+void xbee_cpu_exit_critical(uint32_t);
+bool xbee_cpu_in_interrupt(void);
+uint32_t xbee_cpu_read_retained(void);
+void xbee_cpu_write_retained(uint32_t);
 void xbee_cpu_delay_ms(uint32_t);
+void xbee_cpu_register_yield_callback( void(*)(void) );
+void xbee_cpu_wait(void);
+void xbee_cpu_wait_end(XbeeCpuWait, uint32_t);
+void xbee_cpu_get_wait_stats(XbeeCpuWait, XbeeCpuWaitStats*);
 
 
 #endif /* XBEE_CPU_H_ */
\ No newline at end of file
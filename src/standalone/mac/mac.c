@@ -32,11 +32,74 @@
 
 #include <stdint-gcc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "xbee/xbee.h"
+#include "xbee/xbee_cpu.h"
+#include "xbee/xbee_msg_pool.h"
 #include "radio/radio.h"
 #include "mac.h"
+#include "mac_frag.h"
+#include "mac_bulk.h"
 #include "mac_config.h"
 
+#define EVENT_QUEUE_SIZE	8	///< Max events waiting to be dispatched (MAC_DEFERRED_DISPATCH only). Must be a power of two
+#define EVENT_QUEUE_MASK	(EVENT_QUEUE_SIZE - 1)
+#define TX_MAX_IN_FLIGHT	4		///< Max unicast messages sent and waiting for their TX status (ack, timeout, ...)
+#define TX_STATUS_TIMEOUT	2000	///< ms to wait for a TX status before giving its frame ID up (status frame lost)
+#define FINGERPRINT_VERSION	1		///< Bump when the way the radio is configured changes (invalidates fingerprints kept)
+#define TX_QUEUE_LENGTH		4		///< Max messages waiting per priority (all destinations)
+#define TX_POOL_SIZE		(TX_QUEUE_LENGTH * MAC_N_PRIORITIES)	///< Messages waiting, in all
+#define TX_NONE				0xFF	///< No entry (TX queue links)
+#define TX_DEST_MASK		(MAC_N_DESTINATIONS - 1)
+#ifdef MAC_MAX_IN_FLIGHT_PER_DEST
+#define TX_MAX_IN_FLIGHT_PER_DEST	MAC_MAX_IN_FLIGHT_PER_DEST	///< Max unicast messages waiting for their ack per destination (the rest of its traffic waits)
+#else
+#define TX_MAX_IN_FLIGHT_PER_DEST	TX_MAX_IN_FLIGHT
+#endif
+#define TX_MAX_IN_FLIGHT_FAILING	1	///< Max unicast messages waiting for their ack to a destination failing (last message not acked, or being probed)
+#define BREAKER_THRESHOLD	3		///< Messages in a row not acked that open a destination's circuit breaker
+#define BREAKER_BACKOFF_MIN	1000	///< ms before the first probe of a destination deemed unreachable
+#define BREAKER_BACKOFF_MAX	60000	///< Max ms between probes (the backoff doubles after every failed probe)
+#define TX_AGING_PERIOD		250		///< ms a queued message waits to be raised one priority level (so low priorities are never starved)
+
+typedef enum{ ///< MAC event types
+	MAC_EVENT_MSG_RECEIVED,
+	MAC_EVENT_ACK_RECEIVED
+}MacEventType;
+
+typedef struct{ ///< MAC event (waiting to be dispatched to the app)
+	MacEventType type;
+	Message* msg;		///< message received, NULL if dropped (MAC_EVENT_MSG_RECEIVED), or message acked (MAC_EVENT_ACK_RECEIVED)
+	uint8_t status;		///< ack status (MAC_EVENT_ACK_RECEIVED)
+}MacEvent;
+
+typedef struct{ ///< Message sent, waiting for its TX status
+	Message* msg;		///< message handle, as passed to mac_send (NULL = free entry)
+	uint32_t sent_ms;	///< when it was sent
+	uint16_t address;	///< its destination
+	uint8_t frame_id;	///< frame ID its TX status will carry
+	bool done;			///< its TX status is in, waiting to be reported from mac_poll (MAC_DEFERRED_DISPATCH)
+	uint8_t status;		///< that TX status
+}TxInFlight;
+
+typedef struct{ ///< Message waiting in a TX queue (a copy, the sender's message can be reused)
+	Message* handle;				///< message as passed to mac_send_prio (handle for its TX status)
+	uint32_t queued_ms;				///< when it was queued
+	bool used;						///< whether the entry holds a message
+	uint8_t next;					///< next message in the same queue (TX_NONE = last)
+	uint8_t data_length;			///< length of data
+	uint8_t data[MSG_MAX_LENGTH];	///< payload
+}TxQueued;
+
+typedef struct{ ///< Destination (entry of the destination hash map), with a TX queue (FIFO) per priority
+	bool used;						///< whether the entry is in use
+	uint8_t head[MAC_N_PRIORITIES];	///< oldest message of each queue (TX_NONE = empty)
+	uint8_t tail[MAC_N_PRIORITIES];	///< newest message of each queue
+	uint32_t last_ms;				///< when a message was last queued
+	uint32_t probe_ms;				///< when the next probe may go (circuit breaker open)
+	uint32_t backoff_ms;			///< time between the last probe and the next one
+	MacDestStats stats;				///< its address (the key), queue state, circuit breaker and counters
+}TxDest;
 
 //Xbee to MAC Callbacks
 static void msg_received(Message*);				///< Xbee-to-MAC messasge received callback
@@ -45,8 +108,63 @@ static void msg_response(XbeeStatus, uint8_t);	///< Xbee-to-MAC msg response rec
 //MAC to App callbacks
 static void (*app_msg_received_callback)(Message*);	///< MAC-to-upper-layer message received callback
 static void (*app_ack_received_callback)(uint8_t);	///< MAC-to-upper-layer ack received callback
-							
-static uint8_t dummy_id = 7;	
+static void (*app_tx_status_callback)(Message*, uint8_t);	///< MAC-to-upper-layer ack received callback (with message handle)
+static void (*app_sent_callback)(void);						///< MAC-to-upper-layer messages sent callback
+
+//Messages in flight (sent, waiting for their TX status)
+static TxInFlight tx_in_flight[TX_MAX_IN_FLIGHT];
+static uint8_t next_frame_id = 1;
+
+//TX queues: messages waiting (tx_pool) are linked in a queue per destination and priority.
+//Destinations live in a hash map (open addressing, linear probing) keyed by address
+static TxQueued tx_pool[TX_POOL_SIZE];
+static TxDest tx_dests[MAC_N_DESTINATIONS];
+static uint32_t tx_n_dests = 0;							///< destinations in the hash map
+static uint32_t tx_depth[MAC_N_PRIORITIES];				///< messages waiting per priority
+static uint32_t tx_next_dest = 0;						///< where the round robin over destinations resumes
+static volatile bool tx_scheduling = false;				///< whether tx_schedule is running (it isn't reentrant)
+
+//Event queue. Producers: the rx path and the main loop (see event_queue_push). Consumer: mac_poll
+static MacEvent event_queue[EVENT_QUEUE_SIZE];
+static volatile uint32_t event_head = 0;
+static volatile uint32_t event_tail = 0;
+
+static MacStats stats;
+
+#ifdef MAC_DEFERRED_DISPATCH
+static bool event_queue_push(MacEventType, Message*, uint8_t);
+#ifdef MAC_MSG_POOL_DROP_OLDEST
+static bool drop_oldest_msg(uint8_t);
+#endif
+#endif
+static void dispatch(MacEvent*);
+static bool service_msg_received(Message*);
+static bool service_tx_status(Message*, uint8_t);
+#ifdef MAC_WARM_BOOT
+static uint32_t config_fingerprint(void);
+static uint32_t fingerprint_add(uint32_t, uint32_t);
+#endif
+static bool complete_tx(Message*, uint8_t);
+static Message* tx_slot_release(TxInFlight*, uint8_t);
+#ifdef MAC_DEFERRED_DISPATCH
+static void report_tx_done(void);
+#endif
+static TxInFlight* tx_slot_alloc(Message*, uint16_t);
+static uint8_t tx_frame_id_alloc(void);
+static void reclaim_lost_tx(void);
+static void tx_schedule(void);
+static int32_t tx_select(uint8_t*, bool*);
+static uint32_t tx_queued(void);
+static uint32_t tx_dest_hash(uint16_t);
+static int32_t tx_dest_find(uint16_t);
+static int32_t tx_dest_get(uint16_t);
+static void tx_dest_remove(uint32_t);
+static bool tx_dest_is_idle(TxDest*);
+static void tx_dest_complete(uint16_t, uint8_t);
+static bool tx_dest_admit(TxDest*);
+static uint32_t tx_dest_max_in_flight(TxDest*);
+static void tx_fail_unreachable(void);
+static void frame_sent(void);
 
 
 
@@ -55,8 +173,10 @@ static uint8_t dummy_id = 7;
 *
 *	Initializes the IEEE 802.25.4 MAC. 
 *
-*	@param msg_callback When a msg is received the registered msg_callback is called
-*	@param ack_callback When an ack is received the registered ack_callback is called
+*	@param msg_callback When a msg is received the registered msg_callback is called. The msg
+*						is only valid until the callback returns, unless mac_msg_retain is called
+*	@param ack_callback When an ack is received the registered ack_callback is called (see
+*						also mac_register_tx_status_callback)
 *
 *	@return true if communication with radio was possible and stored speed rate matches RADIO_SPEED_RATE 
 */
@@ -72,16 +192,40 @@ bool mac_init( void(*msg_callback)(Message* msg), void(*ack_callback)(uint8_t) )
 	//registers callbacks (from lower layer to mac) 
 	xbee_register_msg_received_callback(msg_received);
 	xbee_register_msg_responded_callback(msg_response);
+#if defined(MAC_DEFERRED_DISPATCH) && defined(MAC_MSG_POOL_DROP_OLDEST)
+	xbee_msg_pool_register_exhausted_callback(drop_oldest_msg);
+#endif
+
+#ifdef MAC_WARM_BOOT
+	//after a reset, the radio is already set up if the configuration is the one it was
+	//set up with last time (the radio address answering is enough of a check)
+	uint32_t fingerprint = config_fingerprint();
+	uint16_t address;
+	
+	if( xbee_cpu_read_retained() == fingerprint && radio_query_16bit_address(&address) && address == MAC_ADDRESS )
+		return true;
+	
+	xbee_cpu_write_retained(0);
+#endif
 	
 	//sets up radio and mac parameters as per the mac_config file
-	radio_write_16bit_address(MAC_ADDRESS);
-	radio_write_channel(MAC_CHANNEL);
-	radio_write_panid(MAC_PAN_ID);
-	radio_write_macminbe(MAC_macMinBE);
-	radio_write_acks(MAC_ACKS);
+	//(only those that changed are written, in one go)
+	radio_config_begin();
+	radio_config_set_16bit_address(MAC_ADDRESS);
+	radio_config_set_channel(MAC_CHANNEL);
+	radio_config_set_panid(MAC_PAN_ID);
+	radio_config_set_macminbe(MAC_macMinBE);
+	radio_config_set_acks(MAC_ACKS);
 	//radio_write_extra_retries(MAC_EXTRA_RETRIES); //NOT WORKING!... fix this
-	radio_write_tx_power(RADIO_TX_POWER);
-	radio_write_cca_threshold(RADIO_CCA_THRESHOLD);	
+	radio_config_set_tx_power(RADIO_TX_POWER);
+	radio_config_set_cca_threshold(RADIO_CCA_THRESHOLD);	
+	
+	if( !radio_config_commit() )
+		return false;
+
+#ifdef MAC_WARM_BOOT
+	xbee_cpu_write_retained(fingerprint);
+#endif
 	
 	return true;
 }
@@ -89,12 +233,271 @@ bool mac_init( void(*msg_callback)(Message* msg), void(*ack_callback)(uint8_t) )
 /**
 *	Send message.
 *
-*	Send an IEEE 802.25.4 MAC message.
+*	Send an IEEE 802.25.4 MAC message, with priority MAC_PRIO_NORMAL (see 
+*	mac_send_prio).
 *
 *	@param msg the message 
+*
+*	@return true if the message was queued, false if its queue is full (or 
+*			the message is too long)
 */
-void mac_send( Message* msg ){
-	xbee_send_msg( msg, dummy_id );
+bool mac_send( Message* msg ){
+	return mac_send_prio( msg, MAC_PRIO_NORMAL );
+}
+
+/**
+*	Send message with priority.
+*
+*	Send an IEEE 802.25.4 MAC message. The message is copied, so it can be
+*	reused as soon as this returns (which happens before the message has 
+*	actually left for the radio, see mac_register_sent_callback).
+*
+*	Messages wait in a queue per destination and priority until the UART can
+*	take them without waiting, which is right away unless it's busy or this is
+*	called from an interrupt handler (then they go out from mac_poll, or the
+*	next mac_send). Since messages are handed over one at a time, a message
+*	never waits in the UART behind more than one other.
+*	
+*	The highest priority goes first, but a message is raised one level for 
+*	every TX_AGING_PERIOD ms it waits, so lower priorities are never starved. 
+*	Destinations with messages of the same (raised) priority are served round
+*	robin, and each one can only have TX_MAX_IN_FLIGHT_PER_DEST unicast messages
+*	waiting for their ack (see MAC_MAX_IN_FLIGHT_PER_DEST), or only one while its
+*	last message went unacked or it's being probed: a slow or unreachable
+*	destination only holds up its own traffic. After BREAKER_THRESHOLD messages in a row to a destination go
+*	unacked, it's deemed unreachable (its circuit breaker opens) and its messages
+*	aren't sent: their TX status is MSG_ACK_UNREACHABLE, right away (the callbacks
+*	might be called before this returns). It's probed now and then with the next
+*	message to it, after BREAKER_BACKOFF_MIN ms, doubling the time after every
+*	failed probe, and the first ack closes the breaker again (see 
+*	mac_get_dest_stats). Up to TX_MAX_IN_FLIGHT unicast messages can be waiting for their
+*	ack in all. Each one is given its own frame ID, so acks are matched to the 
+*	message they belong to (see mac_register_tx_status_callback). Broadcasts 
+*	aren't acked, and don't count.
+*
+*	@param msg the message 
+*	@param prio its priority: MAC_PRIO_CONTROL, MAC_PRIO_NORMAL or MAC_PRIO_BULK
+*
+*	@return true if the message was queued, false if its priority's queues are
+*			full (or no queue entry is free yet: the last ones taken off are
+*			still being sent), MAC_N_DESTINATIONS other destinations are busy,
+*			the message is too long, or (MAC_DEFERRED_DISPATCH) its destination
+*			is unreachable and the event queue has no room for its TX status
+*/
+bool mac_send_prio( Message* msg, uint8_t prio ){
+	if( msg->data_length > MSG_MAX_LENGTH || prio >= MAC_N_PRIORITIES )
+		return false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	if( tx_depth[prio] >= TX_QUEUE_LENGTH ){
+		stats.tx_queue_full[prio]++;
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	int32_t d = tx_dest_get( msg->address );
+	
+	if( d < 0 ){
+		stats.tx_dest_table_full++;
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	//(an entry taken off its queue stays in use until sent, so all of them can be in use)
+	uint8_t e = 0;
+	while( e < TX_POOL_SIZE && tx_pool[e].used )
+		e++;
+	
+	if( e == TX_POOL_SIZE ){
+		stats.tx_queue_full[prio]++;
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	if( !tx_dest_admit( &tx_dests[d] ) ){
+		xbee_cpu_exit_critical(state);
+		return complete_tx( msg, MSG_ACK_UNREACHABLE );
+	}
+	
+	TxQueued* entry = &tx_pool[e];
+	TxDest* dest = &tx_dests[d];
+	
+	entry->used = true;
+	entry->next = TX_NONE;
+	entry->handle = msg;
+	entry->queued_ms = xbee_cpu_get_ms();
+	entry->data_length = msg->data_length;
+	for( uint32_t i=0; i<msg->data_length; i++ )
+		entry->data[i] = msg->data[i];
+	
+	//append to the destination's queue
+	if( dest->head[prio] == TX_NONE )
+		dest->head[prio] = e;
+	else
+		tx_pool[dest->tail[prio]].next = e;
+	dest->tail[prio] = e;
+	dest->last_ms = entry->queued_ms;
+	dest->stats.queued++;
+	
+	if( ++tx_depth[prio] > stats.tx_queue_high_water[prio] )
+		stats.tx_queue_high_water[prio] = tx_depth[prio];
+	
+	xbee_cpu_exit_critical(state);
+	
+	tx_schedule();
+	
+	return true;
+}
+
+/**
+*	Register TX status callback.
+*
+*	Registers an (optional) callback called when a unicast message is acked,
+*	along with the ack_callback passed to mac_init. It's handed the message
+*	pointer passed to mac_send, as a handle: the message itself isn't read again
+*	(it might have been reused already). Acks that never arrive are reported 
+*	as MSG_ACK_LOST, after TX_STATUS_TIMEOUT ms.
+*
+*	@param status_callback the callback
+*/
+void mac_register_tx_status_callback( void(*status_callback)(Message*, uint8_t) ){
+	app_tx_status_callback = status_callback;
+}
+
+
+/**
+*	Register sent callback.
+*
+*	Registers an (optional) callback called when every message handed to 
+*	mac_send has left the MCU for the radio (none is left queued either). It 
+*	does not mean the message has been acknowledged (see ack_callback in 
+*	mac_init). It might be called from the USART1 handler.
+*
+*	@param sent_callback the callback
+*/
+void mac_register_sent_callback( void(*sent_callback)(void) ){
+	app_sent_callback = sent_callback;
+	xbee_register_frame_sent_callback(frame_sent);
+}
+
+/**
+*	MAC poll.
+*
+*	Processes data received by the radio and dispatches the events waiting in
+*	the event queue (and, with MAC_DEFERRED_DISPATCH, the TX statuses kept in
+*	the in-flight table). With XBEE_DEFERRED_RX_PROCESSING or MAC_DEFERRED_DISPATCH
+*	defined, callbacks are called from here, in the main loop context, and not 
+*	from the USART1 handler. Call it often (from the main loop, see main.c).
+*	It also sends the messages left waiting in the TX queues, and gives up on 
+*	acks and AT command responses that are long overdue (otherwise done only 
+*	when mac_send runs out of room, or while waiting for them).
+*/
+void mac_poll(void){
+#ifdef XBEE_DEFERRED_RX_PROCESSING
+	xbee_process_rx();
+#endif
+	
+	reclaim_lost_tx();
+#ifdef MAC_DEFERRED_DISPATCH
+	report_tx_done();
+#endif
+	radio_poll();
+	tx_schedule();
+#ifdef MAC_FRAGMENTATION
+	mac_frag_poll();
+#endif
+#ifdef MAC_BULK_TRANSFER
+	mac_bulk_poll();
+#endif
+	
+	while( true ){
+		//the event is claimed atomically (the rx path may drop queued messages, see drop_oldest_msg)
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( event_head == event_tail ){
+			xbee_cpu_exit_critical(state);
+			break;
+		}
+		
+		MacEvent event = event_queue[event_tail & EVENT_QUEUE_MASK];
+		event_tail = event_tail + 1;
+		
+		xbee_cpu_exit_critical(state);
+		
+		dispatch( &event );
+	}
+}
+
+/**
+*	Retain message.
+*
+*	Keeps a received message (as passed to msg_callback) after the
+*	callback returns, without copying it. It must be given back with 
+*	mac_msg_release. Messages come from a small pool, so don't hold too many.
+*
+*	@param msg the message
+*/
+void mac_msg_retain(Message* msg){
+	xbee_msg_pool_retain(msg);
+}
+
+/**
+*	Release message.
+*
+*	Gives back a message kept with mac_msg_retain.
+*
+*	@param msg the message
+*/
+void mac_msg_release(Message* msg){
+	xbee_msg_pool_release(msg);
+}
+
+/**
+*	MAC statistics.
+*
+*	@param out where statistics are copied
+*/
+void mac_get_stats(MacStats* out){
+	XbeeMsgPoolStats pool;
+	xbee_msg_pool_get_stats(&pool);
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	*out = stats;
+	xbee_cpu_exit_critical(state);
+	
+	out->event_queue_depth = event_head - event_tail;
+	for( uint32_t p=0; p<MAC_N_PRIORITIES; p++ )
+		out->tx_queue_depth[p] = tx_depth[p];
+	out->msg_pool_in_use = pool.in_use;
+	out->msg_pool_high_water = pool.high_water;
+	out->msg_pool_alloc_failures = pool.alloc_failures;
+}
+
+/**
+*	MAC per-destination statistics.
+*
+*	Copies the statistics of the destinations currently tracked (at most 
+*	MAC_N_DESTINATIONS). A destination with nothing queued or waiting for an
+*	ack may be forgotten, counters included, to make room for a new one.
+*
+*	@param out where statistics are copied
+*	@param max room in out
+*
+*	@return number of destinations copied
+*/
+uint32_t mac_get_dest_stats(MacDestStats* out, uint32_t max){
+	uint32_t n = 0;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t d=0; d<MAC_N_DESTINATIONS && n<max; d++ ){
+		if( tx_dests[d].used )
+			out[n++] = tx_dests[d].stats;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return n;
 }
 
 
@@ -108,7 +511,16 @@ void mac_send( Message* msg ){
 */
 static void msg_received(Message *msg){
 	//msg.lqi = ...
-	(*app_msg_received_callback)(msg);
+#ifdef MAC_DEFERRED_DISPATCH
+	//(with MAC_MSG_POOL_DROP_OLDEST, queued messages make room for newer ones, see drop_oldest_msg)
+	if( !event_queue_push(MAC_EVENT_MSG_RECEIVED, msg, 0) ){
+		stats.events_dropped++;
+		xbee_msg_pool_release(msg);
+	}
+#else
+	MacEvent event = { MAC_EVENT_MSG_RECEIVED, msg, 0 };
+	dispatch( &event );
+#endif
 }
 
 /**
@@ -118,9 +530,898 @@ static void msg_received(Message *msg){
 *	In turn the callback(event) from the upper layer is called
 *
 *	@param msg the message status
-*	@param dummy_msg_id dummy id associated with the msg being acked
+*	@param frame_id frame id associated with the msg being acked
+*/
+static void msg_response(XbeeStatus msg_status, uint8_t frame_id){
+	Message* msg = NULL;
+	bool matched = false;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t i=0; i<TX_MAX_IN_FLIGHT; i++ ){
+		if( tx_in_flight[i].msg && !tx_in_flight[i].done && tx_in_flight[i].frame_id == frame_id ){
+			msg = tx_slot_release( &tx_in_flight[i], msg_status );
+			matched = true;
+			break;
+		}
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	//unknown frame ID (its message was already given up on)
+	if( !matched ){
+		stats.tx_unmatched_acks++;
+		return;
+	}
+	
+	if( msg )
+		complete_tx( msg, msg_status );
+}
+
+/**
+*	Complete TX
+*
+*	Reports the TX status of a message to the app (now or, with 
+*	MAC_DEFERRED_DISPATCH, from mac_poll through the event queue). Used for
+*	messages failed from the main loop: those sent report theirs through
+*	their in-flight entry (see tx_slot_release).
+*
+*	@param msg the message handle
+*	@param status its TX status
+*
+*	@return false if the event queue is full (MAC_DEFERRED_DISPATCH): the
+*	status wasn't reported
+*/
+static bool complete_tx(Message* msg, uint8_t status){
+#ifdef MAC_DEFERRED_DISPATCH
+	return event_queue_push( MAC_EVENT_ACK_RECEIVED, msg, status );
+#else
+	MacEvent event = { MAC_EVENT_ACK_RECEIVED, msg, status };
+	dispatch( &event );
+	
+	return true;
+#endif
+}
+
+/**
+*	TX slot release
+*
+*	Takes the TX status of a message in flight. With MAC_DEFERRED_DISPATCH
+*	the entry keeps the status until mac_poll reports it (see report_tx_done),
+*	so it can't be lost to a full event queue; otherwise the entry is freed
+*	and the status is reported by the caller. To be called within a critical
+*	section.
+*
+*	@param slot the entry
+*	@param status its TX status
+*
+*	@return the message handle, to be passed to complete_tx, or NULL if the
+*	entry keeps it
+*/
+static Message* tx_slot_release(TxInFlight* slot, uint8_t status){
+	stats.tx_in_flight--;
+	tx_dest_complete( slot->address, status );
+
+#ifdef MAC_DEFERRED_DISPATCH
+	slot->done = true;
+	slot->status = status;
+	
+	return NULL;
+#else
+	Message* msg = slot->msg;
+	
+	slot->msg = NULL;
+	
+	return msg;
+#endif
+}
+
+#ifdef MAC_DEFERRED_DISPATCH
+/**
+*	Report TX done
+*
+*	Reports the TX statuses kept in the in-flight table (see tx_slot_release)
+*	to the app, freeing their entries.
+*/
+static void report_tx_done(void){
+	for( uint32_t i=0; i<TX_MAX_IN_FLIGHT; i++ ){
+		MacEvent event = { MAC_EVENT_ACK_RECEIVED, NULL, 0 };
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( tx_in_flight[i].msg && tx_in_flight[i].done ){
+			event.msg = tx_in_flight[i].msg;
+			event.status = tx_in_flight[i].status;
+			tx_in_flight[i].msg = NULL;
+			tx_in_flight[i].done = false;
+		}
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( event.msg )
+			dispatch( &event );
+	}
+}
+#endif
+
+/**
+*	TX slot alloc
+*
+*	Takes a free entry of the in-flight table for a message, and gives it a 
+*	frame ID. 
+*
+*	@param msg the message handle
+*	@param address its destination
+*
+*	@return the entry, or NULL if all entries are in use
+*/
+static TxInFlight* tx_slot_alloc(Message* msg, uint16_t address){
+	TxInFlight* slot = NULL;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t i=0; i<TX_MAX_IN_FLIGHT; i++ ){
+		if( !tx_in_flight[i].msg ){
+			slot = &tx_in_flight[i];
+			break;
+		}
+	}
+	
+	if( slot ){
+		slot->msg = msg;
+		slot->address = address;
+		slot->frame_id = tx_frame_id_alloc();
+		slot->sent_ms = xbee_cpu_get_ms();
+		
+		if( ++stats.tx_in_flight > stats.tx_in_flight_high_water )
+			stats.tx_in_flight_high_water = stats.tx_in_flight;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return slot;
+}
+
+/**
+*	Frame ID alloc
+*
+*	Frame IDs rotate from 1 to 255 (0 means no TX status), skipping those 
+*	still in flight. To be called within a critical section.
+*
+*	@return the frame ID
+*/
+static uint8_t tx_frame_id_alloc(void){
+	uint8_t frame_id;
+	bool in_use;
+	
+	do{
+		frame_id = next_frame_id;
+		next_frame_id = (next_frame_id == 255) ? 1 : next_frame_id + 1;
+		
+		in_use = false;
+		for( uint32_t i=0; i<TX_MAX_IN_FLIGHT; i++ )
+			if( tx_in_flight[i].msg && tx_in_flight[i].frame_id == frame_id )
+				in_use = true;
+	}while( in_use );
+	
+	return frame_id;
+}
+
+/**
+*	Reclaim lost TX
+*
+*	Gives up on messages whose TX status hasn't arrived within TX_STATUS_TIMEOUT
+*	(reporting them as MSG_ACK_LOST), so their entries and frame IDs can be reused.
+*/
+static void reclaim_lost_tx(void){
+	uint32_t now = xbee_cpu_get_ms();
+	
+	for( uint32_t i=0; i<TX_MAX_IN_FLIGHT; i++ ){
+		Message* msg = NULL;
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( tx_in_flight[i].msg && !tx_in_flight[i].done && now - tx_in_flight[i].sent_ms >= TX_STATUS_TIMEOUT ){
+			msg = tx_slot_release( &tx_in_flight[i], MSG_ACK_LOST );
+			stats.tx_status_timeouts++;
+		}
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( msg )
+			complete_tx( msg, MSG_ACK_LOST );
+	}
+}
+
+/**
+*	TX schedule
+*
+*	Hands queued messages to the radio, for as long as the UART can take them
+*	without waiting (so none waits in the UART behind more than one other). 
+*	Messages are picked by tx_select. Those to unreachable destinations are
+*	failed instead (see tx_fail_unreachable). Not reentrant: a call made while 
+*	it runs leaves the work to it. Nothing is sent from interrupt handlers
+*	(the main loop might be writing a frame, and waiting for the UART doesn't
+*	work there): messages queued there go out from mac_poll.
+*/
+static void tx_schedule(void){
+	bool reclaimed = false;
+	
+	if( xbee_cpu_in_interrupt() )
+		return;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	bool busy = tx_scheduling;
+	
+	tx_scheduling = true;
+	xbee_cpu_exit_critical(state);
+	
+	if( busy )
+		return;
+	
+	tx_fail_unreachable();
+	
+	while( xbee_tx_ready() ){
+		uint8_t prio;
+		bool aged;
+		uint8_t frame_id = 0;
+		
+		state = xbee_cpu_enter_critical();
+		
+		int32_t d = tx_select(&prio, &aged);
+		
+		if( d < 0 ){
+			xbee_cpu_exit_critical(state);
+			break;
+		}
+		
+		TxDest* dest = &tx_dests[d];
+		uint8_t e = dest->head[prio];
+		TxQueued* entry = &tx_pool[e];
+		uint16_t address = dest->stats.address;
+		
+		if( address != MSG_BROADCAST_ADDRESS ){
+			TxInFlight* slot = tx_slot_alloc( entry->handle, address );
+			
+			if( !slot ){
+				xbee_cpu_exit_critical(state);
+				
+				//full: give up on acks that are long overdue, and retry (once)
+				if( reclaimed ){
+					stats.tx_table_full++;
+					break;
+				}
+				
+				reclaim_lost_tx();
+				reclaimed = true;
+				continue;
+			}
+			
+			frame_id = slot->frame_id;
+			dest->stats.in_flight++;
+		}
+		
+		//take it off its queue (the entry itself stays in use until sent)
+		dest->head[prio] = entry->next;
+		dest->stats.queued--;
+		dest->stats.sent++;
+		tx_depth[prio]--;
+		tx_next_dest = (d + 1) & TX_DEST_MASK;
+		
+		xbee_cpu_exit_critical(state);
+		
+		Message msg;
+		msg.address = address;
+		msg.data = entry->data;
+		msg.data_length = entry->data_length;
+		
+		xbee_send_msg( &msg, frame_id );
+		
+		uint32_t waited = xbee_cpu_get_ms() - entry->queued_ms;
+		
+		state = xbee_cpu_enter_critical();
+		
+		entry->used = false;
+		stats.tx_msgs++;
+		stats.tx_dequeued[prio]++;
+		stats.tx_latency_total_ms[prio] += waited;
+		if( waited > stats.tx_latency_max_ms[prio] )
+			stats.tx_latency_max_ms[prio] = waited;
+		if( aged )
+			stats.tx_aged[prio]++;
+		
+		xbee_cpu_exit_critical(state);
+	}
+	
+	tx_scheduling = false;
+}
+
+/**
+*	TX select
+*
+*	Picks the next message to send. Strict priority with aging: the oldest
+*	message of each queue is ranked by its priority, raised one level for 
+*	every TX_AGING_PERIOD ms it has waited. Ties go to the higher priority,
+*	then (same rank and priority) to the next destination in round robin order. Destinations with as
+*	many unicast messages waiting for their ack as they're allowed (see
+*	tx_dest_max_in_flight) are skipped. To be called within a critical section.
+*
+*	@param prio where the priority of the queue selected is stored
+*	@param aged where it's stored whether it was raised above a higher priority
+*
+*	@return the destination selected (its message is the head of its queue), -1 if none
+*/
+static int32_t tx_select(uint8_t* prio, bool* aged){
+	uint32_t now = xbee_cpu_get_ms();
+	int32_t selected = -1;
+	int32_t best_rank = 0;
+	uint8_t highest = MAC_N_PRIORITIES;
+	
+	for( uint32_t i=0; i<MAC_N_DESTINATIONS; i++ ){
+		uint32_t d = (tx_next_dest + i) & TX_DEST_MASK;
+		TxDest* dest = &tx_dests[d];
+		
+		if( !dest->used || dest->stats.queued == 0 || dest->stats.breaker == MAC_BREAKER_OPEN )
+			continue;
+		
+		if( dest->stats.address != MSG_BROADCAST_ADDRESS && dest->stats.in_flight >= tx_dest_max_in_flight(dest) )
+			continue;
+		
+		for( uint8_t p=0; p<MAC_N_PRIORITIES; p++ ){
+			if( dest->head[p] == TX_NONE )
+				continue;
+			
+			uint32_t waited = now - tx_pool[dest->head[p]].queued_ms;
+			int32_t rank = p - (int32_t)(waited / TX_AGING_PERIOD);
+			
+			if( p < highest )
+				highest = p;
+			
+			//(ties go to the higher priority, whatever the destination)
+			if( selected < 0 || rank < best_rank || (rank == best_rank && p < *prio) ){
+				selected = d;
+				best_rank = rank;
+				*prio = p;
+			}
+		}
+	}
+	
+	*aged = (selected >= 0 && *prio != highest);
+	
+	return selected;
+}
+
+/**
+*	TX queued
+*
+*	@return messages waiting in the TX queues, all priorities
+*/
+static uint32_t tx_queued(void){
+	uint32_t n = 0;
+	
+	for( uint32_t p=0; p<MAC_N_PRIORITIES; p++ )
+		n += tx_depth[p];
+	
+	return n;
+}
+
+/**
+*	Destination hash
+*
+*	@param address a destination address
+*
+*	@return its home entry in the destination hash map
+*/
+static uint32_t tx_dest_hash(uint16_t address){
+	return (address ^ (address >> 8)) & TX_DEST_MASK;
+}
+
+/**
+*	Destination find
+*
+*	Looks a destination up in the hash map. To be called within a critical section.
+*
+*	@param address the destination address
+*
+*	@return its entry, -1 if not there
+*/
+static int32_t tx_dest_find(uint16_t address){
+	uint32_t d = tx_dest_hash(address);
+	
+	for( uint32_t i=0; i<MAC_N_DESTINATIONS; i++ ){
+		if( !tx_dests[d].used )
+			return -1;
+		
+		if( tx_dests[d].stats.address == address )
+			return d;
+		
+		d = (d + 1) & TX_DEST_MASK;
+	}
+	
+	return -1;
+}
+
+/**
+*	Destination get
+*
+*	Looks a destination up in the hash map, adding it if not there. If the map
+*	is full, the idle destination (see tx_dest_is_idle) that least recently had
+*	a message queued is forgotten, those whose circuit breaker is closed first:
+*	forgetting one that's deemed unreachable forgets its circuit breaker too
+*	(it starts over closed). To be called within a critical section.
+*
+*	@param address the destination address
+*
+*	@return its entry, -1 if the map is full of busy destinations
+*/
+static int32_t tx_dest_get(uint16_t address){
+	int32_t d = tx_dest_find(address);
+	
+	if( d >= 0 )
+		return d;
+	
+	if( tx_n_dests == MAC_N_DESTINATIONS ){
+		uint32_t now = xbee_cpu_get_ms();
+		int32_t victim = -1;
+		
+		bool victim_closed = false;
+		
+		for( uint32_t i=0; i<MAC_N_DESTINATIONS; i++ ){
+			if( !tx_dest_is_idle(&tx_dests[i]) )
+				continue;
+			
+			bool closed = tx_dests[i].stats.breaker == MAC_BREAKER_CLOSED;
+			
+			if( victim < 0 || (closed && !victim_closed) ||
+				(closed == victim_closed && now - tx_dests[i].last_ms > now - tx_dests[victim].last_ms) ){
+				victim = i;
+				victim_closed = closed;
+			}
+		}
+		
+		if( victim < 0 )
+			return -1;
+		
+		tx_dest_remove(victim);
+	}
+	
+	d = tx_dest_hash(address);
+	while( tx_dests[d].used )
+		d = (d + 1) & TX_DEST_MASK;
+	
+	TxDest* dest = &tx_dests[d];
+	
+	dest->used = true;
+	dest->last_ms = xbee_cpu_get_ms();
+	for( uint32_t p=0; p<MAC_N_PRIORITIES; p++ )
+		dest->head[p] = TX_NONE;
+	dest->stats = (MacDestStats){ 0 };
+	dest->stats.address = address;
+	tx_n_dests++;
+	
+	return d;
+}
+
+/**
+*	Destination remove
+*
+*	Removes a destination from the hash map, shifting back the entries that 
+*	follow it in its probe run (so lookups don't stop short at the hole). To 
+*	be called within a critical section.
+*
+*	@param d its entry
+*/
+static void tx_dest_remove(uint32_t d){
+	uint32_t hole = d;
+	uint32_t i = d;
+	
+	tx_dests[hole].used = false;
+	
+	while( true ){
+		i = (i + 1) & TX_DEST_MASK;
+		
+		if( !tx_dests[i].used )
+			break;
+		
+		//an entry can fill the hole unless its home lies cyclically in (hole, i]
+		uint32_t home = tx_dest_hash( tx_dests[i].stats.address );
+		bool stays = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+		
+		if( !stays ){
+			tx_dests[hole] = tx_dests[i];
+			tx_dests[i].used = false;
+			hole = i;
+		}
+	}
+	
+	tx_n_dests--;
+}
+
+/**
+*	Destination is idle
+*
+*	@param dest a destination entry
+*
+*	@return true if it's in use, with nothing queued nor waiting for an ack
+*/
+static bool tx_dest_is_idle(TxDest* dest){
+	return dest->used && dest->stats.queued == 0 && dest->stats.in_flight == 0;
+}
+
+/**
+*	Destination complete
+*
+*	Accounts for the TX status of a message to a destination, and runs its 
+*	circuit breaker: BREAKER_THRESHOLD messages in a row not acked (the radio
+*	gave up, or never told) open it, an ack closes it, and a probe that isn't
+*	acked, whatever the reason, opens it again for twice as long (otherwise it
+*	would stay probing, failing every message). Otherwise CCA failures and 
+*	purges say nothing about the destination. To be called within a critical
+*	section.
+*
+*	@param address the destination address
+*	@param status the TX status
+*/
+static void tx_dest_complete(uint16_t address, uint8_t status){
+	int32_t d = tx_dest_find(address);
+	
+	//(a destination isn't forgotten while a message to it waits for its ack)
+	if( d < 0 )
+		return;
+	
+	TxDest* dest = &tx_dests[d];
+	
+	dest->stats.in_flight--;
+	
+	if( status == MSG_ACK_RECEIVED ){
+		dest->stats.acked++;
+		dest->stats.consecutive_timeouts = 0;
+		dest->stats.breaker = MAC_BREAKER_CLOSED;
+		return;
+	}
+	
+	dest->stats.failed++;
+	
+	if( dest->stats.breaker == MAC_BREAKER_PROBING ){
+		dest->backoff_ms = (dest->backoff_ms * 2 > BREAKER_BACKOFF_MAX) ? BREAKER_BACKOFF_MAX : dest->backoff_ms * 2;
+		dest->probe_ms = xbee_cpu_get_ms() + dest->backoff_ms;
+		dest->stats.breaker = MAC_BREAKER_OPEN;
+		return;
+	}
+	
+	if( status != MSG_ACK_TIMEOUT && status != MSG_ACK_LOST )
+		return;
+	
+	if( dest->stats.consecutive_timeouts < 255 )
+		dest->stats.consecutive_timeouts++;
+	
+	if( dest->stats.breaker == MAC_BREAKER_CLOSED && dest->stats.consecutive_timeouts >= BREAKER_THRESHOLD ){
+		dest->backoff_ms = BREAKER_BACKOFF_MIN;
+		dest->probe_ms = xbee_cpu_get_ms() + dest->backoff_ms;
+		dest->stats.breaker = MAC_BREAKER_OPEN;
+		dest->stats.breaker_trips++;
+	}
+}
+
+/**
+*	Destination admit
+*
+*	Tells whether a new message to a destination may be queued, as per its
+*	circuit breaker. Once the backoff is over, the breaker lets one message
+*	through as a probe. To be called within a critical section.
+*
+*	@param dest the destination entry
+*
+*	@return true if the message may be queued, false if it must fail (MSG_ACK_UNREACHABLE)
+*/
+static bool tx_dest_admit(TxDest* dest){
+	switch( dest->stats.breaker ){
+		case MAC_BREAKER_OPEN:
+			if( (int32_t)(xbee_cpu_get_ms() - dest->probe_ms) >= 0 ){
+				dest->stats.breaker = MAC_BREAKER_PROBING;
+				return true;
+			}
+			break;
+		
+		case MAC_BREAKER_PROBING:
+			break;
+		
+		default:
+			return true;
+	}
+	
+	dest->stats.unreachable++;
+	stats.tx_unreachable++;
+	
+	return false;
+}
+
+/**
+*	Destination max in flight
+*
+*	Tells how many unicast messages to a destination may be waiting for their
+*	ack at once: TX_MAX_IN_FLIGHT_PER_DEST, or TX_MAX_IN_FLIGHT_FAILING while
+*	it's failing (its last message went unacked, or it's being probed), so a
+*	destination that might be gone doesn't tie up the frame IDs of the rest.
+*	To be called within a critical section.
+*
+*	@param dest the destination entry
+*
+*	@return the max
+*/
+static uint32_t tx_dest_max_in_flight(TxDest* dest){
+	if( dest->stats.breaker != MAC_BREAKER_CLOSED || dest->stats.consecutive_timeouts > 0 )
+		return TX_MAX_IN_FLIGHT_FAILING;
+	
+	return TX_MAX_IN_FLIGHT_PER_DEST;
+}
+
+/**
+*	TX fail unreachable
+*
+*	Fails the messages still queued to destinations whose circuit breaker has
+*	opened (reporting them as MSG_ACK_UNREACHABLE), oldest first.
+*/
+static void tx_fail_unreachable(void){
+	for( uint32_t d=0; d<MAC_N_DESTINATIONS; d++ ){
+		while( true ){
+			Message* handle = NULL;
+			uint32_t state = xbee_cpu_enter_critical();
+			TxDest* dest = &tx_dests[d];
+			
+			if( dest->used && dest->stats.breaker == MAC_BREAKER_OPEN && dest->stats.queued > 0 ){
+				uint8_t prio = 0;
+				uint8_t e = TX_NONE;
+				
+				for( uint8_t p=0; p<MAC_N_PRIORITIES; p++ ){
+					uint8_t head = dest->head[p];
+					
+					if( head != TX_NONE && (e == TX_NONE || (int32_t)(tx_pool[head].queued_ms - tx_pool[e].queued_ms) < 0) ){
+						e = head;
+						prio = p;
+					}
+				}
+
+#ifdef MAC_DEFERRED_DISPATCH
+				//(its status is queued first: with no room for it, the message stays queued until the next try)
+				if( !complete_tx( tx_pool[e].handle, MSG_ACK_UNREACHABLE ) ){
+					xbee_cpu_exit_critical(state);
+					return;
+				}
+#endif
+				
+				handle = tx_pool[e].handle;
+				tx_pool[e].used = false;
+				dest->head[prio] = tx_pool[e].next;
+				dest->stats.queued--;
+				dest->stats.unreachable++;
+				tx_depth[prio]--;
+				stats.tx_unreachable++;
+			}
+			
+			xbee_cpu_exit_critical(state);
+			
+			if( !handle )
+				break;
+
+#ifndef MAC_DEFERRED_DISPATCH
+			complete_tx( handle, MSG_ACK_UNREACHABLE );
+#endif
+		}
+	}
+}
+
+/**
+*	Frame sent event
+*
+*	This is how the lower layer notifies every frame handed to the UART has
+*	left it. The app is told once no message is left queued either.
+*/
+static void frame_sent(void){
+	if( tx_queued() == 0 && app_sent_callback )
+		(*app_sent_callback)();
+}
+
+#ifdef MAC_DEFERRED_DISPATCH
+/**
+*	Event queue push
+*
+*	Queues an event (producer side). Events are queued from the USART1 handler
+*	(messages received) and from the main loop (TX statuses failed right away),
+*	so the slot is taken, filled and published atomically. It may be called
+*	within a critical section.
+*
+*	@param type the event type
+*	@param msg its message
+*	@param status its ack status (MAC_EVENT_ACK_RECEIVED)
+*
+*	@return true if it was queued, false if the queue is full (it's up to the
+*	caller to drop the event, or keep it)
+*/
+static bool event_queue_push(MacEventType type, Message* msg, uint8_t status){
+	uint32_t state = xbee_cpu_enter_critical();
+	uint32_t head = event_head;
+	
+	if( head - event_tail >= EVENT_QUEUE_SIZE ){
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	MacEvent* event = &event_queue[head & EVENT_QUEUE_MASK];
+	
+	event->type = type;
+	event->msg = msg;
+	event->status = status;
+	
+	uint32_t depth = ++event_head - event_tail;
+	
+	stats.events_queued++;
+	
+	if( depth > stats.event_queue_high_water )
+		stats.event_queue_high_water = depth;
+	
+	xbee_cpu_exit_critical(state);
+	
+	return true;
+}
+
+#ifdef MAC_MSG_POOL_DROP_OLDEST
+/**
+*	Drop oldest message
+*
+*	Message pool exhausted callback: a message of the given length couldn't be
+*	allocated, so the oldest message waiting in the event queue that's in the
+*	smallest size class the length fits in (and that ran out) is dropped,
+*	giving it back to the pool. Messages of other classes are left alone:
+*	dropping them wouldn't make room.
+*
+*	@param length payload length of the message being allocated
+*
+*	@return true if a message was dropped
+*/
+static bool drop_oldest_msg(uint8_t length){
+	MacEvent* oldest = NULL;
+	uint8_t oldest_capacity = 0;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	for( uint32_t i = event_tail; i != event_head; i++ ){
+		MacEvent* event = &event_queue[i & EVENT_QUEUE_MASK];
+		
+		if( event->type != MAC_EVENT_MSG_RECEIVED || !event->msg )
+			continue;
+		
+		uint8_t capacity = xbee_msg_pool_capacity(event->msg);
+		
+		if( capacity >= length && (!oldest || capacity < oldest_capacity) ){
+			oldest = event;
+			oldest_capacity = capacity;
+		}
+	}
+	
+	if( oldest ){
+		xbee_msg_pool_release(oldest->msg);
+		oldest->msg = NULL;
+		stats.msgs_dropped++;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return oldest != NULL;
+}
+#endif
+#endif
+
+#ifdef MAC_WARM_BOOT
+/**
+*	Configuration fingerprint
+*
+*	Hashes (FNV-1a) the radio configuration set up by mac_init, as per mac_config.h.
+*
+*	@return the fingerprint (never 0, which is what a power up leaves)
+*/
+static uint32_t config_fingerprint(void){
+	uint32_t hash = 2166136261u;
+	
+	hash = fingerprint_add( hash, FINGERPRINT_VERSION );
+	hash = fingerprint_add( hash, MAC_ADDRESS );
+	hash = fingerprint_add( hash, MAC_CHANNEL );
+	hash = fingerprint_add( hash, MAC_PAN_ID );
+	hash = fingerprint_add( hash, MAC_macMinBE );
+	hash = fingerprint_add( hash, MAC_ACKS );
+	hash = fingerprint_add( hash, RADIO_TX_POWER );
+	hash = fingerprint_add( hash, RADIO_CCA_THRESHOLD );
+	hash = fingerprint_add( hash, RADIO_SPEED_RATE );
+	
+	return hash ? hash : 1;
+}
+
+/**
+*	Fingerprint add
+*
+*	@param hash the hash so far
+*	@param value a value to be added (byte by byte)
+*
+*	@return the new hash
+*/
+static uint32_t fingerprint_add(uint32_t hash, uint32_t value){
+	for( uint32_t i=0; i<4; i++ ){
+		hash ^= (value >> (8*i)) & 0xFF;
+		hash *= 16777619u;
+	}
+	
+	return hash;
+}
+#endif
+
+/**
+*	Dispatch
+*
+*	Calls the app callback for an event.
+*
+*	@param event the event
+*/
+static void dispatch(MacEvent* event){
+	switch( event->type ){
+		case MAC_EVENT_MSG_RECEIVED:
+			//(unless it was dropped)
+			if( event->msg ){
+				if( !service_msg_received(event->msg) )
+					(*app_msg_received_callback)(event->msg);
+				xbee_msg_pool_release(event->msg);
+			}
+			break;
+		
+		case MAC_EVENT_ACK_RECEIVED:
+			//(the services' TX statuses aren't the app's business)
+			if( service_tx_status(event->msg, event->status) )
+				break;
+			
+			if( app_tx_status_callback )
+				(*app_tx_status_callback)(event->msg, event->status);
+			
+			(*app_ack_received_callback)(event->status);
+			break;
+	}
+}
+
+/**
+*	Service message received
+*
+*	Hands a message received to the services built on the MAC 
+*	(MAC_FRAGMENTATION, MAC_BULK_TRANSFER), which take their own.
+*
+*	@param msg the message
+*
+*	@return true if a service took it (it's not for the app)
+*/
+static bool service_msg_received(Message* msg){
+#ifdef MAC_FRAGMENTATION
+	if( mac_frag_msg_received(msg) )
+		return true;
+#endif
+#ifdef MAC_BULK_TRANSFER
+	if( mac_bulk_msg_received(msg) )
+		return true;
+#endif
+	return false;
+}
+
+/**
+*	Service TX status
+*
+*	Hands a TX status to the services built on the MAC (MAC_FRAGMENTATION,
+*	MAC_BULK_TRANSFER), which take those of their own messages.
+*
+*	@param msg the message handle
+*	@param status its TX status
+*
+*	@return true if a service took it (it's not for the app)
 */
-static void msg_response(XbeeStatus msg_status, uint8_t dummy_msg_id){
-	(*app_ack_received_callback)(msg_status);
+static bool service_tx_status(Message* msg, uint8_t status){
+#ifdef MAC_FRAGMENTATION
+	if( mac_frag_tx_status(msg, status) )
+		return true;
+#endif
+#ifdef MAC_BULK_TRANSFER
+	if( mac_bulk_tx_status(msg, status) )
+		return true;
+#endif
+	return false;
 }
 
@@ -34,7 +34,64 @@
 
 #define MAC_DEFAULT_macMinBE 0 ///< Default macMinBE threshold	
 
+#define MAC_N_PRIORITIES	3	///< TX priorities (see mac_send_prio)
+#define MAC_PRIO_CONTROL	0	///< Highest TX priority: alarms, control messages
+#define MAC_PRIO_NORMAL		1	///< Default TX priority (mac_send)
+#define MAC_PRIO_BULK		2	///< Lowest TX priority: bulk telemetry
+#define MAC_N_DESTINATIONS	8	///< Destinations tracked at once, each with its own TX queues (see mac_get_dest_stats). Must be a power of two
+
+#define MAC_BREAKER_CLOSED	0	///< Destination circuit breaker state: reachable, messages are sent
+#define MAC_BREAKER_OPEN	1	///< Destination circuit breaker state: deemed unreachable, messages fail right away
+#define MAC_BREAKER_PROBING	2	///< Destination circuit breaker state: a message was let through to probe it
+
+typedef struct{ ///< MAC statistics
+	uint32_t events_queued;			///< events queued for dispatch (MAC_DEFERRED_DISPATCH only)
+	uint32_t events_dropped;		///< messages received dropped because the event queue was full (TX statuses are never dropped)
+	uint32_t event_queue_depth;		///< events currently waiting in the event queue
+	uint32_t event_queue_high_water;///< max events ever waiting in the event queue
+	uint32_t msgs_dropped;			///< queued messages dropped to make room for newer ones (MAC_MSG_POOL_DROP_OLDEST only)
+	uint32_t msg_pool_in_use;		///< received messages currently held (queued, or retained by the app)
+	uint32_t msg_pool_high_water;	///< max received messages ever held at once
+	uint32_t msg_pool_alloc_failures;///< messages dropped because the pool was exhausted
+	uint32_t tx_msgs;				///< messages sent
+	uint32_t tx_in_flight;			///< unicast messages currently waiting for their ack
+	uint32_t tx_in_flight_high_water;///< max unicast messages ever waiting for their ack at once
+	uint32_t tx_table_full;			///< times a unicast message had to stay queued because too many were waiting for their ack
+	uint32_t tx_status_timeouts;	///< messages given up on because their ack (TX status) never arrived
+	uint32_t tx_unmatched_acks;		///< acks (TX statuses) that matched no message waiting
+	uint32_t tx_queue_depth[MAC_N_PRIORITIES];		///< messages currently waiting in each TX queue
+	uint32_t tx_queue_high_water[MAC_N_PRIORITIES];	///< max messages ever waiting in each TX queue
+	uint32_t tx_queue_full[MAC_N_PRIORITIES];		///< messages not sent because their TX queue was full
+	uint32_t tx_dest_table_full;					///< messages not sent because MAC_N_DESTINATIONS other destinations were busy
+	uint32_t tx_unreachable;						///< messages failed right away (MSG_ACK_UNREACHABLE) because their destination's circuit breaker was open
+	uint32_t tx_dequeued[MAC_N_PRIORITIES];			///< messages taken from each TX queue and sent
+	uint32_t tx_aged[MAC_N_PRIORITIES];				///< of those, sent ahead of higher priority ones because they had waited long (aging)
+	uint32_t tx_latency_total_ms[MAC_N_PRIORITIES];	///< time spent waiting in each TX queue, in all (divide by tx_dequeued for the average)
+	uint32_t tx_latency_max_ms[MAC_N_PRIORITIES];	///< longest wait in each TX queue
+}MacStats;
+
+typedef struct{ ///< Per-destination TX statistics (see mac_get_dest_stats)
+	uint16_t address;		///< destination address
+	uint8_t queued;			///< messages waiting in its TX queues
+	uint8_t in_flight;		///< messages sent, waiting for their ack
+	uint32_t sent;			///< messages sent
+	uint32_t acked;			///< messages acked (MSG_ACK_RECEIVED)
+	uint32_t failed;		///< messages not acked (no ack, CCA failure, purged or lost)
+	uint8_t breaker;		///< circuit breaker state (MAC_BREAKER_CLOSED, MAC_BREAKER_OPEN or MAC_BREAKER_PROBING)
+	uint8_t consecutive_timeouts;	///< messages in a row not acked (MSG_ACK_TIMEOUT or MSG_ACK_LOST)
+	uint32_t breaker_trips;	///< times the circuit breaker opened
+	uint32_t unreachable;	///< messages failed right away because the circuit breaker was open
+}MacDestStats;
+
 bool mac_init( void(*)(Message*), void(*)(uint8_t) );
-void mac_send( Message* );
+bool mac_send( Message* );
+bool mac_send_prio( Message*, uint8_t );
+void mac_poll(void);
+void mac_get_stats(MacStats*);
+uint32_t mac_get_dest_stats(MacDestStats*, uint32_t);
+void mac_msg_retain(Message*);
+void mac_msg_release(Message*);
+void mac_register_sent_callback( void(*)(void) );
+void mac_register_tx_status_callback( void(*)(Message*, uint8_t) );
 
 #endif /* MAC_H_ */
\ No newline at end of file
@@ -0,0 +1,570 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	mac_frag.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Fragmentation and reassembly of payloads longer than a message.
+ *
+ * Payloads of up to MAC_FRAG_MAX_LENGTH bytes are split in fragments of
+ * MAC_FRAG_PAYLOAD_LENGTH bytes, each one sent as a unicast message with a
+ * MAC_FRAG_HEADER_LENGTH byte header (tag, transfer ID, index, count), and put
+ * back together on the receiving side. Only built with MAC_FRAGMENTATION
+ * (mac.c routes fragments here, and not to the app).
+ */
+
+#include <stdint-gcc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "xbee/xbee_cpu.h"
+#include "mac.h"
+#include "mac_frag.h"
+#include "mac_config.h"
+
+#ifdef MAC_FRAGMENTATION
+
+#define FRAG_TX_WINDOW		2		///< Fragments handed to the MAC at once (one waiting for its ack, the next one queued behind it)
+#define FRAG_TX_RETRIES		3		///< Times a fragment is sent again before its payload is given up on
+#define REASSEMBLY_TIMEOUT	3000	///< ms without new fragments after which a payload being reassembled is given up on
+#define FRAG_WORDS			((MAC_FRAG_MAX_FRAGMENTS + 31) / 32)	///< 32-bit words in a fragment bitmap
+
+typedef struct{ ///< Fragment handed to the MAC, waiting for its TX status
+	Message msg;		///< message handle, as passed to mac_send_prio
+	bool used;			///< whether it's waiting for its TX status
+	uint8_t index;		///< fragment index
+}FragInFlight;
+
+typedef struct{ ///< Payload being sent
+	bool active;							///< whether a payload is being sent
+	bool failed;							///< whether a fragment failed for good (the rest aren't sent)
+	const uint8_t* data;					///< the payload (the app's buffer)
+	uint32_t length;						///< payload length
+	uint16_t address;						///< destination
+	uint8_t id;								///< transfer ID
+	uint8_t n_fragments;					///< fragments in all
+	uint8_t unacked;						///< fragments not acked yet
+	uint8_t in_flight;						///< fragments waiting for their TX status
+	uint32_t pending[FRAG_WORDS];			///< fragments waiting to be sent, or sent again (bitmap)
+	uint8_t retries[MAC_FRAG_MAX_FRAGMENTS];///< times each fragment was sent again
+}FragTx;
+
+typedef struct{ ///< Payload being reassembled
+	bool used;							///< whether the slot is in use
+	bool done;							///< whether the payload was handed to the app (then the slot only filters duplicates, until it times out)
+	uint16_t address;					///< source (part of the key)
+	uint8_t id;							///< transfer ID (part of the key)
+	uint8_t n_fragments;				///< fragments in all
+	uint8_t received;					///< fragments received
+	uint32_t length;					///< payload length (known once the last fragment arrives)
+	uint32_t last_ms;					///< when a fragment last arrived
+	uint32_t bitmap[FRAG_WORDS];		///< fragments received
+	uint8_t data[MAC_FRAG_MAX_LENGTH];	///< payload
+}Reassembly;
+
+//Fragmentation to App callbacks
+static void (*app_payload_received_callback)(uint16_t, uint8_t*, uint32_t);	///< payload reassembled callback
+static void (*app_payload_sent_callback)(uint16_t, bool);					///< payload sent (or given up on) callback
+
+static FragTx tx;
+static FragInFlight tx_frags[FRAG_TX_WINDOW];
+static uint8_t tx_buffer[MSG_MAX_LENGTH];		///< fragment being handed to the MAC (which copies it)
+static uint8_t next_id = 0;
+static volatile bool tx_pumping = false;		///< whether frag_pump is running (it isn't reentrant)
+static Reassembly reassembly[MAC_FRAG_REASSEMBLY_SLOTS];
+static MacFragStats stats;
+
+static void frag_pump(void);
+static bool frag_tx_finish(void);
+static uint32_t fragment_length(uint32_t);
+static Reassembly* reassembly_get(uint16_t, uint8_t, uint8_t);
+static bool reassembly_expired(Reassembly*, uint32_t);
+static bool bitmap_get(uint32_t*, uint32_t);
+static void bitmap_set(uint32_t*, uint32_t);
+static void bitmap_clear(uint32_t*, uint32_t);
+
+
+
+/**
+*	Fragmentation init.
+*
+*	Initializes fragmentation and reassembly. To be called after mac_init.
+*
+*	@param received_callback called with the source, the payload and its length when
+*							a payload is reassembled. The payload is only valid until
+*							the callback returns
+*	@param sent_callback called with the destination when all the fragments of a payload
+*						are acked (true), or when it's given up on (false). The payload
+*						buffer can be reused then
+*/
+void mac_frag_init( void(*received_callback)(uint16_t, uint8_t*, uint32_t), void(*sent_callback)(uint16_t, bool) ){
+	app_payload_received_callback = received_callback;
+	app_payload_sent_callback = sent_callback;
+}
+
+/**
+*	Send large payload.
+*
+*	Sends a payload of up to MAC_FRAG_MAX_LENGTH bytes to a destination, in
+*	fragments of MAC_FRAG_PAYLOAD_LENGTH bytes (with priority MAC_PRIO_BULK).
+*	The payload is NOT copied: the buffer must be left alone until sent_callback
+*	(see mac_frag_init) is called. FRAG_TX_WINDOW fragments are handed to the MAC
+*	at a time, so the next one is queued while the previous one waits for its
+*	ack. A fragment that isn't acked is sent again, up to FRAG_TX_RETRIES times
+*	(the receiver drops duplicates); the payload is given up on after that, or
+*	right away if the destination is deemed unreachable. Fragments are only
+*	sent from mac_poll (call it often), never from the USART1 handler, where
+*	this might be called from (a callback).
+*
+*	@param address the destination (not the broadcast address: fragments must be acked)
+*	@param data the payload
+*	@param length its length (1 to MAC_FRAG_MAX_LENGTH)
+*
+*	@return true if the payload is being sent, false if another one still is, or the
+*			payload is too long (or empty), or the address is the broadcast address
+*/
+bool mac_send_large( uint16_t address, const uint8_t* data, uint32_t length ){
+	if( length == 0 || length > MAC_FRAG_MAX_LENGTH || address == MSG_BROADCAST_ADDRESS )
+		return false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	if( tx.active ){
+		xbee_cpu_exit_critical(state);
+		return false;
+	}
+	
+	tx.active = true;
+	tx.failed = false;
+	tx.data = data;
+	tx.length = length;
+	tx.address = address;
+	tx.id = next_id++;
+	tx.n_fragments = (length + MAC_FRAG_PAYLOAD_LENGTH - 1) / MAC_FRAG_PAYLOAD_LENGTH;
+	tx.unacked = tx.n_fragments;
+	tx.in_flight = 0;
+	
+	for( uint32_t w=0; w<FRAG_WORDS; w++ )
+		tx.pending[w] = 0;
+	
+	for( uint32_t i=0; i<tx.n_fragments; i++ ){
+		bitmap_set( tx.pending, i );
+		tx.retries[i] = 0;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return true;
+}
+
+/**
+*	Fragment received.
+*
+*	Called by the MAC with every message received: fragments are copied to
+*	their reassembly slot, and the payload is handed to the app once all its
+*	fragments are in. A new payload takes a free slot, or one whose payload is
+*	done or timed out; if there's none, its fragment is dropped.
+*
+*	@param msg the message received
+*
+*	@return true if it was a fragment (not for the app), false otherwise
+*/
+bool mac_frag_msg_received( Message* msg ){
+	if( msg->data_length == 0 || msg->data[0] != MAC_FRAG_TAG )
+		return false;
+	
+	stats.rx_fragments++;
+	
+	if( msg->data_length <= MAC_FRAG_HEADER_LENGTH ){
+		stats.rx_fragments_invalid++;
+		return true;
+	}
+	
+	uint8_t id = msg->data[1];
+	uint8_t index = msg->data[2];
+	uint8_t count = msg->data[3];
+	uint32_t length = msg->data_length - MAC_FRAG_HEADER_LENGTH;
+	
+	//all fragments but the last one are full
+	if( count == 0 || count > MAC_FRAG_MAX_FRAGMENTS || index >= count ||
+		(index < count - 1 && length != MAC_FRAG_PAYLOAD_LENGTH) ||
+		index * MAC_FRAG_PAYLOAD_LENGTH + length > MAC_FRAG_MAX_LENGTH ){
+		stats.rx_fragments_invalid++;
+		return true;
+	}
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	Reassembly* slot = reassembly_get( msg->address, id, count );
+	
+	if( !slot ){
+		stats.rx_reassembly_table_full++;
+		xbee_cpu_exit_critical(state);
+		return true;
+	}
+	
+	if( slot->n_fragments != count ){
+		stats.rx_fragments_invalid++;
+		xbee_cpu_exit_critical(state);
+		return true;
+	}
+	
+	if( slot->done || bitmap_get(slot->bitmap, index) ){
+		stats.rx_fragments_duplicate++;
+		xbee_cpu_exit_critical(state);
+		return true;
+	}
+	
+	for( uint32_t i=0; i<length; i++ )
+		slot->data[index * MAC_FRAG_PAYLOAD_LENGTH + i] = msg->data[MAC_FRAG_HEADER_LENGTH + i];
+	
+	if( index == count - 1 )
+		slot->length = index * MAC_FRAG_PAYLOAD_LENGTH + length;
+	
+	bitmap_set( slot->bitmap, index );
+	slot->last_ms = xbee_cpu_get_ms();
+	slot->done = ++slot->received == count;
+	
+	if( slot->done )
+		stats.rx_payloads++;
+	
+	xbee_cpu_exit_critical(state);
+	
+	//(a done slot isn't reused until the callback returns: it's called from where fragments are received)
+	if( slot->done )
+		(*app_payload_received_callback)( slot->address, slot->data, slot->length );
+	
+	return true;
+}
+
+/**
+*	Fragment TX status.
+*
+*	Called by the MAC with every TX status: a fragment that isn't acked is
+*	queued to be sent again (or its payload given up on). Fragments go out from
+*	mac_poll, not from here (possibly the USART1 handler).
+*
+*	@param msg the message handle
+*	@param status its TX status
+*
+*	@return true if it was a fragment (not for the app), false otherwise
+*/
+bool mac_frag_tx_status( Message* msg, uint8_t status ){
+	FragInFlight* frag = NULL;
+	
+	for( uint32_t i=0; i<FRAG_TX_WINDOW; i++ )
+		if( tx_frags[i].used && &tx_frags[i].msg == msg )
+			frag = &tx_frags[i];
+	
+	if( !frag )
+		return false;
+	
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	frag->used = false;
+	tx.in_flight--;
+	
+	if( status == MSG_ACK_RECEIVED ){
+		tx.unacked--;
+	}
+	else{
+		stats.tx_fragments_failed++;
+		
+		if( !tx.failed && status != MSG_ACK_UNREACHABLE && tx.retries[frag->index] < FRAG_TX_RETRIES ){
+			tx.retries[frag->index]++;
+			bitmap_set( tx.pending, frag->index );
+			stats.tx_fragments_retried++;
+		}
+		else{
+			tx.failed = true;
+			for( uint32_t w=0; w<FRAG_WORDS; w++ )
+				tx.pending[w] = 0;
+		}
+	}
+	
+	bool finished = frag_tx_finish();
+	bool acked = !tx.failed;
+	uint16_t address = tx.address;
+	
+	xbee_cpu_exit_critical(state);
+	
+	if( finished && app_payload_sent_callback )
+		(*app_payload_sent_callback)( address, acked );
+	
+	return true;
+}
+
+/**
+*	Fragmentation poll.
+*
+*	Called from mac_poll: gives up on payloads whose fragments stopped arriving
+*	(counting the fragments missing as lost), and sends the fragments waiting
+*	(new ones, or to send again).
+*/
+void mac_frag_poll(void){
+	uint32_t now = xbee_cpu_get_ms();
+	
+	for( uint32_t s=0; s<MAC_FRAG_REASSEMBLY_SLOTS; s++ ){
+		uint32_t state = xbee_cpu_enter_critical();
+		
+		if( reassembly_expired(&reassembly[s], now) )
+			reassembly[s].used = false;
+		
+		xbee_cpu_exit_critical(state);
+	}
+	
+	frag_pump();
+}
+
+/**
+*	Fragmentation statistics.
+*
+*	@param out where statistics are copied
+*/
+void mac_frag_get_stats( MacFragStats* out ){
+	uint32_t state = xbee_cpu_enter_critical();
+	*out = stats;
+	xbee_cpu_exit_critical(state);
+}
+
+
+//  L O C A L    F U N C T I O N S
+
+/**
+*	Fragment pump
+*
+*	Hands the fragments waiting to be sent to the MAC, as long as fewer than
+*	FRAG_TX_WINDOW are waiting for their TX status and the MAC takes them. Only
+*	called from mac_frag_poll, in the main loop: fragments are never serialized
+*	from the USART1 handler (it could be in the middle of another frame, and
+*	UART waits can't time out there). Not reentrant: a call made while it runs
+*	(a callback calling mac_poll) leaves the work to it.
+*/
+static void frag_pump(void){
+	uint32_t state = xbee_cpu_enter_critical();
+	bool busy = tx_pumping;
+	
+	tx_pumping = true;
+	xbee_cpu_exit_critical(state);
+	
+	if( busy )
+		return;
+	
+	while( true ){
+		FragInFlight* frag = NULL;
+		int32_t index = -1;
+		
+		state = xbee_cpu_enter_critical();
+		
+		for( uint32_t i=0; i<tx.n_fragments && tx.active; i++ ){
+			if( bitmap_get(tx.pending, i) ){
+				index = i;
+				break;
+			}
+		}
+		
+		for( uint32_t i=0; i<FRAG_TX_WINDOW && index >= 0; i++ ){
+			if( !tx_frags[i].used ){
+				frag = &tx_frags[i];
+				break;
+			}
+		}
+		
+		if( frag ){
+			bitmap_clear( tx.pending, index );
+			frag->used = true;
+			frag->index = index;
+			tx.in_flight++;
+		}
+		
+		xbee_cpu_exit_critical(state);
+		
+		if( !frag )
+			break;
+		
+		uint32_t length = fragment_length(index);
+		
+		tx_buffer[0] = MAC_FRAG_TAG;
+		tx_buffer[1] = tx.id;
+		tx_buffer[2] = index;
+		tx_buffer[3] = tx.n_fragments;
+		for( uint32_t i=0; i<length; i++ )
+			tx_buffer[MAC_FRAG_HEADER_LENGTH + i] = tx.data[index * MAC_FRAG_PAYLOAD_LENGTH + i];
+		
+		frag->msg.address = tx.address;
+		frag->msg.data = tx_buffer;
+		frag->msg.data_length = MAC_FRAG_HEADER_LENGTH + length;
+		
+		//(its TX status might be reported before this returns)
+		if( mac_send_prio( &frag->msg, MAC_PRIO_BULK ) ){
+			stats.tx_fragments++;
+			continue;
+		}
+		
+		//MAC queue full, try again later
+		state = xbee_cpu_enter_critical();
+		bitmap_set( tx.pending, index );
+		frag->used = false;
+		tx.in_flight--;
+		xbee_cpu_exit_critical(state);
+		break;
+	}
+	
+	tx_pumping = false;
+}
+
+/**
+*	TX finish
+*
+*	Ends the payload being sent once all its fragments are acked, or one
+*	failed for good and none is left waiting for its TX status. To be called
+*	within a critical section.
+*
+*	@return true if the payload was just ended (sent_callback is due)
+*/
+static bool frag_tx_finish(void){
+	if( !tx.active || tx.in_flight > 0 || (tx.unacked > 0 && !tx.failed) )
+		return false;
+	
+	tx.active = false;
+	
+	if( tx.failed )
+		stats.tx_payloads_failed++;
+	else
+		stats.tx_payloads++;
+	
+	return true;
+}
+
+/**
+*	Fragment length
+*
+*	@param index a fragment index of the payload being sent
+*
+*	@return the length of its payload
+*/
+static uint32_t fragment_length(uint32_t index){
+	uint32_t offset = index * MAC_FRAG_PAYLOAD_LENGTH;
+	
+	return (tx.length - offset > MAC_FRAG_PAYLOAD_LENGTH) ? MAC_FRAG_PAYLOAD_LENGTH : tx.length - offset;
+}
+
+/**
+*	Reassembly get
+*
+*	Finds the slot of a payload, or takes one for it: a free one, or else one
+*	whose payload is done (handed to the app) or timed out. To be called within
+*	a critical section.
+*
+*	@param address the source
+*	@param id the transfer ID
+*	@param count its fragment count
+*
+*	@return the slot, or NULL if all are busy with other payloads
+*/
+static Reassembly* reassembly_get(uint16_t address, uint8_t id, uint8_t count){
+	Reassembly* slot = NULL;
+	uint32_t now = xbee_cpu_get_ms();
+	
+	for( uint32_t s=0; s<MAC_FRAG_REASSEMBLY_SLOTS; s++ )
+		if( reassembly[s].used && reassembly[s].address == address && reassembly[s].id == id )
+			return &reassembly[s];
+	
+	for( uint32_t s=0; s<MAC_FRAG_REASSEMBLY_SLOTS && !slot; s++ )
+		if( !reassembly[s].used )
+			slot = &reassembly[s];
+	
+	for( uint32_t s=0; s<MAC_FRAG_REASSEMBLY_SLOTS && !slot; s++ )
+		if( reassembly[s].done || reassembly_expired(&reassembly[s], now) )
+			slot = &reassembly[s];
+	
+	if( !slot )
+		return NULL;
+	
+	slot->used = true;
+	slot->done = false;
+	slot->address = address;
+	slot->id = id;
+	slot->n_fragments = count;
+	slot->received = 0;
+	slot->length = 0;
+	for( uint32_t w=0; w<FRAG_WORDS; w++ )
+		slot->bitmap[w] = 0;
+	
+	return slot;
+}
+
+/**
+*	Reassembly expired
+*
+*	Tells whether a slot's payload timed out (REASSEMBLY_TIMEOUT ms without new
+*	fragments), accounting for it if it wasn't done: the slot is to be reused.
+*	To be called within a critical section.
+*
+*	@param slot the slot
+*	@param now the current time, in ms
+*
+*	@return true if it timed out
+*/
+static bool reassembly_expired(Reassembly* slot, uint32_t now){
+	if( !slot->used || now - slot->last_ms < REASSEMBLY_TIMEOUT )
+		return false;
+	
+	if( !slot->done ){
+		stats.rx_reassembly_timeouts++;
+		stats.rx_fragments_lost += slot->n_fragments - slot->received;
+	}
+	
+	return true;
+}
+
+/**
+*	Bitmap get
+*
+*	@param bitmap the bitmap
+*	@param i a bit
+*
+*	@return whether the bit is set
+*/
+static bool bitmap_get(uint32_t* bitmap, uint32_t i){
+	return (bitmap[i / 32] >> (i % 32)) & 1;
+}
+
+/**
+*	Bitmap set
+*
+*	@param bitmap the bitmap
+*	@param i a bit
+*/
+static void bitmap_set(uint32_t* bitmap, uint32_t i){
+	bitmap[i / 32] |= 1UL << (i % 32);
+}
+
+/**
+*	Bitmap clear
+*
+*	@param bitmap the bitmap
+*	@param i a bit
+*/
+static void bitmap_clear(uint32_t* bitmap, uint32_t i){
+	bitmap[i / 32] &= ~(1UL << (i % 32));
+}
+
+#endif /* MAC_FRAGMENTATION */
@@ -0,0 +1,64 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	mac_frag.h
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief header file for mac_frag.c
+ *
+ */
+
+#ifndef MAC_FRAG_H_
+#define MAC_FRAG_H_
+
+#include "message.h"
+
+#define MAC_FRAG_TAG				0xF7	///< First byte of every fragment. With MAC_FRAGMENTATION, messages starting with it are taken for fragments
+#define MAC_FRAG_HEADER_LENGTH		4		///< Fragment header: tag, transfer ID, fragment index, fragment count
+#define MAC_FRAG_PAYLOAD_LENGTH		(MSG_MAX_LENGTH - MAC_FRAG_HEADER_LENGTH)	///< Payload bytes per fragment (all but the last one are full)
+#define MAC_FRAG_MAX_LENGTH			2048	///< Max payload length (mac_send_large). Reassembly takes this much RAM per slot
+#define MAC_FRAG_MAX_FRAGMENTS		((MAC_FRAG_MAX_LENGTH + MAC_FRAG_PAYLOAD_LENGTH - 1) / MAC_FRAG_PAYLOAD_LENGTH)	///< Max fragments per payload (at most 255)
+#define MAC_FRAG_REASSEMBLY_SLOTS	2		///< Payloads being reassembled at once (from different sources, or transfers)
+
+typedef struct{ ///< Fragmentation statistics
+	uint32_t tx_payloads;				///< payloads sent (all their fragments acked)
+	uint32_t tx_payloads_failed;		///< payloads given up on (a fragment failed too many times, or its destination is unreachable)
+	uint32_t tx_fragments;				///< fragments handed to the MAC, retries included
+	uint32_t tx_fragments_failed;		///< fragments not acked (no ack, CCA failure, purged, lost or unreachable)
+	uint32_t tx_fragments_retried;		///< of those, fragments sent again
+	uint32_t rx_payloads;				///< payloads reassembled and handed to the app
+	uint32_t rx_fragments;				///< fragments received, duplicates included
+	uint32_t rx_fragments_duplicate;	///< fragments received twice (their ack was lost, and they were sent again)
+	uint32_t rx_fragments_invalid;		///< fragments dropped because their header made no sense (bad index, count or length)
+	uint32_t rx_fragments_lost;			///< fragments never received, of payloads given up on
+	uint32_t rx_reassembly_timeouts;	///< payloads given up on because their fragments stopped arriving
+	uint32_t rx_reassembly_table_full;	///< fragments dropped because MAC_FRAG_REASSEMBLY_SLOTS other payloads were being reassembled
+}MacFragStats;
+
+void mac_frag_init( void(*)(uint16_t, uint8_t*, uint32_t), void(*)(uint16_t, bool) );
+bool mac_send_large( uint16_t, const uint8_t*, uint32_t );
+bool mac_frag_msg_received( Message* );
+bool mac_frag_tx_status( Message*, uint8_t );
+void mac_frag_poll(void);
+void mac_frag_get_stats( MacFragStats* );
+
+#endif /* MAC_FRAG_H_ */
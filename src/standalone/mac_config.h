@@ -52,5 +52,16 @@
 #define RADIO_SPEED_RATE	9600						///< UART baud rate. Match it with Xbee's baud rate. (options: 1200, 2400, ... 57600)
 #define RADIO_TX_POWER		RADIO_MAX_TX_POWER			///< 0 = -10dBm, 1 = -6dBm, 2 = -4dBm, 3 = -2dBm, 4 = 0dBm							
 #define RADIO_CCA_THRESHOLD RADIO_DEFAULT_CCA_THRESHOLD	///< CCA Energy level Threshold in-dBm. Min = 0, Max = 0x50 
+//#define MAC_MAX_IN_FLIGHT_PER_DEST	1						///< Max unicast messages waiting for their ack per destination (default: 4, all of them). Failing destinations are held to one anyway
+//#define MAC_DEFERRED_DISPATCH							///< Call msg/ack callbacks from mac_poll() (main loop) instead of the USART1 handler
+//#define MAC_MSG_POOL_DROP_OLDEST						///< When a received message finds the pool exhausted, drop the oldest one queued that makes room for it (default: drop the newest). MAC_DEFERRED_DISPATCH only
+//#define XBEE_DEFERRED_RX_PROCESSING					///< Process received frames in mac_poll() (main loop) instead of the USART1 handler
+//#define XBEE_UART_RX_PDC								///< Receive by PDC (DMA) in chunks instead of one interrupt per byte. Recommended at 57600 and above
+//#define XBEE_UART_TX_PDC								///< Send by PDC (DMA). mac_send() returns without waiting for the frame to be sent
+//#define XBEE_UART_FLOW_CONTROL						///< RTS/CTS hardware flow control (RTS on PA24, CTS on PA25). Recommended at 115200
+//#define XBEE_BAUDRATE_UPGRADE						///< At init, raise the baud rate above RADIO_SPEED_RATE for as long as the link holds (see xbee_get_baudrate_report)
+//#define MAC_WARM_BOOT									///< Skip configuring the radio after a reset (not a power up) if this configuration hasn't changed
+//#define MAC_FRAGMENTATION								///< Send and receive payloads longer than a message (mac_send_large). Messages starting with MAC_FRAG_TAG are taken for fragments
+//#define MAC_BULK_TRANSFER								///< Reliable windowed transfers with selective acks (mac_bulk_send). Messages starting with MAC_BULK_TAG are taken for its segments and SACKs
 	
 #endif /* MAC_CONFIG_H_ */
\ No newline at end of file
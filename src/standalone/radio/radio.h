@@ -31,11 +31,48 @@
 #ifndef RADIO_H_
 #define RADIO_H_
 
+#include "xbee/xbee.h"
+
 #define	RADIO_DEFAULT_CCA_THRESHOLD 0x2C	///< Default CCA threshold
 #define	RADIO_MAX_SPEED_RATE		57600	///< Max baud rate
 #define	RADIO_MAX_TX_POWER			4		///< Max TX Power
+#define RADIO_AT_STATUS_TIMEOUT		0xFF	///< AT command response status reported when no response arrived
+
+typedef struct{ ///< Radio configuration (as read by radio_read_config)
+	uint16_t address;		///< 16-bit address (MY)
+	uint16_t panid;			///< PAN ID (ID)
+	uint8_t channel;		///< channel (CH)
+	bool acks;				///< acks enabled (MM)
+	uint8_t tx_power;		///< TX power level (PL)
+	uint8_t cca_threshold;	///< CCA threshold in -dBm (CA)
+	uint8_t extra_retries;	///< extra retries (RR)
+	uint8_t macminbe;		///< macMinBE (RN)
+}RadioConfig;
+
+typedef struct{ ///< Radio statistics
+	uint32_t at_commands;		///< AT commands sent
+	uint32_t at_timeouts;		///< AT commands whose response never arrived (reported with status RADIO_AT_STATUS_TIMEOUT)
+	uint32_t wait_timeouts;		///< blocking waits (for room, or for responses) cut short by their deadline
+	uint32_t refresh_failures;	///< times the radio parameters (shadow copy) failed to be read
+}RadioStats;
 
 bool radio_init(void);
+bool radio_send_at_command(const uint8_t*, const uint8_t*, uint8_t, void(*)(XbeeATCommandResponse*));
+void radio_poll(void);
+void radio_get_stats(RadioStats*);
+bool radio_read_config(RadioConfig*);
+bool radio_refresh(void);
+bool radio_shadow_valid(void);
+bool radio_query_16bit_address(uint16_t*);
+bool radio_config_begin(void);
+void radio_config_set_16bit_address(uint16_t);
+void radio_config_set_panid(uint16_t);
+void radio_config_set_channel(uint8_t);
+void radio_config_set_acks(bool);
+void radio_config_set_tx_power(uint8_t);
+void radio_config_set_cca_threshold(uint8_t);
+void radio_config_set_macminbe(uint8_t);
+bool radio_config_commit(void);
 uint16_t radio_read_16bit_address(void);
 uint16_t radio_read_panid(void);
 uint8_t radio_read_channel(void);
@@ -44,14 +81,16 @@ uint8_t radio_read_cca_threshold(void);
 uint8_t radio_read_extra_retries(void);
 bool radio_read_acks(void);
 uint8_t radio_read_macminbe(void);
-void radio_write_16bit_address(uint16_t);
-void radio_write_panid(uint16_t);
-void radio_write_channel(uint8_t);
-void radio_write_acks(bool);
-void radio_write_tx_power(uint8_t);
-void radio_write_cca_threshold(uint8_t);
-void radio_write_extra_retries(uint8_t); //not working
-void radio_write_macminbe(uint8_t); 
+//Each write sets one value and saves it (WR), blocking until both are acked or given up on.
+//It returns true only if both were acked (false if the value is out of range: nothing is sent)
+bool radio_write_16bit_address(uint16_t);
+bool radio_write_panid(uint16_t);
+bool radio_write_channel(uint8_t);
+bool radio_write_acks(bool);
+bool radio_write_tx_power(uint8_t);
+bool radio_write_cca_threshold(uint8_t);
+bool radio_write_extra_retries(uint8_t); //not working
+bool radio_write_macminbe(uint8_t); 
 
 
 #endif /* RADIO_H_ */
\ No newline at end of file
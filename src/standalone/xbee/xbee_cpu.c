@@ -34,7 +34,76 @@
 #include <stdbool.h>
 #include "xbee_cpu.h"
 
+#define RETAINED_GPBR	GPBR7	///< General purpose backup register holding the retained word
 
+static volatile uint32_t ms_ticks = 0;		///< milliseconds elapsed (SysTick periods)
+static uint32_t cycles_per_us;				///< SysTick (CPU clock) cycles per microsecond
+
+static void (*yield_callback)(void) = NULL;				///< cooperative scheduler yield (see xbee_cpu_wait)
+static XbeeCpuWaitStats wait_stats[XBEE_CPU_N_WAITS];
+
+/**
+*	CPU init
+*
+*	Starts the timebase: SysTick, interrupting every millisecond. The 
+*	microsecond part is read from the SysTick counter itself.
+*/
+void xbee_cpu_init(void){
+	cycles_per_us = sysclk_get_cpu_hz() / 1000000;
+	SysTick_Config( sysclk_get_cpu_hz() / 1000 );
+}
+
+/**
+*	Milliseconds
+*
+*	Monotonic millisecond counter, started by xbee_cpu_init. It wraps around
+*	(after about 49 days), so compare times by subtracting them.
+*
+*	@return milliseconds elapsed since xbee_cpu_init
+*/
+uint32_t xbee_cpu_get_ms(void){
+	return ms_ticks;
+}
+
+/**
+*	Microseconds
+*
+*	Monotonic microsecond counter, started by xbee_cpu_init. It wraps around
+*	(after about 71 minutes), so compare times by subtracting them (see 
+*	xbee_cpu_is_past). Works with interrupts disabled too, as long as they 
+*	aren't for more than a millisecond.
+*
+*	@return microseconds elapsed since xbee_cpu_init
+*/
+uint32_t xbee_cpu_get_us(void){
+	uint32_t ms, cycles;
+	
+	//read until SysTick_Handler doesn't run in between
+	do{
+		ms = ms_ticks;
+		cycles = SysTick->LOAD - SysTick->VAL;
+		
+		//wrapped, but SysTick_Handler hasn't run yet (interrupts disabled)
+		if( SCB->ICSR & SCB_ICSR_PENDSTSET_Msk )
+			cycles = SysTick->LOAD + 1 + SysTick->LOAD - SysTick->VAL;
+	}while( ms != ms_ticks );
+	
+	return ms * 1000 + cycles / cycles_per_us;
+}
+
+/**
+*	Is past
+*
+*	Tells whether a deadline has passed. Deadlines are xbee_cpu_get_us times
+*	(e.g. xbee_cpu_get_us() + timeout_ms * 1000), at most 35 minutes ahead.
+*
+*	@param deadline the deadline
+*
+*	@return true if the deadline has passed
+*/
+bool xbee_cpu_is_past(uint32_t deadline){
+	return (int32_t)(xbee_cpu_get_us() - deadline) >= 0;
+}
 
 /**
 *	CPU endianness
@@ -46,7 +115,7 @@
 bool xbee_cpu_is_little_endian(void) {
 	uint16_t i = 1;
 	uint8_t *p = (uint8_t *)&i;
-
+	
 	if (p[0] == 1)
 		return true;
 	else
@@ -69,19 +138,206 @@ uint16_t xbee_cpu_swap_endianness_16bit(uint16_t value) {
 	c2 = (value >> 8) & 0xff;
 	
 	return (c1 << 8) + c2;
+
+}
+
+
+
+/**
+*	Enter critical section
+*
+*	Disables interrupts (critical sections can be nested).
+*
+*	@return the previous interrupt state, to be passed to xbee_cpu_exit_critical
+*/
+uint32_t xbee_cpu_enter_critical(void){
+	return cpu_irq_save();
+}
+
+/**
+*	Exit critical section
+*
+*	Restores the interrupt state from before xbee_cpu_enter_critical.
+*
+*	@param state the state returned by xbee_cpu_enter_critical
+*/
+void xbee_cpu_exit_critical(uint32_t state){
+	cpu_irq_restore(state);
+}
+
+/**
+*	In interrupt
+*
+*	@return true if called from an interrupt handler
+*/
+bool xbee_cpu_in_interrupt(void){
+	return __get_IPSR() != 0;
+}
+
+/**
+*	Byte sum
+*
+*	Adds up a run of bytes (as needed by API frame checksums). Four bytes 
+*	are added at a time: with the Cortex-M4 SIMD instructions (USADA8) when
+*	available, otherwise with a portable SWAR (SIMD within a register) fallback.
+*
+*	@param data the bytes
+*	@param length number of bytes
+*
+*	@return the sum (only its 8 LSBs matter for checksums)
+*/
+uint32_t xbee_cpu_sum(const uint8_t* data, uint32_t length){
+	uint32_t sum = 0;
+	
+	//leading bytes, up to a word boundary
+	while( length > 0 && ((uintptr_t)data & 3) ){
+		sum += *data++;
+		length--;
+	}
+	
+	const uint32_t* words = (const uint32_t*)data;
+	uint32_t n_words = length >> 2;
+
+#if defined(__CORTEX_M) && (__CORTEX_M >= 0x04)
+	//|byte - 0| for all four bytes, accumulated (single cycle)
+	for( uint32_t i=0; i<n_words; i++ )
+		sum = __USADA8( words[i], 0, sum );
+#else
+	//two 16-bit lanes (even and odd bytes), folded before they can overflow
+	while( n_words > 0 ){
+		uint32_t chunk = (n_words > 128) ? 128 : n_words;
+		uint32_t lanes = 0;
+		
+		for( uint32_t i=0; i<chunk; i++ ){
+			uint32_t w = words[i];
+			lanes += (w & 0x00FF00FF) + ((w >> 8) & 0x00FF00FF);
+		}
+		
+		sum += (lanes & 0xFFFF) + (lanes >> 16);
+		words += chunk;
+		n_words -= chunk;
+	}
+#endif
 	
+	//trailing bytes
+	data += length & ~3u;
+	for( uint32_t i=0; i<(length & 3); i++ )
+		sum += data[i];
+	
+	return sum;
+}
+
+/**
+*	Read retained word
+*
+*	Reads a word kept across resets (in a general purpose backup register). 
+*	It's lost on power down, reading 0 again.
+*
+*	@return the word
+*/
+uint32_t xbee_cpu_read_retained(void){
+	return gpbr_read(RETAINED_GPBR);
 }
 
+/**
+*	Write retained word
+*
+*	Writes a word to be kept across resets (see xbee_cpu_read_retained).
+*
+*	@param value the word
+*/
+void xbee_cpu_write_retained(uint32_t value){
+	gpbr_write(RETAINED_GPBR, value);
+}
 
+/**
+*	Register yield callback
+*
+*	Registers the yield routine of a cooperative scheduler, to be called
+*	by xbee_cpu_wait instead of sleeping, so other tasks run while the 
+*	library waits on the radio.
+*
+*	@param callback the yield routine (NULL to sleep again)
+*/
+void xbee_cpu_register_yield_callback( void(*callback)(void) ){
+	yield_callback = callback;
+}
+
+/**
+*	Wait
+*
+*	Called repeatedly by waiting loops, between checks of what they wait for.
+*	Yields to the cooperative scheduler if one is registered, otherwise sleeps
+*	the core (WFI) until the next interrupt: USART1 brings radio traffic, and
+*	SysTick bounds the sleep to a millisecond. Returns right away when 
+*	called from an interrupt handler or with interrupts disabled, where
+*	nothing would wake the core.
+*/
+void xbee_cpu_wait(void){
+	if( xbee_cpu_in_interrupt() || __get_PRIMASK() != 0 )
+		return;
+	
+	if( yield_callback )
+		(*yield_callback)();
+	else
+		__WFI();
+}
+
+/**
+*	Wait end
+*
+*	Accounts for a wait, once done.
+*
+*	@param wait what was waited for
+*	@param start when the wait began (xbee_cpu_get_us time)
+*/
+void xbee_cpu_wait_end(XbeeCpuWait wait, uint32_t start){
+	uint32_t elapsed = xbee_cpu_get_us() - start;
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	wait_stats[wait].waits++;
+	wait_stats[wait].total_us += elapsed;
+	if( elapsed > wait_stats[wait].max_us )
+		wait_stats[wait].max_us = elapsed;
+	
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Get wait statistics
+*
+*	@param wait what was waited for
+*	@param out where the statistics are copied
+*/
+void xbee_cpu_get_wait_stats(XbeeCpuWait wait, XbeeCpuWaitStats* out){
+	uint32_t state = xbee_cpu_enter_critical();
+	*out = wait_stats[wait];
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	SysTick handler
+*
+*	Counts milliseconds (see xbee_cpu_init).
+*/
+void SysTick_Handler(void){
+	ms_ticks++;
+}
 
 /**
 *	Delays Routine in milliseconds.
 *
-*	Busy waiting delay routine in milliseconds.
+*	Delay routine in milliseconds, waiting through xbee_cpu_wait.
 *
 *	@param time_ms self explanatory
 */
 void xbee_cpu_delay_ms(uint32_t time_ms){
-	delay_ms(time_ms);
+	uint32_t start = xbee_cpu_get_us();
+	uint32_t deadline = start + time_ms * 1000;
+	
+	while( !xbee_cpu_is_past(deadline) )
+		xbee_cpu_wait();
+	
+	xbee_cpu_wait_end(XBEE_CPU_WAIT_DELAY, start);
 }
 
@@ -0,0 +1,257 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/**
+ * @file	xbee_msg_pool.c
+ * @author  Rafael Roman Otero
+ * @version 2.0
+ *
+ * @brief Fixed-block Message pool
+ *
+ * Received messages are built in place in pool messages and handed
+ * (by pointer) to upper layers, which hold a reference until they're done.
+ * Payload buffers come in a few size classes, each message taking the smallest
+ * one its payload fits in (or the next one up, if that class is exhausted).
+ * Allocation and release are O(1) and safe to use from interrupt handlers.
+ */
+
+#include <stdint-gcc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "xbee_cpu.h"
+#include "xbee_msg_pool.h"
+
+#define SMALL_MSG_LENGTH	16				///< Payload capacity of small messages
+#define SMALL_MSG_COUNT		6				///< Number of small messages
+#define MEDIUM_MSG_LENGTH	48				///< Payload capacity of medium messages
+#define MEDIUM_MSG_COUNT	3				///< Number of medium messages
+#define LARGE_MSG_LENGTH	MSG_MAX_LENGTH	///< Payload capacity of large messages
+#define LARGE_MSG_COUNT		2				///< Number of large messages
+
+#define N_CLASSES			3
+#define MSG_POOL_SIZE		(SMALL_MSG_COUNT + MEDIUM_MSG_COUNT + LARGE_MSG_COUNT)
+
+typedef struct{ ///< Size class. Its messages are pool[first] to pool[first + count - 1]
+	uint8_t length;			///< payload capacity
+	uint8_t count;
+	uint8_t first;
+	uint8_t* buffers;		///< payload buffers (count x length bytes)
+}SizeClass;
+
+static uint8_t small_buffers[SMALL_MSG_COUNT][SMALL_MSG_LENGTH];
+static uint8_t medium_buffers[MEDIUM_MSG_COUNT][MEDIUM_MSG_LENGTH];
+static uint8_t large_buffers[LARGE_MSG_COUNT][LARGE_MSG_LENGTH];
+
+static const SizeClass classes[N_CLASSES] = {
+	{ SMALL_MSG_LENGTH,		SMALL_MSG_COUNT,	0,									small_buffers[0] },
+	{ MEDIUM_MSG_LENGTH,	MEDIUM_MSG_COUNT,	SMALL_MSG_COUNT,					medium_buffers[0] },
+	{ LARGE_MSG_LENGTH,		LARGE_MSG_COUNT,	SMALL_MSG_COUNT + MEDIUM_MSG_COUNT,	large_buffers[0] }
+};
+
+static Message pool[MSG_POOL_SIZE];
+static uint8_t refs[MSG_POOL_SIZE];			///< references held on each message (0 = free)
+
+//Free messages, per class. Never-used messages are taken in order (n_fresh), released ones 
+//are stacked (class c uses free_stack[classes[c].first] onwards)
+static Message* free_stack[MSG_POOL_SIZE];
+static uint8_t n_free_stack[N_CLASSES];
+static uint8_t n_fresh[N_CLASSES];
+
+static XbeeMsgPoolStats stats;
+static bool (*exhausted_callback)(uint8_t) = NULL;	///< asked to give a message back when an allocation fails
+
+static Message* take(uint8_t);
+static uint32_t class_of(Message*);
+
+
+/**
+*	Allocate message
+*
+*	Takes a message from the pool, with one reference held by the caller. Its
+*	payload buffer can hold at least the length requested. If every class it
+*	fits in is exhausted, the exhausted callback (if any) is given a chance to
+*	give a message back, and the allocation is tried once more.
+*
+*	@param length payload length
+*
+*	@return the message, or NULL if the pool is exhausted
+*/
+Message* xbee_msg_pool_alloc(uint8_t length){
+	uint32_t state = xbee_cpu_enter_critical();
+	Message* msg = take(length);
+	
+	if( !msg && exhausted_callback && (*exhausted_callback)(length) )
+		msg = take(length);
+	
+	if( msg ){
+		refs[msg - pool] = 1;
+		stats.allocs++;
+		
+		if( ++stats.in_use > stats.high_water )
+			stats.high_water = stats.in_use;
+	}
+	else{
+		stats.alloc_failures++;
+	}
+	
+	xbee_cpu_exit_critical(state);
+	
+	return msg;
+}
+
+/**
+*	Retain message
+*
+*	Takes one more reference on a pool message (so it isn't given back to
+*	the pool when the current holder releases it).
+*
+*	@param msg the message
+*/
+void xbee_msg_pool_retain(Message* msg){
+	uint32_t state = xbee_cpu_enter_critical();
+	refs[msg - pool]++;
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Release message
+*
+*	Gives up one reference on a pool message. The message goes back to the
+*	pool once nobody holds it.
+*
+*	@param msg the message
+*/
+void xbee_msg_pool_release(Message* msg){
+	uint32_t state = xbee_cpu_enter_critical();
+	
+	if( refs[msg - pool] > 0 && --refs[msg - pool] == 0 ){
+		uint32_t c = class_of(msg);
+		
+		free_stack[classes[c].first + n_free_stack[c]++] = msg;
+		stats.in_use--;
+	}
+	
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Messages available
+*
+*	@param length payload length
+*
+*	@return number of free messages in the pool that can hold the payload length
+*/
+uint32_t xbee_msg_pool_available(uint8_t length){
+	uint32_t available = 0;
+	
+	for( uint32_t c=0; c<N_CLASSES; c++ ){
+		if( length <= classes[c].length )
+			available += classes[c].count - n_fresh[c] + n_free_stack[c];
+	}
+	
+	return available;
+}
+
+/**
+*	Message capacity
+*
+*	@param msg a pool message
+*
+*	@return the payload capacity of its buffer (its size class)
+*/
+uint8_t xbee_msg_pool_capacity(Message* msg){
+	return classes[class_of(msg)].length;
+}
+
+/**
+*	Register exhausted callback
+*
+*	The callback is called (within a critical section, possibly from an
+*	interrupt handler) when an allocation fails, with the payload length
+*	asked for. It may give back (release) a message that can hold it, and
+*	returns whether it did; the allocation is then tried once more.
+*
+*	@param callback the callback, NULL for none (the allocation just fails)
+*/
+void xbee_msg_pool_register_exhausted_callback( bool(*callback)(uint8_t) ){
+	exhausted_callback = callback;
+}
+
+/**
+*	Message pool statistics
+*
+*	@param out where statistics are copied
+*/
+void xbee_msg_pool_get_stats(XbeeMsgPoolStats* out){
+	uint32_t state = xbee_cpu_enter_critical();
+	*out = stats;
+	xbee_cpu_exit_critical(state);
+}
+
+/**
+*	Take message
+*
+*	Takes a free message from the smallest class the length fits in that
+*	isn't exhausted. To be called within a critical section.
+*
+*	@param length payload length
+*
+*	@return the message (its reference count not set yet), or NULL if none
+*/
+static Message* take(uint8_t length){
+	Message* msg = NULL;
+	
+	//smallest class that fits and isn't exhausted
+	for( uint32_t c=0; c<N_CLASSES && !msg; c++ ){
+		const SizeClass* class = &classes[c];
+		
+		if( length > class->length )
+			continue;
+		
+		if( n_free_stack[c] > 0 ){
+			msg = free_stack[class->first + --n_free_stack[c]];
+		}
+		else if( n_fresh[c] < class->count ){
+			msg = &pool[class->first + n_fresh[c]];
+			msg->data = class->buffers + n_fresh[c] * class->length;
+			n_fresh[c]++;
+		}
+	}
+	
+	return msg;
+}
+
+/**
+*	Class of a message
+*
+*	@param msg a pool message
+*
+*	@return the index of its size class
+*/
+static uint32_t class_of(Message* msg){
+	uint32_t i = msg - pool;
+	uint32_t c = 0;
+	
+	while( i >= (uint32_t)(classes[c].first + classes[c].count) )
+		c++;
+	
+	return c;
+}
@@ -0,0 +1,52 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/**
+ * @file	xbee_msg_pool.h
+ * @author  Rafael Roman Otero
+ * @version 2.0
+ *
+ * @brief header file for xbee_msg_pool.c
+ *
+ */
+
+
+#ifndef XBEE_MSG_POOL_H_
+#define XBEE_MSG_POOL_H_
+
+#include "message.h"
+
+typedef struct{ ///< Message pool statistics (all size classes)
+	uint32_t allocs;			///< messages allocated
+	uint32_t alloc_failures;	///< allocations failed (pool exhausted)
+	uint32_t in_use;			///< messages currently allocated
+	uint32_t high_water;		///< max messages ever allocated at once
+}XbeeMsgPoolStats;
+
+Message* xbee_msg_pool_alloc(uint8_t);
+void xbee_msg_pool_retain(Message*);
+void xbee_msg_pool_release(Message*);
+uint32_t xbee_msg_pool_available(uint8_t);
+uint8_t xbee_msg_pool_capacity(Message*);
+void xbee_msg_pool_register_exhausted_callback( bool(*)(uint8_t) );
+void xbee_msg_pool_get_stats(XbeeMsgPoolStats*);
+
+#endif /* XBEE_MSG_POOL_H_ */
@@ -37,7 +37,10 @@
 #include <asf.h>
 #include <stdint-gcc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "xbee_uart.h"
+#include "xbee_cpu.h"
+#include "mac_config.h"
 
 #define USART_SERIAL                 USART1
 #define USART_SERIAL_ID              ID_USART1
@@ -49,18 +52,108 @@
 #define PINS_USART1_ID       ID_USART1
 #define PINS_USART1_TYPE     PIO_PERIPH_A
 #define PINS_USART1_ATTR     PIO_DEFAULT
+#ifdef XBEE_UART_FLOW_CONTROL
+#define PINS_USART1_MASK     (PIO_PA21A_RXD1| PIO_PA22A_TXD1 | PIO_PA25A_CTS1 )
+#else
 #define PINS_USART1_MASK     (PIO_PA21A_RXD1| PIO_PA22A_TXD1 )
+#endif
+#define PIN_RTS_PIO			 PIOA		///< RTS (driven by software, from the receive ring level)
+#define PIN_RTS_MASK		 PIO_PA24	
+
+#define RX_RING_SIZE		256						///< Receive ring size. Must be a power of two
+#define RX_RING_MASK		(RX_RING_SIZE - 1)
+#define TX_RING_SIZE		256						///< Transmit ring size. Must be a power of two (not used with XBEE_UART_TX_PDC)
+#define TX_RING_MASK		(TX_RING_SIZE - 1)
+#define RX_PDC_BUFFER_SIZE	32						///< Size of each of the two PDC receive buffers (XBEE_UART_RX_PDC only)
+#define RX_TIMEOUT_PERIODS	20						///< Line idle time (in bit periods) that ends a PDC reception (XBEE_UART_RX_PDC only)
+#define RX_RTS_HIGH_WATER	(RX_RING_SIZE / 2)		///< Receive ring level that deasserts RTS (XBEE_UART_FLOW_CONTROL only). Leaves room for the PDC buffers
+#define RX_RTS_LOW_WATER	(RX_RING_SIZE / 4)		///< Receive ring level that asserts RTS again (XBEE_UART_FLOW_CONTROL only)
+#define TX_STALL_TIMEOUT	1000					///< ms without transmit progress (e.g. CTS held deasserted) before what's queued is dropped
+
+typedef struct{ ///< Transmit wait (see tx_stalled)
+	uint32_t left;		///< bytes left to be sent when last checked
+	uint32_t since;		///< when that number last changed (xbee_cpu_get_us time)
+	uint32_t start;		///< when the wait began (xbee_cpu_get_us time)
+	bool waited;		///< whether there was anything to wait for
+}TxWait;
 
 static void (*data_received_callback)(void);					///< UART1 interrupt callback
+static void (*tx_done_callback)(void);							///< UART1 transmission complete callback
+
+//Receive ring. Single producer (USART1_Handler), single consumer (xbee_uart_read).
+//Indexes are free running; only the producer writes rx_head and only the consumer writes rx_tail
+static volatile uint8_t rx_ring[RX_RING_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+
+static XbeeUartStats stats;
+
+//Receive error mark: position in the receive ring (as rx_head) where bytes were lost or
+//corrupted. Set by USART1_Handler, cleared by xbee_uart_take_rx_error once reading gets there
+static volatile uint32_t rx_error_at;
+static volatile bool rx_error_pending = false;
+
+#ifdef XBEE_UART_FLOW_CONTROL
+static volatile bool rts_deasserted = false;	///< whether the Xbee has been told to hold off sending
+#endif
+
+#ifdef XBEE_UART_RX_PDC
+//PDC receive buffers (ping-pong). One is being filled (PERIPH_RPR), the other is queued next (PERIPH_RNPR)
+static uint8_t rx_pdc_buffer[2][RX_PDC_BUFFER_SIZE];
+static uint8_t rx_pdc_current;
+#endif
+
+#ifdef XBEE_UART_TX_PDC
+//PDC transmit buffers. Frames alternate between them: one can be sent (PERIPH_TPR) while the other is queued next (PERIPH_TNPR)
+static uint8_t tx_pdc_buffer[2][XBEE_UART_TX_BUFFER_LENGTH];
+static uint8_t tx_pdc_slot;
+#else
+static uint8_t tx_buffer[XBEE_UART_TX_BUFFER_LENGTH];
+
+//Transmit ring. Single producer (xbee_uart_write), single consumer (USART1_Handler).
+static volatile uint8_t tx_ring[TX_RING_SIZE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+#endif
+static volatile bool tx_owned = false;	///< whether a frame is being written (between xbee_uart_get_tx_buffer and xbee_uart_send_tx_buffer)
+
+static void rx_ring_put(const volatile uint8_t*, uint32_t);
+static void rx_mark_error(uint32_t);
+static uint32_t tx_bytes_left(void);
+static void tx_wait_begin(TxWait*);
+static bool tx_stalled(TxWait*);
+static void tx_wait_end(TxWait*);
+static void tx_drop(void);
 
 
 /**
 *	Enables UART interrupt.
 *
-*	Enables UART interrupt.
+*	Enables UART interrupt. With XBEE_UART_RX_PDC defined reception is
+*	done by the PDC instead, interrupting only when a buffer fills up or
+*	the line goes idle.
 */
 void xbee_uart_enable_interrupt(void){
+#ifdef XBEE_UART_RX_PDC
+	Pdc* pdc = usart_get_pdc_base(USART_SERIAL);
+	
+	//first buffer is filled, second one is next
+	rx_pdc_current = 0;
+	pdc->PERIPH_RPR = (uint32_t)(uintptr_t)rx_pdc_buffer[0];
+	pdc->PERIPH_RCR = RX_PDC_BUFFER_SIZE;
+	pdc->PERIPH_RNPR = (uint32_t)(uintptr_t)rx_pdc_buffer[1];
+	pdc->PERIPH_RNCR = RX_PDC_BUFFER_SIZE;
+	
+	//time-out starts counting after the next character is received
+	usart_set_rx_timeout(USART_SERIAL, RX_TIMEOUT_PERIODS);
+	usart_start_rx_timeout(USART_SERIAL);
+	
+	pdc->PERIPH_PTCR = PERIPH_PTCR_RXTEN;
+	usart_enable_interrupt(USART_SERIAL, US_IER_ENDRX | US_IER_TIMEOUT);
+#else
 	usart_enable_interrupt(USART_SERIAL, US_IER_RXRDY);
+#endif
+	usart_enable_interrupt(USART_SERIAL, US_IER_OVRE | US_IER_FRAME | US_IER_PARE);
 	NVIC_EnableIRQ(USART1_IRQn);
 }
 
@@ -70,28 +163,56 @@ void xbee_uart_enable_interrupt(void){
 *	Disables UART interrupt.
 */
 void xbee_uart_disable_interrupt(void){
+#ifdef XBEE_UART_RX_PDC
+	usart_get_pdc_base(USART_SERIAL)->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+	usart_disable_interrupt(USART_SERIAL, US_IDR_ENDRX | US_IDR_TIMEOUT);
+#else
 	usart_disable_interrupt(USART_SERIAL, US_IER_RXRDY);
+#endif
+	usart_disable_interrupt(USART_SERIAL, US_IDR_OVRE | US_IDR_FRAME | US_IDR_PARE);
 	NVIC_EnableIRQ(USART1_IRQn);
 }
 
 /**
-*	putc for UART
+*	Write to UART
+*
+*	Queues bytes in the transmit ring, which is drained by the USART1 handler
+*	(TXRDY interrupt). Never blocks; if the ring is full fewer bytes are 
+*	accepted, and the caller is expected to retry with the rest. 
+*	(Not available with XBEE_UART_TX_PDC defined)
 *
-*	Writes one character to the UART1. Blocks until writing to Tx is possible.
+*	@param data bytes to be written
+*	@param n number of bytes
 *
-*	@param c the character to be written
+*	@return number of bytes accepted
 */
-void xbee_uart_putc(uint8_t c){
-	//wait for tx to be ready
-	while( !(USART_SERIAL->US_CSR & US_CSR_TXRDY) );
-	//write
-	usart_write(USART_SERIAL, c);
+#ifndef XBEE_UART_TX_PDC
+size_t xbee_uart_write(const uint8_t* data, size_t n){
+	uint32_t head = tx_head;
+	uint32_t free = TX_RING_SIZE - (head - tx_tail);
+	
+	if( n > free )
+		n = free;
+	
+	for(size_t i=0; i<n; i++){
+		tx_ring[(head + i) & TX_RING_MASK] = data[i];
+	}
+	
+	tx_head = head + n; //publishes the bytes (after they've being written)
+	
+	if( n > 0 )
+		usart_enable_interrupt(USART_SERIAL, US_IER_TXRDY);
+	
+	return n;
 }
+#endif
 
 /**
 *	getc for UART
 * 
 *	Reads one character from the UART. Blocks until a character is ready.
+*	It bypasses the receive ring, so it is only meant for polling while
+*	UART interrupts are disabled (e.g. during init).
 *
 *	@return A character from the UART buffer
 */
@@ -111,19 +232,236 @@ uint8_t xbee_uart_getc(void){
 }
 
 /**
-*	puts for UART
+*	Try get char
+*
+*	Polls the UART for a character received, without waiting (UART
+*	interrupts must be disabled).
+*
+*	@param c where the character is stored
+*
+*	@return true if a character was received
+*/
+bool xbee_uart_try_getc(uint8_t* c){
+	uint32_t ch;
+	
+	if( !(usart_get_status(USART_SERIAL) & US_CSR_RXRDY) )
+		return false;
+	
+	usart_read(USART_SERIAL, &ch);
+	*c = (uint8_t)ch;
+	
+	return true;
+}
+
+/**
+*	Read from UART
+*
+*	Reads up to n bytes received over the UART (and buffered in the receive
+*	ring). Never blocks. Reading stops short of a receive error (see 
+*	xbee_uart_take_rx_error).
 *
-*	Writes a null-terminated string to the UART. Blocks until transmitting is possible.
+*	@param buf buffer where bytes are copied
+*	@param n max number of bytes to read
 *
-*	@param buffer A pointer to the null-terminated string
+*	@return number of bytes read
 */
-void xbee_uart_puts( const uint8_t* buffer){
+size_t xbee_uart_read(uint8_t* buf, size_t n){
+	uint32_t tail = rx_tail;
+	uint32_t available = rx_head - tail;
+	
+	if( rx_error_pending && rx_error_at - tail < available )
+		available = rx_error_at - tail;
+	
+	if( n > available )
+		n = available;
+	
+	for(size_t i=0; i<n; i++){
+		buf[i] = rx_ring[(tail + i) & RX_RING_MASK];
+	}
 	
-	while( *buffer ){ //while not null characters
-		while( !(USART_SERIAL->US_CSR & US_CSR_TXRDY) ); //wait for tx to be ready
-		usart_write(USART_SERIAL, *buffer); //write
-		buffer++;									//next character
+	//frees the slots (after they've being copied)
+	rx_tail = tail + n;
+
+#ifdef XBEE_UART_FLOW_CONTROL
+	//let the Xbee send again once there's room (atomically, as the handler may be deasserting it)
+	if( rts_deasserted ){
+		uint32_t state = cpu_irq_save();
+		
+		if( rts_deasserted && rx_head - rx_tail <= RX_RTS_LOW_WATER ){
+			pio_clear(PIN_RTS_PIO, PIN_RTS_MASK);
+			rts_deasserted = false;
+		}
+		
+		cpu_irq_restore(state);
 	}
+#endif
+	
+	return n;
+}
+
+/**
+*	Take receive error
+*
+*	Tells whether reading has got to a receive error (bytes lost to an 
+*	overrun, or received with a framing or parity error), clearing it. The
+*	bytes read so far and the ones that follow don't belong to the same 
+*	frame, so the frame being received must be abandoned.
+*
+*	@return true if reading is at a receive error
+*/
+bool xbee_uart_take_rx_error(void){
+	//(the USART1 handler may mark a newer error in between)
+	uint32_t state = xbee_cpu_enter_critical();
+	bool at_error = rx_error_pending && rx_error_at == rx_tail;
+	
+	if( at_error )
+		rx_error_pending = false;
+	
+	xbee_cpu_exit_critical(state);
+	
+	return at_error;
+}
+
+/**
+*	Bytes available
+*
+*	@return number of received bytes waiting in the receive ring
+*/
+size_t xbee_uart_available(void){
+	return rx_head - rx_tail;
+}
+
+/**
+*	UART statistics
+*
+*	@param out where statistics are copied
+*/
+void xbee_uart_get_stats(XbeeUartStats* out){
+	*out = stats;
+}
+
+/**
+*	Transmit ready
+*
+*	Tells whether a frame can be handed over (xbee_uart_get_tx_buffer and 
+*	xbee_uart_send_tx_buffer) without waiting, with at most about one frame
+*	still ahead of it.
+*
+*	@return true if a frame can be sent right away
+*/
+bool xbee_uart_tx_ready(void){
+	if( tx_owned )
+		return false;
+
+#ifdef XBEE_UART_TX_PDC
+	return usart_get_pdc_base(USART_SERIAL)->PERIPH_TNCR == 0;
+#else
+	return tx_head - tx_tail <= TX_RING_SIZE - XBEE_UART_TX_BUFFER_LENGTH;
+#endif
+}
+
+/**
+*	Get transmit buffer
+*
+*	Returns the buffer where the next frame is to be written (at most 
+*	XBEE_UART_TX_BUFFER_LENGTH bytes) before calling xbee_uart_send_tx_buffer.
+*	With XBEE_UART_TX_PDC defined it blocks while two frames are still being sent
+*	(unless transmission stalls, see tx_stalled).
+*
+*	The buffer has one writer at a time, until xbee_uart_send_tx_buffer: a
+*	frame written from an interrupt handler while the main loop is writing
+*	another one is refused. Frames are best not sent from interrupt handlers
+*	at all, where waiting for the UART doesn't work (see xbee_cpu_wait).
+*
+*	@return the transmit buffer, or NULL if another frame is being written
+*/
+uint8_t* xbee_uart_get_tx_buffer(void){
+	uint32_t state = xbee_cpu_enter_critical();
+	bool owned = tx_owned;
+	
+	tx_owned = true;
+	if( owned )
+		stats.tx_busy++;
+	
+	xbee_cpu_exit_critical(state);
+	
+	if( owned )
+		return NULL;
+
+#ifdef XBEE_UART_TX_PDC
+	TxWait wait;
+	
+	//frames alternate between buffers, so as long as nothing is queued next
+	//the frame being sent (if any) is in the other buffer
+	tx_wait_begin(&wait);
+	while( usart_get_pdc_base(USART_SERIAL)->PERIPH_TNCR != 0 && !tx_stalled(&wait) )
+		xbee_cpu_wait();
+	tx_wait_end(&wait);
+	
+	return tx_pdc_buffer[tx_pdc_slot];
+#else
+	return tx_buffer;
+#endif
+}
+
+/**
+*	Send transmit buffer
+*
+*	Sends the frame written in the buffer returned by xbee_uart_get_tx_buffer.
+*	With XBEE_UART_TX_PDC defined the frame is handed to the PDC, otherwise
+*	it's queued in the transmit ring (waiting only if the ring is full, and 
+*	dropping the frame if transmission stalls). Either way it returns before
+*	the frame is sent, and the tx done callback is called once the last byte 
+*	has left the UART. The buffer is free for the next frame once it returns.
+*
+*	@param length length of the frame
+*/
+void xbee_uart_send_tx_buffer(uint16_t length){
+#ifdef XBEE_UART_TX_PDC
+	Pdc* pdc = usart_get_pdc_base(USART_SERIAL);
+	
+	//transfers are paused so the PDC can't finish in between
+	pdc->PERIPH_PTCR = PERIPH_PTCR_TXTDIS;
+	
+	if( pdc->PERIPH_TCR == 0 ){
+		//idle, send now
+		pdc->PERIPH_TPR = (uint32_t)(uintptr_t)tx_pdc_buffer[tx_pdc_slot];
+		pdc->PERIPH_TCR = length;
+	}
+	else{
+		//chain it after the frame being sent
+		pdc->PERIPH_TNPR = (uint32_t)(uintptr_t)tx_pdc_buffer[tx_pdc_slot];
+		pdc->PERIPH_TNCR = length;
+	}
+	
+	pdc->PERIPH_PTCR = PERIPH_PTCR_TXTEN;
+	tx_pdc_slot ^= 1;
+	
+	//let us know when both buffers are done
+	usart_enable_interrupt(USART_SERIAL, US_IER_TXBUFE);
+#else
+	const uint8_t* data = tx_buffer;
+	TxWait wait;
+	
+	//waits for room while the ring is full
+	tx_wait_begin(&wait);
+	while( length > 0 ){
+		size_t n = xbee_uart_write( data, length );
+		
+		if( n == 0 ){
+			if( tx_stalled(&wait) )
+				break;
+			
+			xbee_cpu_wait();	//(woken by the TXRDY interrupt)
+		}
+		
+		data += n;
+		length -= n;
+	}
+	tx_wait_end(&wait);
+#endif
+	
+	tx_owned = false;
 }
 
 /**
@@ -134,7 +472,7 @@ void xbee_uart_puts( const uint8_t* buffer){
 void xbee_uart_config_init(uint32_t baudrate){
 	pio_configure(PINS_USART1_PIO, PINS_USART1_TYPE, PINS_USART1_MASK, PINS_USART1_ATTR);
 	pmc_enable_periph_clk(ID_USART1);
-
+	
 	const sam_usart_opt_t usart_console_settings = {
 		baudrate,
 		USART_SERIAL_CHAR_LENGTH,
@@ -142,11 +480,39 @@ void xbee_uart_config_init(uint32_t baudrate){
 		USART_SERIAL_STOP_BIT,
 		US_MR_CHMODE_NORMAL
 	};
-
+	
 	sysclk_enable_peripheral_clock(USART_SERIAL_ID);	
+#ifdef XBEE_UART_FLOW_CONTROL
+	//CTS pauses transmission in hardware. RTS is a plain output (asserted, low, while there's room)
+	pio_configure(PIN_RTS_PIO, PIO_OUTPUT_0, PIN_RTS_MASK, PIO_DEFAULT);
+	usart_init_hw_handshaking(USART_SERIAL, &usart_console_settings, sysclk_get_peripheral_hz());
+#else
 	usart_init_rs232(USART_SERIAL, &usart_console_settings, sysclk_get_peripheral_hz());
+#endif
 	usart_enable_tx(USART_SERIAL);
 	usart_enable_rx(USART_SERIAL);
+	
+	//transmission is interrupt/PDC driven from now on (reception interrupts are enabled later)
+	NVIC_EnableIRQ(USART1_IRQn);
+}
+
+/**
+*	Set UART baud rate
+*
+*	Changes the baud rate on the fly, once everything queued for 
+*	transmission has been sent (or dropped, if transmission stalls).
+*
+*	@param baudrate the new baud rate
+*/
+void xbee_uart_set_baudrate(uint32_t baudrate){
+	TxWait wait;
+	
+	tx_wait_begin(&wait);
+	while( (tx_bytes_left() > 0 || !(usart_get_status(USART_SERIAL) & US_CSR_TXEMPTY)) && !tx_stalled(&wait) )
+		xbee_cpu_wait();
+	tx_wait_end(&wait);
+	
+	usart_set_async_baudrate(USART_SERIAL, baudrate, sysclk_get_peripheral_hz());
 }
 
 /**
@@ -161,18 +527,316 @@ void xbee_uart_register_callback( void(*callback)(void) ){
 	data_received_callback = callback;
 }
 
+/**
+*	Registers UART's transmission complete callback
+*
+*	Allows to register a function that will get call when
+*	every frame sent has completely left UART Tx 
+*
+*	@param callback a pointer to the callback function
+*/
+void xbee_uart_register_tx_done_callback( void(*callback)(void) ){
+	tx_done_callback = callback;
+}
+
 /**
 *	USART1 Handler
 *
-*	USART1 Handler. Where everything begins... 
+*	USART1 Handler. Where everything begins... Bytes received are
+*	dropped into the receive ring, and the upper layer notified.
 */
 void USART1_Handler(void){
 	
-	uint32_t dw_status = usart_get_status(USART1);
+	uint32_t dw_status = usart_get_status(USART1) & usart_get_interrupt_mask(USART1);
+	
+	if (dw_status & (US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE)) {
+		if (dw_status & US_CSR_OVRE)
+			stats.rx_overruns++;		//a character arrived before the previous one was read
+		if (dw_status & US_CSR_FRAME)
+			stats.rx_framing_errors++;
+		if (dw_status & US_CSR_PARE)
+			stats.rx_parity_errors++;
+		
+		usart_reset_status(USART_SERIAL);
+
+#ifdef XBEE_UART_RX_PDC
+		//(the offending character comes after the bytes the PDC has taken so far,
+		//a full buffer not put in the ring yet included)
+		uint32_t held = RX_PDC_BUFFER_SIZE - usart_get_pdc_base(USART_SERIAL)->PERIPH_RCR;
+		
+		if (dw_status & US_CSR_ENDRX)
+			held += RX_PDC_BUFFER_SIZE;
+		
+		rx_mark_error( rx_head + held );
+#else
+		rx_mark_error( rx_head );
+#endif
+	}
+
+#ifdef XBEE_UART_RX_PDC
+	Pdc* pdc = usart_get_pdc_base(USART_SERIAL);
+	bool received = false;
+	
+	if (dw_status & US_CSR_ENDRX) {
+		//current buffer is full (PDC already moved on to the next one)
+		rx_ring_put( rx_pdc_buffer[rx_pdc_current], RX_PDC_BUFFER_SIZE );
+		
+		if( pdc->PERIPH_RCR == 0 ){
+			//the next one is full too, so the PDC stopped (characters after it were lost,
+			//see OVRE above): take it as well and start over with both
+			rx_ring_put( rx_pdc_buffer[rx_pdc_current ^ 1], RX_PDC_BUFFER_SIZE );
+			
+			pdc->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+			pdc->PERIPH_RPR = (uint32_t)(uintptr_t)rx_pdc_buffer[rx_pdc_current];
+			pdc->PERIPH_RCR = RX_PDC_BUFFER_SIZE;
+			pdc->PERIPH_RNPR = (uint32_t)(uintptr_t)rx_pdc_buffer[rx_pdc_current ^ 1];
+			pdc->PERIPH_RNCR = RX_PDC_BUFFER_SIZE;
+			pdc->PERIPH_PTCR = PERIPH_PTCR_RXTEN;
+		}
+		else{
+			//queue it back as next (this clears ENDRX)
+			pdc->PERIPH_RNPR = (uint32_t)(uintptr_t)rx_pdc_buffer[rx_pdc_current];
+			pdc->PERIPH_RNCR = RX_PDC_BUFFER_SIZE;
+			rx_pdc_current ^= 1;
+		}
+		
+		received = true;
+	}
+	
+	if (dw_status & US_CSR_TIMEOUT) {
+		//line is idle, take whatever is in the current buffer
+		pdc->PERIPH_PTCR = PERIPH_PTCR_RXTDIS;
+		
+		uint32_t count = RX_PDC_BUFFER_SIZE - pdc->PERIPH_RCR;
+		
+		if( count > 0 ){
+			rx_ring_put( rx_pdc_buffer[rx_pdc_current], count );
+			
+			//restart current buffer from the beginning
+			pdc->PERIPH_RPR = (uint32_t)(uintptr_t)rx_pdc_buffer[rx_pdc_current];
+			pdc->PERIPH_RCR = RX_PDC_BUFFER_SIZE;
+			received = true;
+		}
+		
+		pdc->PERIPH_PTCR = PERIPH_PTCR_RXTEN;
+		usart_start_rx_timeout(USART_SERIAL); //clears TIMEOUT, waits for the next character
+	}
 	
+	if( received ){
+		(*data_received_callback)(); //notifies the upper layer data was received
+	}
+#else
 	if (dw_status & US_CSR_RXRDY) {
+		uint8_t c = (uint8_t)(USART_SERIAL->US_RHR & US_RHR_RXCHR_Msk);
+		
+		rx_ring_put( &c, 1 );
+		
 		(*data_received_callback)(); //notifies the upper layer data was received
 	}
+#endif
+
+#ifndef XBEE_UART_TX_PDC
+	if (dw_status & US_CSR_TXRDY) {
+		uint32_t tail = tx_tail;
+		
+		if( tx_head != tail ){
+			USART_SERIAL->US_THR = US_THR_TXCHR( tx_ring[tail & TX_RING_MASK] );
+			tx_tail = ++tail;
+		}
+		
+		if( tx_head == tail ){
+			//ring drained, wait for the last byte to leave the shift register
+			usart_disable_interrupt(USART_SERIAL, US_IDR_TXRDY);
+			usart_enable_interrupt(USART_SERIAL, US_IER_TXEMPTY);
+		}
+	}
+	
+	if (dw_status & US_CSR_TXEMPTY) {
+		usart_disable_interrupt(USART_SERIAL, US_IDR_TXEMPTY);
+		
+		//(unless more bytes were queued meanwhile)
+		if( tx_head == tx_tail && tx_done_callback )
+			(*tx_done_callback)();
+	}
+#else
+	if (dw_status & US_CSR_TXBUFE) {
+		//every frame was handed to the USART, wait for the last byte to leave the shift register
+		usart_disable_interrupt(USART_SERIAL, US_IDR_TXBUFE);
+		usart_enable_interrupt(USART_SERIAL, US_IER_TXEMPTY);
+	}
+	
+	if (dw_status & US_CSR_TXEMPTY) {
+		usart_disable_interrupt(USART_SERIAL, US_IDR_TXEMPTY);
+		
+		//(unless another frame was queued meanwhile)
+		Pdc* tx_pdc = usart_get_pdc_base(USART_SERIAL);
+		
+		if( tx_pdc->PERIPH_TCR == 0 && tx_pdc->PERIPH_TNCR == 0 && tx_done_callback )
+			(*tx_done_callback)();
+	}
+#endif
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////		     					L O C A L     R O U T I N E S								//////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+*	Receive mark error
+*
+*	Marks a receive error in the receive ring (only called from USART1_Handler). 
+*	Only one is kept: a newer one replaces an older one not yet reached, as
+*	abandoning the later frame is what matters most (checksums still catch the 
+*	earlier one).
+*
+*	@param position where the error happened (as rx_head)
+*/
+static void rx_mark_error(uint32_t position){
+	rx_error_at = position;
+	rx_error_pending = true;
+}
+
+/**
+*	Transmit bytes left
+*
+*	@return number of bytes queued for transmission (not handed to the USART yet)
+*/
+static uint32_t tx_bytes_left(void){
+#ifdef XBEE_UART_TX_PDC
+	Pdc* pdc = usart_get_pdc_base(USART_SERIAL);
+	
+	return pdc->PERIPH_TCR + pdc->PERIPH_TNCR;
+#else
+	return tx_head - tx_tail;
+#endif
+}
+
+/**
+*	Transmit wait begin
+*
+*	Starts watching transmit progress, before waiting on it (see tx_stalled).
+*
+*	@param wait the wait
+*/
+static void tx_wait_begin(TxWait* wait){
+	wait->left = tx_bytes_left();
+	wait->since = xbee_cpu_get_us();
+	wait->start = wait->since;
+	wait->waited = false;
+}
+
+/**
+*	Transmit wait end
+*
+*	Accounts for the time spent waiting (see xbee_cpu_get_wait_stats), if 
+*	there was anything to wait for.
+*
+*	@param wait the wait
+*/
+static void tx_wait_end(TxWait* wait){
+	if( wait->waited )
+		xbee_cpu_wait_end(XBEE_CPU_WAIT_UART_TX, wait->start);
+}
+
+/**
+*	Transmit stalled
+*
+*	Checks on transmit progress while waiting on it. If no byte has gone out for
+*	TX_STALL_TIMEOUT ms (with flow control, the Xbee may hold CTS deasserted, 
+*	e.g. when missing or browned out) what's queued is dropped, so the wait 
+*	is bounded.
+*
+*	@param wait the wait (see tx_wait_begin)
+*
+*	@return true if transmission stalled (and what was queued was dropped)
+*/
+static bool tx_stalled(TxWait* wait){
+	uint32_t left = tx_bytes_left();
+	uint32_t now = xbee_cpu_get_us();
+	
+	wait->waited = true;
+	
+	if( left != wait->left ){
+		wait->left = left;
+		wait->since = now;
+		return false;
+	}
+	
+	if( now - wait->since < TX_STALL_TIMEOUT * 1000 )
+		return false;
+	
+	tx_drop();
+	stats.tx_stalls++;
+	
+	return true;
+}
+
+/**
+*	Transmit drop
+*
+*	Drops every byte queued for transmission. The tx done callback is still
+*	called, once the USART is done.
+*/
+static void tx_drop(void){
+#ifdef XBEE_UART_TX_PDC
+	Pdc* pdc = usart_get_pdc_base(USART_SERIAL);
+	
+	pdc->PERIPH_PTCR = PERIPH_PTCR_TXTDIS;
+	pdc->PERIPH_TNCR = 0;
+	pdc->PERIPH_TCR = 0;
+	pdc->PERIPH_PTCR = PERIPH_PTCR_TXTEN;
+#else
+	//(the consumer's index, so USART1_Handler must not run in between)
+	uint32_t state = xbee_cpu_enter_critical();
+	tx_tail = tx_head;
+	xbee_cpu_exit_critical(state);
+#endif
+}
+
+/**
+*	Receive ring put
+*
+*	Drops received bytes into the receive ring (producer side, only called
+*	from USART1_Handler). Bytes that don't fit are lost, and a receive error
+*	is marked where they'd have gone (the frame they belong to is abandoned).
+*
+*	@param data bytes received
+*	@param n number of bytes
+*/
+static void rx_ring_put(const volatile uint8_t* data, uint32_t n){
+	uint32_t head = rx_head;
+	uint32_t used = head - rx_tail;
+	bool lost = false;
+	
+	stats.rx_bytes += n;
+	
+	if( n > RX_RING_SIZE - used ){
+		//ring is full, bytes are lost
+		stats.rx_ring_overruns += n - (RX_RING_SIZE - used);
+		n = RX_RING_SIZE - used;
+		lost = true;
+	}
+	
+	for(uint32_t i=0; i<n; i++){
+		rx_ring[(head + i) & RX_RING_MASK] = data[i];
+	}
+	
+	//(marked before the bytes are published, so reading can't go past it)
+	if( lost )
+		rx_mark_error( head + n );
+	
+	rx_head = head + n; //publishes the bytes (after they've being written)
+	
+	if( used + n > stats.rx_ring_high_water )
+		stats.rx_ring_high_water = used + n;
+
+#ifdef XBEE_UART_FLOW_CONTROL
+	//tell the Xbee to hold off before the ring fills up
+	if( !rts_deasserted && used + n >= RX_RTS_HIGH_WATER ){
+		pio_set(PIN_RTS_PIO, PIN_RTS_MASK);
+		rts_deasserted = true;
+		stats.rts_deasserts++;
+	}
+#endif
+}
@@ -31,12 +31,37 @@
 #ifndef XBEE_UART_H_
 #define XBEE_UART_H_
 
+#include <stddef.h>
+
+#define XBEE_UART_TX_BUFFER_LENGTH	115	///< Max API frame length sent (64-bit TX request carrying 100 bytes of RF data)
+
+typedef struct{ ///< UART statistics
+	uint32_t rx_bytes;				///< bytes received
+	uint32_t rx_ring_overruns;		///< bytes lost because the receive ring was full
+	uint32_t rx_ring_high_water;	///< max number of bytes ever waiting in the receive ring
+	uint32_t rx_overruns;			///< characters lost because the previous one hadn't been read yet (US_CSR_OVRE)
+	uint32_t rx_framing_errors;		///< characters received with a framing error, e.g. wrong baud rate or noise (US_CSR_FRAME)
+	uint32_t rx_parity_errors;		///< characters received with a parity error (US_CSR_PARE)
+	uint32_t rts_deasserts;			///< times the Xbee was told to hold off sending (XBEE_UART_FLOW_CONTROL only)
+	uint32_t tx_stalls;				///< times transmission made no progress for a while (e.g. CTS held deasserted) and what was queued was dropped
+	uint32_t tx_busy;				///< frames refused because another one was being written (see xbee_uart_get_tx_buffer)
+}XbeeUartStats;
+
 void xbee_uart_enable_interrupt(void);
 void xbee_uart_disable_interrupt(void);
 uint8_t xbee_uart_getc(void);
-void xbee_uart_putc(uint8_t);
-void xbee_uart_puts(const uint8_t*);
+bool xbee_uart_try_getc(uint8_t*);
+size_t xbee_uart_read(uint8_t*, size_t);
+size_t xbee_uart_available(void);
+bool xbee_uart_take_rx_error(void);
+void xbee_uart_get_stats(XbeeUartStats*);
+size_t xbee_uart_write(const uint8_t*, size_t);
+bool xbee_uart_tx_ready(void);
+uint8_t* xbee_uart_get_tx_buffer(void);
+void xbee_uart_send_tx_buffer(uint16_t);
 void xbee_uart_config_init(uint32_t);
-void xbee_uart_register_callback( void(*)(void) );	
+void xbee_uart_set_baudrate(uint32_t);
+void xbee_uart_register_callback( void(*)(void) );
+void xbee_uart_register_tx_done_callback( void(*)(void) );	
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,239 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	bulk_bench.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Bulk transfer throughput benchmark (host).
+ *
+ * Runs mac_bulk.c against a stub MAC: mac_send_prio queues up to
+ * STUB_QUEUE_LENGTH frames, and the link sends one at a time, taking
+ * FRAME_OVERHEAD_US plus BYTE_US per byte (about what a 250 kbps radio with
+ * acks and turnaround gives), on simulated time. Each frame is lost with the
+ * probability asked for; lost frames get MSG_ACK_TIMEOUT, the rest are
+ * delivered (to the same engine, which plays both ends: addresses 1 and 2)
+ * and get MSG_ACK_RECEIVED. Every transfer must come through intact and in
+ * order (or be given up on, at high loss). Prints bytes/s per window and
+ * loss rate.
+ *
+ *	bulk_bench [loss % ...]		(default 0 5 10 20)
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xbee/xbee_cpu.h"
+#include "mac/mac.h"
+#include "mac/mac_bulk.h"
+
+#define TRANSFER_LENGTH		32768	///< Bytes per transfer
+#define STUB_QUEUE_LENGTH	4		///< Frames the stub MAC queues
+#define FRAME_OVERHEAD_US	1000	///< Air time per frame, besides its bytes (header, ack, turnaround)
+#define BYTE_US				32		///< Air time per byte
+#define MAX_LOSS_RATES		8
+#define TRANSFER_GAVE_UP	-1
+#define TRANSFER_DAMAGED	-2		///< (or not done within SIM_LIMIT_MS, or couldn't be started)
+#define SIM_LIMIT_MS		600000	///< Simulated time a transfer is given before the bench gives up on it
+
+typedef struct{ ///< Frame queued in the stub MAC
+	Message* handle;			///< as passed to mac_send_prio
+	uint8_t data[MSG_MAX_LENGTH];
+	uint8_t data_length;
+	uint16_t address;
+}Frame;
+
+static Frame queue[STUB_QUEUE_LENGTH];
+static uint32_t queued = 0;
+static uint32_t loss_per_mille = 0;
+static uint64_t now_us = 0;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint8_t sent[TRANSFER_LENGTH];
+static uint8_t received[TRANSFER_LENGTH];
+static uint32_t received_length;
+static bool in_order;
+static bool last_received;
+static int transfer_result;	///< -1 while the transfer is on, then whether it was sent
+
+static uint32_t rng(void){
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	
+	return rng_state >> 32;
+}
+
+uint32_t xbee_cpu_get_ms(void){ return now_us / 1000; }
+uint32_t xbee_cpu_enter_critical(void){ return 0; }
+void xbee_cpu_exit_critical(uint32_t state){}
+
+/**
+*	Stub MAC send
+*
+*	Queues a copy of the frame (the handle is kept for its TX status).
+*/
+bool mac_send_prio(Message* msg, uint8_t priority){
+	if( queued == STUB_QUEUE_LENGTH )
+		return false;
+	
+	Frame* frame = &queue[queued++];
+	
+	frame->handle = msg;
+	frame->address = msg->address;
+	frame->data_length = msg->data_length;
+	memcpy(frame->data, msg->data, msg->data_length);
+	
+	return true;
+}
+
+/**
+*	Link step
+*
+*	Sends the frame at the head of the queue (or lets a millisecond go by
+*	if there's none), delivers it unless it's lost, and reports its status.
+*/
+static void link_step(void){
+	if( queued == 0 ){
+		now_us += 1000;
+		return;
+	}
+	
+	Frame frame = queue[0];
+	
+	memmove(&queue[0], &queue[1], --queued * sizeof(Frame));
+	now_us += FRAME_OVERHEAD_US + frame.data_length * BYTE_US;
+	
+	bool lost = rng() % 1000 < loss_per_mille;
+	
+	if( !lost ){
+		Message msg = { .address = (frame.address == 2) ? 1 : 2, .data = frame.data, .data_length = frame.data_length };
+		
+		mac_bulk_msg_received(&msg);
+	}
+	
+	mac_bulk_tx_status(frame.handle, lost ? MSG_ACK_TIMEOUT : MSG_ACK_RECEIVED);
+}
+
+static void data_received(uint16_t address, uint32_t offset, uint8_t* data, uint32_t length, bool last){
+	if( offset != received_length || offset + length > TRANSFER_LENGTH ){
+		in_order = false;
+		return;
+	}
+	
+	memcpy(&received[offset], data, length);
+	received_length = offset + length;
+	last_received |= last;
+}
+
+static void transfer_sent(uint16_t address, bool ok){
+	transfer_result = ok;
+}
+
+/**
+*	Run transfer
+*
+*	@param window window size
+*	@param loss_percent frames lost, in %
+*
+*	@return bytes/s achieved, TRANSFER_GAVE_UP if the engine gave up on the
+*	transfer (expected on very lossy links), or TRANSFER_DAMAGED
+*/
+static double run_transfer(uint8_t window, uint32_t loss_percent){
+	uint64_t start_us = now_us;
+	MacBulkStats stats;
+	
+	for( uint32_t i=0; i<TRANSFER_LENGTH; i++ )
+		sent[i] = rng();
+	
+	loss_per_mille = loss_percent * 10;
+	received_length = 0;
+	in_order = true;
+	last_received = false;
+	transfer_result = -1;
+	
+	if( !mac_bulk_set_window(window) || !mac_bulk_send(2, sent, TRANSFER_LENGTH) )
+		return TRANSFER_DAMAGED;
+	
+	while( transfer_result < 0 && now_us - start_us < SIM_LIMIT_MS * 1000ULL ){
+		link_step();
+		mac_bulk_poll();
+	}
+	
+	//let the receive session end before the next transfer
+	now_us += 20000000;
+	mac_bulk_poll();
+	
+	if( transfer_result == 0 )
+		return TRANSFER_GAVE_UP;
+	
+	if( transfer_result != 1 || !in_order || !last_received || received_length != TRANSFER_LENGTH || memcmp(sent, received, TRANSFER_LENGTH) )
+		return TRANSFER_DAMAGED;
+	
+	mac_bulk_get_stats(&stats);
+	
+	return stats.tx_last_bytes * 1000.0 / stats.tx_last_ms;
+}
+
+int main(int argc, char** argv){
+	static const uint8_t windows[] = { 1, 2, 4, 8, 16 };
+	uint32_t loss[MAX_LOSS_RATES] = { 0, 5, 10, 20 };
+	uint32_t n_loss = 4;
+	int result = 0;
+	
+	if( argc > 1 ){
+		n_loss = 0;
+		for( int i=1; i<argc && n_loss<MAX_LOSS_RATES; i++ )
+			loss[n_loss++] = atoi(argv[i]);
+	}
+	
+	mac_bulk_init(data_received, transfer_sent);
+	
+	printf("bytes/s, %u-byte transfers (%u us + %u us/byte per frame)\nwindow", TRANSFER_LENGTH, FRAME_OVERHEAD_US, BYTE_US);
+	for( uint32_t j=0; j<n_loss; j++ )
+		printf("  loss %2u%%", loss[j]);
+	printf("\n");
+	
+	for( uint32_t i=0; i<sizeof(windows); i++ ){
+		printf("%6u", windows[i]);
+		
+		for( uint32_t j=0; j<n_loss; j++ ){
+			double rate = run_transfer(windows[i], loss[j]);
+			
+			if( rate == TRANSFER_GAVE_UP ){
+				printf("   gave up");
+			}
+			else if( rate == TRANSFER_DAMAGED ){
+				printf("    FAILED");
+				result = 1;
+			}
+			else{
+				printf("  %8.0f", rate);
+			}
+		}
+		
+		printf("\n");
+	}
+	
+	return result;
+}
@@ -0,0 +1,167 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	asf.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Host stand-in for the ASF (see asf.h).
+ *
+ * Interrupts are modelled with one recursive lock: critical sections
+ * (cpu_irq_save) hold it, and so does an interrupt handler while it runs
+ * (host_irq_run), so handlers and critical sections never overlap, even
+ * when the handler is run from another thread.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "asf.h"
+
+#define HOST_CPU_HZ		120000000	///< SAM4S core clock
+
+Usart host_usart1;
+Pdc host_usart1_pdc;
+SysTick_Type host_systick;
+SCB_Type host_scb;
+
+static pthread_mutex_t irq_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread uint32_t irq_depth = 0;		///< critical sections (and handlers) the thread is in
+static __thread bool in_handler = false;	///< whether the thread is running an interrupt handler
+static uint32_t gpbr[8];
+
+
+/**
+*	IRQ save
+*
+*	Enters a critical section (takes the interrupt lock).
+*
+*	@return the previous state (unused)
+*/
+uint32_t cpu_irq_save(void){
+	pthread_mutex_lock(&irq_lock);
+	irq_depth++;
+	
+	return 0;
+}
+
+/**
+*	IRQ restore
+*
+*	Leaves a critical section.
+*
+*	@param state the state returned by cpu_irq_save (unused)
+*/
+void cpu_irq_restore(uint32_t state){
+	irq_depth--;
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/**
+*	Run interrupt
+*
+*	Runs an interrupt handler, as the NVIC would: not in the middle of a
+*	critical section, nor of another handler.
+*
+*	@param handler the handler (e.g. USART1_Handler)
+*/
+void host_irq_run(void(*handler)(void)){
+	cpu_irq_save();
+	in_handler = true;
+	(*handler)();
+	in_handler = false;
+	cpu_irq_restore(0);
+}
+
+/**
+*	PDC buffer
+*
+*	Turns what a PDC pointer register holds (the library stores pointers in
+*	32-bit registers) back into a host pointer. The buffers the library hands
+*	the PDC are statics, so they share the upper bits of the ones here.
+*
+*	@param reg the register value
+*
+*	@return the pointer
+*/
+void* host_pdc_buffer(uint32_t reg){
+	return (void*)(((uintptr_t)&host_usart1_pdc & ~(uintptr_t)0xFFFFFFFFu) | reg);
+}
+
+uint32_t __get_IPSR(void){ return in_handler ? USART1_IRQn + 16 : 0; }
+uint32_t __get_PRIMASK(void){ return irq_depth > 0; }
+void __WFI(void){ sched_yield(); }
+
+void usart_enable_interrupt(Usart* p, uint32_t mask){ p->US_IMR |= mask; }
+void usart_disable_interrupt(Usart* p, uint32_t mask){ p->US_IMR &= ~mask; }
+uint32_t usart_get_status(Usart* p){ return p->US_CSR; }
+uint32_t usart_get_interrupt_mask(Usart* p){ return p->US_IMR; }
+void usart_reset_status(Usart* p){ p->US_CSR &= ~(US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE); }
+Pdc* usart_get_pdc_base(Usart* p){ return &host_usart1_pdc; }
+void usart_set_rx_timeout(Usart* p, uint32_t periods){ p->US_RTOR = periods; }
+void usart_start_rx_timeout(Usart* p){ p->US_CSR &= ~US_CSR_TIMEOUT; }
+uint32_t usart_init_rs232(Usart* p, const sam_usart_opt_t* opt, uint32_t hz){ return 0; }
+uint32_t usart_init_hw_handshaking(Usart* p, const sam_usart_opt_t* opt, uint32_t hz){ return 0; }
+uint32_t usart_set_async_baudrate(Usart* p, uint32_t baudrate, uint32_t hz){ return 0; }
+void usart_enable_tx(Usart* p){ p->US_CSR |= US_CSR_TXRDY | US_CSR_TXEMPTY; }
+void usart_enable_rx(Usart* p){}
+void NVIC_EnableIRQ(IRQn_Type irq){}
+uint32_t sysclk_get_cpu_hz(void){ return HOST_CPU_HZ; }
+uint32_t sysclk_get_peripheral_hz(void){ return HOST_CPU_HZ; }
+void sysclk_enable_peripheral_clock(uint32_t id){}
+uint32_t pmc_enable_periph_clk(uint32_t id){ return 0; }
+uint32_t pio_configure(void* pio, uint32_t type, uint32_t mask, uint32_t attr){ return 1; }
+void pio_set(void* pio, uint32_t mask){}
+void pio_clear(void* pio, uint32_t mask){}
+uint32_t gpbr_read(uint32_t reg){ return gpbr[reg]; }
+void gpbr_write(uint32_t reg, uint32_t value){ gpbr[reg] = value; }
+
+/**
+*	USART read
+*
+*	Takes the character received (clearing RXRDY).
+*
+*	@param p the USART
+*
+*	@return the character
+*/
+uint32_t host_usart_read(Usart* p){
+	p->US_CSR &= ~US_CSR_RXRDY;
+	
+	return p->US_RHR & US_RHR_RXCHR_Msk;
+}
+
+/**
+*	SysTick config
+*
+*	Starts SysTick. The counter doesn't run on the host: time only moves when
+*	a test calls SysTick_Handler, a millisecond at a time.
+*
+*	@param ticks cycles per period
+*
+*	@return 0 (success)
+*/
+uint32_t SysTick_Config(uint32_t ticks){
+	host_systick.LOAD = ticks - 1;
+	host_systick.VAL = ticks - 1;
+	
+	return 0;
+}
@@ -0,0 +1,182 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	asf.h
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Host stand-in for the ASF, to build the library on a PC (tests only).
+ *
+ * Only what xbee_uart.c and xbee_cpu.c use is here. USART1 and its PDC are
+ * plain register blocks the tests drive (see asf.c), and an interrupt is a
+ * call made with the interrupt lock held: critical sections take that lock,
+ * so a handler run from another thread can't get in the middle of one.
+ */
+
+#ifndef HOST_ASF_H_
+#define HOST_ASF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct{ ///< USART registers (the ones the library uses)
+	volatile uint32_t US_CSR;	///< channel status
+	volatile uint32_t US_RHR;	///< receive holding
+	volatile uint32_t US_THR;	///< transmit holding
+	volatile uint32_t US_IMR;	///< interrupt mask
+	volatile uint32_t US_RTOR;	///< receiver time-out
+}Usart;
+
+typedef struct{ ///< PDC registers. Pointer registers hold the low 32 bits of host addresses (see host_pdc_buffer)
+	volatile uint32_t PERIPH_RPR;
+	volatile uint32_t PERIPH_RCR;
+	volatile uint32_t PERIPH_TPR;
+	volatile uint32_t PERIPH_TCR;
+	volatile uint32_t PERIPH_RNPR;
+	volatile uint32_t PERIPH_RNCR;
+	volatile uint32_t PERIPH_TNPR;
+	volatile uint32_t PERIPH_TNCR;
+	volatile uint32_t PERIPH_PTCR;
+	volatile uint32_t PERIPH_PTSR;	///< transfer status (receiver/transmitter enabled)
+}Pdc;
+
+typedef struct{ ///< SysTick registers
+	volatile uint32_t LOAD;
+	volatile uint32_t VAL;
+}SysTick_Type;
+
+typedef struct{ ///< System control block registers
+	volatile uint32_t ICSR;
+}SCB_Type;
+
+typedef struct{ ///< USART settings
+	uint32_t baudrate;
+	uint32_t char_length;
+	uint32_t parity_type;
+	uint32_t stop_bits;
+	uint32_t channel_mode;
+}sam_usart_opt_t;
+
+typedef enum{ USART1_IRQn = 15 }IRQn_Type;
+
+extern Usart host_usart1;
+extern Pdc host_usart1_pdc;
+extern SysTick_Type host_systick;
+extern SCB_Type host_scb;
+
+#define USART1						(&host_usart1)
+#define SysTick						(&host_systick)
+#define SCB							(&host_scb)
+#define PIOA						((void*)0)
+#define ID_USART1					14
+#define GPBR7						7
+
+#define US_CSR_RXRDY				(1u << 0)
+#define US_CSR_TXRDY				(1u << 1)
+#define US_CSR_ENDRX				(1u << 3)
+#define US_CSR_ENDTX				(1u << 4)
+#define US_CSR_OVRE					(1u << 5)
+#define US_CSR_FRAME				(1u << 6)
+#define US_CSR_PARE					(1u << 7)
+#define US_CSR_TIMEOUT				(1u << 8)
+#define US_CSR_TXEMPTY				(1u << 9)
+#define US_CSR_TXBUFE				(1u << 11)
+#define US_IER_RXRDY				US_CSR_RXRDY
+#define US_IER_TXRDY				US_CSR_TXRDY
+#define US_IER_ENDRX				US_CSR_ENDRX
+#define US_IER_OVRE					US_CSR_OVRE
+#define US_IER_FRAME				US_CSR_FRAME
+#define US_IER_PARE					US_CSR_PARE
+#define US_IER_TIMEOUT				US_CSR_TIMEOUT
+#define US_IER_TXEMPTY				US_CSR_TXEMPTY
+#define US_IER_TXBUFE				US_CSR_TXBUFE
+#define US_IDR_RXRDY				US_CSR_RXRDY
+#define US_IDR_TXRDY				US_CSR_TXRDY
+#define US_IDR_ENDRX				US_CSR_ENDRX
+#define US_IDR_OVRE					US_CSR_OVRE
+#define US_IDR_FRAME				US_CSR_FRAME
+#define US_IDR_PARE					US_CSR_PARE
+#define US_IDR_TIMEOUT				US_CSR_TIMEOUT
+#define US_IDR_TXEMPTY				US_CSR_TXEMPTY
+#define US_IDR_TXBUFE				US_CSR_TXBUFE
+#define US_RHR_RXCHR_Msk			0x1FFu
+#define US_THR_TXCHR(c)				((uint32_t)(c) & 0x1FFu)
+#define US_MR_CHRL_8_BIT			(3u << 6)
+#define US_MR_PAR_NO				(4u << 9)
+#define US_MR_NBSTOP_1_BIT			0
+#define US_MR_CHMODE_NORMAL			0
+
+#define PERIPH_PTCR_RXTEN			(1u << 0)
+#define PERIPH_PTCR_RXTDIS			(1u << 1)
+#define PERIPH_PTCR_TXTEN			(1u << 8)
+#define PERIPH_PTCR_TXTDIS			(1u << 9)
+
+#define PIO_PA21A_RXD1				(1u << 21)
+#define PIO_PA22A_TXD1				(1u << 22)
+#define PIO_PA24					(1u << 24)
+#define PIO_PA25A_CTS1				(1u << 25)
+#define PIO_PERIPH_A				0
+#define PIO_OUTPUT_0				1
+#define PIO_DEFAULT					0
+
+#define SCB_ICSR_PENDSTSET_Msk		(1u << 26)
+
+//interrupts (see asf.c)
+uint32_t cpu_irq_save(void);
+void cpu_irq_restore(uint32_t);
+uint32_t __get_IPSR(void);
+uint32_t __get_PRIMASK(void);
+void __WFI(void);
+void host_irq_run(void(*)(void));
+void* host_pdc_buffer(uint32_t);
+
+//drivers (register accesses only)
+void usart_enable_interrupt(Usart*, uint32_t);
+void usart_disable_interrupt(Usart*, uint32_t);
+uint32_t usart_get_status(Usart*);
+uint32_t usart_get_interrupt_mask(Usart*);
+void usart_reset_status(Usart*);
+Pdc* usart_get_pdc_base(Usart*);
+void usart_set_rx_timeout(Usart*, uint32_t);
+void usart_start_rx_timeout(Usart*);
+uint32_t usart_init_rs232(Usart*, const sam_usart_opt_t*, uint32_t);
+uint32_t usart_init_hw_handshaking(Usart*, const sam_usart_opt_t*, uint32_t);
+uint32_t usart_set_async_baudrate(Usart*, uint32_t, uint32_t);
+void usart_enable_tx(Usart*);
+void usart_enable_rx(Usart*);
+void NVIC_EnableIRQ(IRQn_Type);
+uint32_t SysTick_Config(uint32_t);
+uint32_t sysclk_get_cpu_hz(void);
+uint32_t sysclk_get_peripheral_hz(void);
+void sysclk_enable_peripheral_clock(uint32_t);
+uint32_t pmc_enable_periph_clk(uint32_t);
+uint32_t pio_configure(void*, uint32_t, uint32_t, uint32_t);
+void pio_set(void*, uint32_t);
+void pio_clear(void*, uint32_t);
+uint32_t gpbr_read(uint32_t);
+uint32_t host_usart_read(Usart*);
+void gpbr_write(uint32_t, uint32_t);
+
+//(takes a uint8_t or a uint32_t, like the ASF's does in practice)
+#define usart_read(usart, c)		( *(c) = host_usart_read(usart) )
+
+#endif /* HOST_ASF_H_ */
@@ -0,0 +1,211 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	parser_bench.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Receive parser benchmark (host).
+ *
+ * Feeds a recorded stream of API frames (messages of several lengths, and
+ * message responses) to xbee_process_rx through a stub UART, over and over,
+ * and prints the time taken per byte and per frame. It's fed two ways: one
+ * byte per xbee_process_rx call, as the USART1 handler does per RXRDY
+ * interrupt, and all at once, read in chunks, as mac_poll does with
+ * XBEE_DEFERRED_RX_PROCESSING. Every frame must be delivered, with the
+ * payload it was sent with, and none must be dropped.
+ *
+ * Times are the host's, in ns: a proxy to compare parser changes with, not
+ * Cortex-M4 cycles (those need DWT->CYCCNT on the target).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "xbee/xbee_uart.h"
+#include "xbee/xbee_msg_pool.h"
+#include "xbee/xbee.h"
+
+#define STREAM_MAX_LENGTH	8192	///< Bytes in the recorded stream
+#define ROUNDS				2000	///< Times the stream is fed
+#define API_ID_MSG_16		0x81	///< 16-bit RX (message received)
+#define API_ID_MSG_RESPONSE	0x89	///< TX status (message response)
+
+static uint8_t stream[STREAM_MAX_LENGTH];
+static size_t stream_length = 0;
+static size_t read_at = 0;
+static size_t received = 0;				///< bytes of the stream the stub UART has received so far
+
+static uint32_t frames_expected = 0;	///< per round
+static uint32_t payload_sum_expected = 0;
+static uint32_t frames_delivered = 0;
+static uint32_t payload_sum = 0;
+
+//stub UART: reads come from the recorded stream, as far as it has been received
+size_t xbee_uart_read(uint8_t* buffer, size_t n){
+	if( n > received - read_at )
+		n = received - read_at;
+	
+	memcpy(buffer, &stream[read_at], n);
+	read_at += n;
+	
+	return n;
+}
+
+bool xbee_uart_take_rx_error(void){ return false; }
+bool xbee_uart_try_getc(uint8_t* c){ return false; }
+bool xbee_uart_tx_ready(void){ return true; }
+uint8_t* xbee_uart_get_tx_buffer(void){ static uint8_t buffer[128]; return buffer; }
+void xbee_uart_send_tx_buffer(uint16_t length){}
+void xbee_uart_config_init(uint32_t baudrate){}
+void xbee_uart_set_baudrate(uint32_t baudrate){}
+void xbee_uart_enable_interrupt(void){}
+void xbee_uart_register_callback( void(*callback)(void) ){}
+void xbee_uart_register_tx_done_callback( void(*callback)(void) ){}
+
+/**
+*	Record frame
+*
+*	Appends an API frame (delimiter, length, API ID, data, checksum) to the stream.
+*/
+static void record_frame(uint8_t api_id, const uint8_t* data, uint16_t length){
+	uint8_t sum = api_id;
+	
+	stream[stream_length++] = 0x7E;
+	stream[stream_length++] = (length + 1) >> 8;
+	stream[stream_length++] = (length + 1) & 0xFF;
+	stream[stream_length++] = api_id;
+	
+	for( uint16_t i=0; i<length; i++ ){
+		stream[stream_length++] = data[i];
+		sum += data[i];
+	}
+	
+	stream[stream_length++] = 0xFF - sum;
+}
+
+/**
+*	Record message
+*
+*	Appends a 16-bit RX frame carrying a payload of the given length.
+*/
+static void record_msg(uint8_t payload_length){
+	uint8_t data[4 + MSG_MAX_LENGTH] = { 0x00, 0x02, 40, 0x00 };	//source, rssi, options
+	
+	for( uint8_t i=0; i<payload_length; i++ ){
+		data[4 + i] = (uint8_t)(frames_expected * 7 + i);
+		payload_sum_expected += data[4 + i];
+	}
+	
+	record_frame(API_ID_MSG_16, data, 4 + payload_length);
+	frames_expected++;
+}
+
+static void msg_received(Message* msg){
+	for( uint8_t i=0; i<msg->data_length; i++ )
+		payload_sum += msg->data[i];
+	
+	frames_delivered++;
+	xbee_msg_pool_release(msg);
+}
+
+static void msg_responded(XbeeStatus status, uint8_t msg_id){
+	frames_delivered++;
+}
+
+static void at_command_responded(XbeeATCommandResponse* response){}
+
+/**
+*	Run
+*
+*	Feeds the stream ROUNDS times, and checks every frame came through.
+*
+*	@param per_byte whether xbee_process_rx is called per byte received
+*	(as per interrupt), or once the whole stream is in
+*	@param label what's printed with the times
+*
+*	@return true if every frame was delivered intact
+*/
+static bool run(bool per_byte, const char* label){
+	struct timespec start, end;
+	XbeeStats before, after;
+	
+	frames_delivered = 0;
+	payload_sum = 0;
+	xbee_get_stats(&before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	for( uint32_t r=0; r<ROUNDS; r++ ){
+		read_at = 0;
+		
+		if( per_byte ){
+			for( received=1; received<=stream_length; received++ )
+				xbee_process_rx();
+		}
+		else{
+			received = stream_length;
+			xbee_process_rx();
+		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	xbee_get_stats(&after);
+	
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	uint32_t frames = after.rx_frames - before.rx_frames;
+	uint32_t errors = (after.rx_checksum_errors - before.rx_checksum_errors) + (after.rx_length_errors - before.rx_length_errors);
+	uint32_t dropped = after.rx_msgs_dropped - before.rx_msgs_dropped;
+	
+	printf("%-10s %8.2f ns/byte %8.1f ns/frame\n", label, ns / ((double)stream_length * ROUNDS), ns / ((double)frames_expected * ROUNDS));
+	
+	if( frames_delivered != frames_expected * ROUNDS || payload_sum != payload_sum_expected * ROUNDS ||
+		frames != frames_expected * ROUNDS || errors || dropped ){
+		printf("FAIL: %u frames delivered (payload sum %u, expected %u), %u checksum or length errors, %u messages dropped\n",
+			frames_delivered, payload_sum, payload_sum_expected * ROUNDS, errors, dropped);
+		return false;
+	}
+	
+	return true;
+}
+
+int main(void){
+	static const uint8_t lengths[] = { 4, 16, 32, 64, MSG_MAX_LENGTH };
+	const uint8_t response[] = { 1, 0 };	//frame ID, status
+	
+	xbee_register_msg_received_callback(msg_received);
+	xbee_register_msg_responded_callback(msg_responded);
+	xbee_register_at_command_responded_callback(at_command_responded);
+	
+	while( stream_length + 2 * (MSG_MAX_LENGTH + 10) < STREAM_MAX_LENGTH ){
+		record_msg( lengths[frames_expected % sizeof(lengths)] );
+		record_frame(API_ID_MSG_RESPONSE, response, sizeof(response));
+		frames_expected++;
+	}
+	
+	printf("%zu-byte stream of %u frames, %u rounds (host time, not target cycles)\n", stream_length, frames_expected, ROUNDS);
+	
+	if( !run(true, "per byte") || !run(false, "chunked") )
+		return 1;
+	
+	return 0;
+}
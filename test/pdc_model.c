@@ -0,0 +1,250 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	pdc_model.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief PDC reception test (host), XBEE_UART_RX_PDC.
+ *
+ * Models the USART receiver and its PDC channel: characters land in RHR and
+ * the PDC moves them to the buffer RPR points to, switching to the next
+ * buffer (RNPR) when RCR runs out and raising ENDRX; once both are full it
+ * stops, and a second character arriving before RHR is read raises OVRE.
+ * TIMEOUT is raised when the line goes idle after a character, until the
+ * handler restarts the time-out. First bursts of random length, some with an
+ * idle line after them and some not, must come through intact and in order.
+ * Then the handler is held off while more than two buffers' worth arrives:
+ * the bytes lost must be marked as a receive error, right where they were
+ * lost, and reception must go on in order after that.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "asf.h"
+#include "xbee/xbee_uart.h"
+
+#define BURSTS				20000	///< Bursts sent in the first phase
+#define BURST_MAX_LENGTH	80
+#define PDC_BUFFER_SIZE		32		///< RX_PDC_BUFFER_SIZE
+#define STALL_EXTRA			5		///< Characters arriving after both PDC buffers are full (all but the last are lost)
+#define RX_INTERRUPTS		(US_CSR_ENDRX | US_CSR_TIMEOUT | US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE)
+
+void USART1_Handler(void);
+
+static bool timeout_armed = true;		///< (xbee_uart_enable_interrupt starts the time-out)
+static bool timeout_running = false;	///< a character was received since the time-out was started
+static bool interrupts_held = false;
+
+static uint32_t sent = 0;				///< bytes sent (byte i is (uint8_t)i)
+static uint32_t position = 0;			///< bytes read
+static uint32_t callbacks = 0;
+
+static void data_received(void){
+	callbacks++;
+}
+
+/**
+*	PDC transfer
+*
+*	What the PDC does on its own: loads the next buffer once the current one
+*	is done, and takes the character in RHR if there's room for it.
+*/
+static void pdc_transfer(void){
+	Pdc* pdc = &host_usart1_pdc;
+	
+	if( !(pdc->PERIPH_PTCR & PERIPH_PTCR_RXTEN) )
+		return;
+	
+	if( pdc->PERIPH_RCR == 0 && pdc->PERIPH_RNCR != 0 ){
+		pdc->PERIPH_RPR = pdc->PERIPH_RNPR;
+		pdc->PERIPH_RCR = pdc->PERIPH_RNCR;
+		pdc->PERIPH_RNCR = 0;
+	}
+	
+	if( pdc->PERIPH_RCR != 0 && (host_usart1.US_CSR & US_CSR_RXRDY) ){
+		*(uint8_t*)host_pdc_buffer(pdc->PERIPH_RPR) = host_usart1.US_RHR;
+		pdc->PERIPH_RPR++;
+		host_usart1.US_CSR &= ~US_CSR_RXRDY;
+		
+		if( --pdc->PERIPH_RCR == 0 ){
+			host_usart1.US_CSR |= US_CSR_ENDRX;
+			pdc_transfer();
+		}
+	}
+}
+
+/**
+*	Interrupt
+*
+*	Runs USART1_Handler if a receive interrupt is pending (and not held off).
+*/
+static void interrupt(void){
+	if( interrupts_held || !(host_usart1.US_CSR & host_usart1.US_IMR & RX_INTERRUPTS) )
+		return;
+	
+	bool timeout = host_usart1.US_CSR & US_CSR_TIMEOUT;
+	
+	host_irq_run(USART1_Handler);
+	
+	//writing RNCR clears ENDRX, starting the time-out clears TIMEOUT
+	if( host_usart1_pdc.PERIPH_RNCR != 0 )
+		host_usart1.US_CSR &= ~US_CSR_ENDRX;
+	if( timeout && !(host_usart1.US_CSR & US_CSR_TIMEOUT) )
+		timeout_armed = true;
+	
+	pdc_transfer();
+}
+
+static void line_receive(uint8_t c){
+	if( host_usart1.US_CSR & US_CSR_RXRDY )
+		host_usart1.US_CSR |= US_CSR_OVRE;
+	
+	host_usart1.US_RHR = c;
+	host_usart1.US_CSR |= US_CSR_RXRDY;
+	pdc_transfer();
+	
+	if( timeout_armed )
+		timeout_running = true;
+	
+	interrupt();
+}
+
+static void line_idle(void){
+	if( timeout_running ){
+		timeout_running = false;
+		timeout_armed = false;
+		host_usart1.US_CSR |= US_CSR_TIMEOUT;
+		interrupt();
+	}
+}
+
+/**
+*	Read all
+*
+*	Reads everything received so far, checking it's the stream sent.
+*
+*	@param expected next byte expected
+*	@param error_at where a receive error is expected (-1 for none)
+*	@param resume_at byte expected after the receive error
+*
+*	@return the next byte expected, or -1 on failure
+*/
+static int64_t read_all(uint32_t expected, int64_t error_at, uint32_t resume_at){
+	uint8_t buf[64];
+	size_t n;
+	
+	do{
+		if( xbee_uart_take_rx_error() ){
+			if( position != error_at ){
+				printf("FAIL: receive error marked at %u, expected at %lld\n", position, (long long)error_at);
+				return -1;
+			}
+			expected = resume_at;
+			error_at = -1;
+		}
+		
+		n = xbee_uart_read( buf, 1 + rand() % sizeof(buf) );
+		
+		for( size_t i=0; i<n; i++, position++, expected++ ){
+			if( buf[i] != (uint8_t)expected ){
+				printf("FAIL: byte %u is 0x%02X, expected 0x%02X\n", position, buf[i], (uint8_t)expected);
+				return -1;
+			}
+		}
+	}while( n > 0 );
+	
+	if( error_at >= 0 ){
+		printf("FAIL: no receive error marked at %lld\n", (long long)error_at);
+		return -1;
+	}
+	
+	return expected;
+}
+
+int main(void){
+	XbeeUartStats stats;
+	int64_t expected = 0;
+	
+	xbee_uart_register_callback(data_received);
+	xbee_uart_enable_interrupt();
+	
+	//bursts, the line going idle after most of them
+	for( uint32_t b=0; b<BURSTS && expected >= 0; b++ ){
+		uint32_t length = 1 + rand() % BURST_MAX_LENGTH;
+		
+		for( uint32_t i=0; i<length; i++ )
+			line_receive( (uint8_t)sent++ );
+		
+		if( rand() % 4 != 0 )
+			line_idle();
+		
+		expected = read_all(expected, -1, 0);
+	}
+	
+	line_idle();
+	expected = read_all(expected, -1, 0);
+	xbee_uart_get_stats(&stats);
+	
+	printf("bursts: %u bytes sent, %u read in %u chunks, %u overruns\n", sent, position, callbacks, stats.rx_overruns);
+	
+	if( expected < 0 )
+		return 1;
+	if( position != sent || stats.rx_overruns != 0 ){
+		printf("FAIL: bytes were lost\n");
+		return 1;
+	}
+	
+	//handler held off while both buffers fill up and then some
+	uint32_t stall_start = position;
+	
+	line_idle();
+	interrupts_held = true;
+	for( uint32_t i=0; i<2 * PDC_BUFFER_SIZE + STALL_EXTRA; i++ )
+		line_receive( (uint8_t)sent++ );
+	
+	interrupts_held = false;
+	interrupt();
+	
+	for( uint32_t i=0; i<2 * PDC_BUFFER_SIZE; i++ )
+		line_receive( (uint8_t)sent++ );
+	
+	line_idle();
+	
+	//the last character held in RHR survives, the ones before it are lost
+	expected = read_all(expected, stall_start + 2 * PDC_BUFFER_SIZE, expected + 2 * PDC_BUFFER_SIZE + STALL_EXTRA - 1);
+	xbee_uart_get_stats(&stats);
+	
+	printf("stall: %u bytes sent, %u read, %u overruns\n", sent, position, stats.rx_overruns);
+	
+	if( expected < 0 )
+		return 1;
+	if( position != sent - (STALL_EXTRA - 1) || stats.rx_overruns == 0 ){
+		printf("FAIL: %u bytes lost, %u expected\n", sent - position, STALL_EXTRA - 1);
+		return 1;
+	}
+	
+	printf("ok\n");
+	
+	return 0;
+}
@@ -0,0 +1,189 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	ring_stress.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief Receive ring stress test (host).
+ *
+ * A producer thread plays the USART: it feeds a counting byte stream to
+ * USART1_Handler, one RXRDY interrupt per byte. A consumer thread reads it
+ * back with xbee_uart_read, in chunks of random length. First the producer
+ * is paced so the ring never fills, and every byte must come back in order.
+ * Then it runs flat out and the consumer stalls now and then: bytes are lost,
+ * and every gap in the stream must be at a position where bytes were lost,
+ * the last loss must be marked as a receive error, and bytes read plus bytes
+ * lost must add up to bytes sent.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "asf.h"
+#include "xbee/xbee_uart.h"
+
+#define STREAM_LENGTH	2000000		///< Bytes sent per phase
+#define PACED_LEVEL		128			///< Ring level the paced producer waits below
+#define MAX_LOSSES		STREAM_LENGTH
+
+void USART1_Handler(void);
+
+static volatile bool paced;
+static volatile bool producer_done;
+static uint32_t loss_at[MAX_LOSSES];		///< stream positions (bytes accepted before) where bytes were lost
+static uint32_t n_losses;					///< (published with release/acquire)
+
+static void data_received(void){}
+
+static void* producer(void* arg){
+	uint32_t overruns = 0;
+	uint32_t accepted = 0;
+	
+	for( uint32_t i=0; i<STREAM_LENGTH; i++ ){
+		while( paced && xbee_uart_available() >= PACED_LEVEL )
+			sched_yield();
+		
+		host_usart1.US_RHR = (uint8_t)i;
+		host_usart1.US_CSR |= US_CSR_RXRDY;
+		host_irq_run(USART1_Handler);
+		
+		XbeeUartStats stats;
+		xbee_uart_get_stats(&stats);
+		
+		if( stats.rx_ring_overruns != overruns ){
+			uint32_t n = __atomic_load_n(&n_losses, __ATOMIC_RELAXED);
+			
+			overruns = stats.rx_ring_overruns;
+			if( n == 0 || loss_at[n - 1] != accepted ){
+				loss_at[n] = accepted;
+				__atomic_store_n(&n_losses, n + 1, __ATOMIC_RELEASE);
+			}
+		}
+		else{
+			accepted++;
+		}
+	}
+	
+	producer_done = true;
+	
+	return NULL;
+}
+
+static bool was_lost_at(uint32_t position){
+	uint32_t n = __atomic_load_n(&n_losses, __ATOMIC_ACQUIRE);
+	
+	for( uint32_t i=n; i>0; i-- )
+		if( loss_at[i - 1] == position )
+			return true;
+	
+	return false;
+}
+
+static int run_phase(bool pace){
+	static uint32_t bytes_read_before = 0, overruns_before = 0;
+	uint8_t buf[64];
+	uint32_t position = 0;			///< bytes read this phase
+	uint32_t gaps = 0, marks = 0, last_mark = 0;
+	bool have_expected = false;
+	uint8_t expected = 0;
+	pthread_t thread;
+	
+	paced = pace;
+	producer_done = false;
+	n_losses = 0;
+	pthread_create(&thread, NULL, producer, NULL);
+	
+	while( !producer_done || xbee_uart_available() > 0 ){
+		if( xbee_uart_take_rx_error() ){
+			if( !was_lost_at(position) ){
+				printf("FAIL: receive error marked at %u, where nothing was lost\n", position);
+				return 1;
+			}
+			marks++;
+			last_mark = position;
+		}
+		
+		size_t n = xbee_uart_read( buf, 1 + rand() % sizeof(buf) );
+		
+		for( size_t i=0; i<n; i++, position++ ){
+			if( have_expected && buf[i] != expected ){
+				if( !was_lost_at(position) ){
+					printf("FAIL: byte %u is 0x%02X, expected 0x%02X, and nothing was lost there\n", position, buf[i], expected);
+					return 1;
+				}
+				gaps++;
+			}
+			expected = buf[i] + 1;
+			have_expected = true;
+		}
+		
+		//stall now and then (the producer outruns the ring)
+		if( !pace && rand() % 64 == 0 )
+			usleep(200);
+	}
+	
+	pthread_join(thread, NULL);
+	
+	//(bytes lost at the very end are marked where the stream ends)
+	if( xbee_uart_take_rx_error() ){
+		marks++;
+		last_mark = position;
+	}
+	
+	XbeeUartStats stats;
+	xbee_uart_get_stats(&stats);
+	uint32_t overruns = stats.rx_ring_overruns - overruns_before;
+	
+	printf("%s: %u bytes read, %u lost (%u runs), %u gaps, %u receive errors, high water %u\n",
+		pace ? "paced" : "flat out", position, overruns, n_losses, gaps, marks, stats.rx_ring_high_water);
+	
+	if( position + overruns != STREAM_LENGTH || stats.rx_bytes - bytes_read_before != STREAM_LENGTH ){
+		printf("FAIL: bytes read and lost don't add up to bytes sent\n");
+		return 1;
+	}
+	if( pace && (overruns != 0 || marks != 0) ){
+		printf("FAIL: bytes lost although the ring never filled up\n");
+		return 1;
+	}
+	if( overruns > 0 && (marks == 0 || last_mark != loss_at[n_losses - 1]) ){
+		printf("FAIL: the last loss wasn't marked as a receive error\n");
+		return 1;
+	}
+	
+	bytes_read_before = stats.rx_bytes;
+	overruns_before = stats.rx_ring_overruns;
+	
+	return 0;
+}
+
+int main(void){
+	xbee_uart_register_callback(data_received);
+	xbee_uart_enable_interrupt();
+	
+	if( run_phase(true) || run_phase(false) )
+		return 1;
+	
+	printf("ok\n");
+	
+	return 0;
+}
@@ -0,0 +1,109 @@
+/**
+* Copyright 2015 Rafael Roman Otero.
+*
+* This file is part of Xbee MAC Interface.
+*
+* Xbee MAC Interface is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/**
+ * @file	sum_bench.c
+ * @author  Rafael Roman Otero
+ * @version 1.0
+ *
+ * @brief xbee_cpu_sum benchmark (host).
+ *
+ * Checks xbee_cpu_sum against a byte loop for every alignment and for
+ * lengths up to CHECK_MAX_LENGTH (random bytes, and all 0xFF so the lanes
+ * are pushed to overflow), then times both on 100-byte payloads (the
+ * longest message), aligned and not. The host builds the portable
+ * (two-lane) version; the Cortex-M4 one uses USADA8 instead.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "xbee/xbee_cpu.h"
+
+#define PAYLOAD_LENGTH		100			///< Bytes summed per call when timing (MSG_MAX_LENGTH)
+#define CHECK_MAX_LENGTH	2048		///< Longest run checked
+#define CALLS				2000000		///< Calls timed per case
+
+static uint8_t buffer[CHECK_MAX_LENGTH + 4];
+static volatile uint32_t sink;
+
+/**
+*	Byte loop sum
+*
+*	The reference (and what xbee_cpu_sum replaced). Not vectorized, as on
+*	the target.
+*/
+__attribute__((noinline, optimize("no-tree-vectorize")))
+static uint32_t byte_sum(const uint8_t* data, uint32_t length){
+	uint32_t sum = 0;
+	
+	for( uint32_t i=0; i<length; i++ )
+		sum += data[i];
+	
+	return sum;
+}
+
+static bool check(void){
+	for( uint32_t offset=0; offset<4; offset++ ){
+		for( uint32_t length=0; length<=CHECK_MAX_LENGTH; length++ ){
+			if( xbee_cpu_sum(&buffer[offset], length) != byte_sum(&buffer[offset], length) ){
+				printf("FAIL: wrong sum of %u bytes at offset %u\n", length, offset);
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+static double time_ns(uint32_t (*sum)(const uint8_t*, uint32_t), uint32_t offset){
+	struct timespec start, end;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	for( uint32_t i=0; i<CALLS; i++ )
+		sink = (*sum)(&buffer[offset + (i & 1) * 4], PAYLOAD_LENGTH);
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / CALLS;
+}
+
+int main(void){
+	for( uint32_t i=0; i<sizeof(buffer); i++ )
+		buffer[i] = rand();
+	
+	if( !check() )
+		return 1;
+	
+	for( uint32_t i=0; i<sizeof(buffer); i++ )
+		buffer[i] = 0xFF;
+	
+	if( !check() )
+		return 1;
+	
+	printf("ns per %u-byte sum\toffset 0\toffset 1\n", PAYLOAD_LENGTH);
+	printf("byte loop\t\t%8.1f\t%8.1f\n", time_ns(byte_sum, 0), time_ns(byte_sum, 1));
+	printf("xbee_cpu_sum\t\t%8.1f\t%8.1f\n", time_ns(xbee_cpu_sum, 0), time_ns(xbee_cpu_sum, 1));
+	
+	return 0;
+}